@@ -0,0 +1,484 @@
+#include "atlas.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jpeglib.h>
+#include <jansson.h>
+
+#include "batch.h"
+#include "jcanvas.h"
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+__attribute__((format(printf, 2, 3)))
+static void atlas_set_error(struct atlas *self, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(self->errmsg, sizeof(self->errmsg), fmt, ap);
+	va_end(ap);
+}
+
+const char *atlas_get_error(struct atlas *self)
+{
+	if U (!self)
+		return "out of memory";
+
+	return self->errmsg;
+}
+
+struct atlas *atlas_new(const struct atlas_opts *opts)
+{
+	struct atlas *self;
+
+	if U (!(self = calloc(1, sizeof(*self))))
+		return NULL;
+
+	self->opts = *opts;
+
+	return self;
+}
+
+void atlas_free(struct atlas *self)
+{
+	if U (!self)
+		return;
+
+	for (size_t i = 0; i < self->items_cnt; i++)
+		free(self->items[i].path);
+	free(self->items);
+	free(self->pages);
+	jc_free(self->probe);
+	free(self);
+}
+
+// the images are added to a canvas that's never saved, with a memory budget
+// that only lets it read their headers. that also checks that they can all
+// go on the same canvas
+bool atlas_add_image(struct atlas *self, const char *path)
+{
+	struct jc_info_struct info;
+	struct atlas_item *item;
+	int idx;
+
+	if U (!self)
+		return false;
+
+	if (!self->probe) {
+		if U (!(self->probe = jc_new("/dev/null", 1, 1))) {
+			atlas_set_error(self, "jc_new failed");
+			return false;
+		}
+		jc_set_memory_budget(self->probe, 1);
+	}
+
+	if U ((idx = jc_add_image(self->probe, path)) == -1 ||
+	      !jc_get_info(self->probe, idx, &info)) {
+		atlas_set_error(self, "%s", jc_get_error(self->probe));
+		return false;
+	}
+
+	if (self->items_cnt == self->items_cap) {
+		size_t newcap = (self->items_cap) ? self->items_cap*2 : 64;
+		struct atlas_item *newitems;
+
+		newitems = reallocarray(self->items, newcap, sizeof(*self->items));
+		if U (!newitems)
+			goto oom;
+
+		self->items = newitems;
+		self->items_cap = newcap;
+	}
+
+	item = &self->items[self->items_cnt];
+	memset(item, 0, sizeof(*item));
+
+	if U (!(item->path = strdup(path)))
+		goto oom;
+	item->width = info.width;
+	item->height = info.height;
+	item->data_width = info.data_width;
+	item->data_height = info.data_height;
+
+	self->block_width = info.block_width;
+	self->block_height = info.block_height;
+	self->items_cnt++;
+
+	return true;
+oom:
+	atlas_set_error(self, "out of memory");
+	return false;
+}
+
+// -----------------------------------------------------------------------------
+
+// tallest first, then widest, then in the order they were added
+static int atlas_compare_items(const void *p1, const void *p2)
+{
+	const struct atlas_item *a = *(struct atlas_item *const *)p1;
+	const struct atlas_item *b = *(struct atlas_item *const *)p2;
+
+	if (a->data_height != b->data_height)
+		return (a->data_height > b->data_height) ? -1 : 1;
+	if (a->data_width != b->data_width)
+		return (a->data_width > b->data_width) ? -1 : 1;
+
+	return (a < b) ? -1 : 1;
+}
+
+struct atlas_shelf {
+	unsigned page;
+	unsigned y;
+	unsigned height;
+	unsigned used;
+};
+
+// first fit decreasing height: each image goes on the first shelf (on any
+// page) that has room for it. if none does, a new shelf is started on the
+// first page that has room for one, or on a new page
+bool atlas_pack(struct atlas *self)
+{
+	struct atlas_shelf *shelves = NULL;
+	size_t shelves_cnt = 0;
+	struct atlas_item **order = NULL;
+	unsigned maxw, maxh;
+
+	if U (!self)
+		return false;
+	if U (self->items_cnt == 0) {
+		atlas_set_error(self, "no images added");
+		return false;
+	}
+
+	maxw = (self->opts.max_width) ? self->opts.max_width : JPEG_MAX_DIMENSION;
+	maxh = (self->opts.max_height) ? self->opts.max_height : JPEG_MAX_DIMENSION;
+	maxw -= maxw%self->block_width;
+	maxh -= maxh%self->block_height;
+
+	free(self->pages);
+	self->pages = NULL;
+	self->pages_cnt = 0;
+
+	// (at most one shelf and one page per image)
+	if U (!(order = malloc(self->items_cnt*sizeof(*order))) ||
+	      !(shelves = malloc(self->items_cnt*sizeof(*shelves))) ||
+	      !(self->pages = calloc(self->items_cnt, sizeof(*self->pages)))) {
+		atlas_set_error(self, "out of memory");
+		goto err;
+	}
+
+	for (size_t i = 0; i < self->items_cnt; i++)
+		order[i] = &self->items[i];
+	qsort(order, self->items_cnt, sizeof(*order), atlas_compare_items);
+
+	for (size_t i = 0; i < self->items_cnt; i++) {
+		struct atlas_item *item = order[i];
+		struct atlas_shelf *shelf = NULL;
+		struct atlas_page *page;
+
+		if U (item->data_width > maxw || item->data_height > maxh) {
+			atlas_set_error(self, "%s: image is bigger than the page size (%ux%u)",
+			    item->path, maxw, maxh);
+			goto err;
+		}
+
+		for (size_t s = 0; s < shelves_cnt; s++) {
+			if (item->data_height <= shelves[s].height &&
+			    item->data_width <= maxw-shelves[s].used) {
+				shelf = &shelves[s];
+				break;
+			}
+		}
+
+		if (!shelf) {
+			size_t p;
+
+			for (p = 0; p < self->pages_cnt; p++)
+				if (item->data_height <= maxh-self->pages[p].height)
+					break;
+			if (p == self->pages_cnt)
+				self->pages_cnt++;
+
+			shelf = &shelves[shelves_cnt++];
+			shelf->page = p;
+			shelf->y = self->pages[p].height;
+			shelf->height = item->data_height;
+			shelf->used = 0;
+
+			self->pages[p].height += item->data_height;
+		}
+
+		item->page = shelf->page;
+		item->x = shelf->used;
+		item->y = shelf->y;
+		shelf->used += item->data_width;
+
+		page = &self->pages[shelf->page];
+		page->width = MAX(page->width, shelf->used);
+		page->items_cnt++;
+	}
+
+	free(shelves);
+	free(order);
+
+	return true;
+err:
+	free(shelves);
+	free(order);
+	free(self->pages);
+	self->pages = NULL;
+	self->pages_cnt = 0;
+	return false;
+}
+
+// -----------------------------------------------------------------------------
+
+bool atlas_write_page(struct atlas *self, unsigned page, const char *outpath)
+{
+	struct jc *jc;
+
+	if U (!self)
+		return false;
+	if U (page >= self->pages_cnt) {
+		atlas_set_error(self, "no page %u", page);
+		return false;
+	}
+
+	if U (!(jc = jc_new(outpath, self->pages[page].width, self->pages[page].height))) {
+		atlas_set_error(self, "%s: %s", outpath, strerror(errno));
+		return false;
+	}
+
+	if (self->opts.memory_budget)
+		jc_set_memory_budget(jc, self->opts.memory_budget);
+
+	// the images are decoded in the background while the rest is set up
+	for (size_t i = 0; i < self->items_cnt; i++) {
+		if (self->items[i].page != page)
+			continue;
+		if U (jc_add_image_async(jc, self->items[i].path) == -1)
+			goto err;
+	}
+
+	// gaps between the images first, then the images in the order they
+	// were added to the canvas
+	if U (!jc_drawimage(jc, JC_BLANK, 0, 0, 0, 0, -1, -1))
+		goto err;
+
+	for (size_t i = 0, idx = 0; i < self->items_cnt; i++) {
+		struct atlas_item *item = &self->items[i];
+
+		if (item->page != page)
+			continue;
+		if U (!jc_drawimage(jc, idx++, item->x, item->y, 0, 0,
+		    item->data_width, item->data_height))
+			goto err;
+	}
+
+	if U (!jc_save(jc))
+		goto err;
+
+	jc_free(jc);
+
+	return true;
+err:
+	atlas_set_error(self, "%s", jc_get_error(jc));
+	jc_free(jc);
+	return false;
+}
+
+// -----------------------------------------------------------------------------
+
+#define sscanf2_full(s, fmt, p1, p2) \
+	({ int n_; (sscanf((s), (fmt "%n"), (p1), (p2), &n_) == 2 && (s)[n_] == '\0'); })
+
+static int compare_batch_items_path(const void *p1, const void *p2)
+{
+	const struct batch_item *a = p1;
+	const struct batch_item *b = p2;
+
+	return strcmp(a->path, b->path);
+}
+
+static json_t *atlas_index_json(struct atlas *self, char **pagepaths)
+{
+	json_t *root, *pages, *images;
+
+	root = json_object();
+	pages = json_array();
+	images = json_array();
+
+	json_object_set_new(root, "block_width", json_integer(self->block_width));
+	json_object_set_new(root, "block_height", json_integer(self->block_height));
+
+	for (size_t p = 0; p < self->pages_cnt; p++) {
+		json_array_append_new(pages, json_pack("{s:s, s:I, s:I}",
+		    "path", pagepaths[p],
+		    "width", (json_int_t)self->pages[p].width,
+		    "height", (json_int_t)self->pages[p].height));
+	}
+
+	for (size_t i = 0; i < self->items_cnt; i++) {
+		struct atlas_item *item = &self->items[i];
+
+		json_array_append_new(images, json_pack("{s:s, s:I, s:I, s:I, s:I, s:I}",
+		    "path", item->path,
+		    "page", (json_int_t)item->page,
+		    "x", (json_int_t)item->x,
+		    "y", (json_int_t)item->y,
+		    "width", (json_int_t)item->width,
+		    "height", (json_int_t)item->height));
+	}
+
+	json_object_set_new(root, "pages", pages);
+	json_object_set_new(root, "images", images);
+
+	return root;
+}
+
+__attribute__((weak))
+int main(int argc, char **argv)
+{
+	struct atlas_opts opts = {
+		.max_width = 4096,
+		.max_height = 4096,
+		.memory_budget = 256<<20,
+	};
+	struct batch batch = {0};
+	struct atlas *atlas = NULL;
+	char **pagepaths = NULL;
+	const char *prefix;
+	bool list0 = false;
+	json_t *index;
+	char *path;
+	int rv = 1;
+
+	while (argc > 1) {
+		if (argv[1][0] != '-') break;
+		else if (strcmp(argv[1], "-0") == 0) list0 = true;
+		else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+			if (!sscanf2_full(argv[2], "%ux%u", &opts.max_width, &opts.max_height)) {
+				fprintf(stderr, "atlas: failed to parse dimensions from \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "-m") == 0 && argc > 2) {
+			char *end;
+			unsigned long n = strtoul(argv[2], &end, 10);
+
+			if (end == argv[2] || *end != '\0') {
+				fprintf(stderr, "atlas: bad memory budget \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			opts.memory_budget = (size_t)n<<20;
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "--") == 0) {
+			argc--;
+			argv++;
+			break;
+		}
+		else {
+			fprintf(stderr, "atlas: unknown option \"%s\"\n", argv[1]);
+			goto usage;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (argc < 2 || (argc < 3 && !list0)) {
+usage:
+		fprintf(stderr,
+		    "usage: atlas [options] <outprefix> [path...]\n"
+		    "writes <outprefix>_N.jpg and an index of where each image went\n"
+		    "to <outprefix>.json\n"
+		    "options:\n"
+		    "    -s WIDTHxHEIGHT  maximum page size (default: 4096x4096, 0 = no limit)\n"
+		    "    -m MIB           memory for the source images per page (default: 256,\n"
+		    "                     0 = no limit)\n"
+		    "    -0               read a NUL-separated list of paths from stdin\n"
+		    "directories are searched recursively for .jpg and .jpeg files\n"
+		    );
+		return 1;
+	}
+
+	prefix = argv[1];
+
+	for (int i = 2; i < argc; i++)
+		if (!batch_add_path(&batch, argv[i]))
+			goto out;
+	if (list0 && !batch_add_list0(&batch, stdin))
+		goto out;
+	if (batch.items_cnt == 0) {
+		fprintf(stderr, "atlas: no images\n");
+		goto out;
+	}
+	qsort(batch.items, batch.items_cnt, sizeof(*batch.items), compare_batch_items_path);
+
+	if (!(atlas = atlas_new(&opts))) {
+		fprintf(stderr, "atlas: out of memory\n");
+		goto out;
+	}
+	for (size_t i = 0; i < batch.items_cnt; i++) {
+		if (!atlas_add_image(atlas, batch.items[i].path)) {
+			fprintf(stderr, "atlas: %s\n", atlas_get_error(atlas));
+			goto out;
+		}
+	}
+	if (!atlas_pack(atlas)) {
+		fprintf(stderr, "atlas: %s\n", atlas_get_error(atlas));
+		goto out;
+	}
+
+	if (!(pagepaths = calloc(atlas->pages_cnt, sizeof(*pagepaths)))) {
+		fprintf(stderr, "atlas: out of memory\n");
+		goto out;
+	}
+	for (size_t p = 0; p < atlas->pages_cnt; p++) {
+		if (!(pagepaths[p] = malloc(strlen(prefix)+32))) {
+			fprintf(stderr, "atlas: out of memory\n");
+			goto out;
+		}
+		sprintf(pagepaths[p], "%s_%zu.jpg", prefix, p);
+		if (!atlas_write_page(atlas, p, pagepaths[p])) {
+			fprintf(stderr, "atlas: %s\n", atlas_get_error(atlas));
+			goto out;
+		}
+	}
+
+	if (!(path = malloc(strlen(prefix)+sizeof(".json")))) {
+		fprintf(stderr, "atlas: out of memory\n");
+		goto out;
+	}
+	sprintf(path, "%s.json", prefix);
+	index = atlas_index_json(atlas, pagepaths);
+	if (json_dump_file(index, path, JSON_INDENT(1)) == -1)
+		fprintf(stderr, "atlas: %s: couldn't write the index\n", path);
+	else
+		rv = 0;
+	json_decref(index);
+	free(path);
+
+	fprintf(stderr, "atlas: %zu images on %zu pages\n", atlas->items_cnt, atlas->pages_cnt);
+out:
+	if (pagepaths)
+		for (size_t p = 0; p < atlas->pages_cnt; p++)
+			free(pagepaths[p]);
+	free(pagepaths);
+	atlas_free(atlas);
+	batch_free(&batch);
+
+	return rv;
+}
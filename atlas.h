@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// packs many jpgs into a few big ones using jcanvas (no re-encoding)
+// the images have to be compatible (see jc_add_image)
+
+struct atlas_opts {
+	unsigned max_width; // page size limit, rounded down to the block size
+	unsigned max_height; // (0 = as big as a jpg can be)
+	size_t memory_budget; // for each page, see jc_set_memory_budget
+};
+
+struct atlas_item {
+	char *path;
+	unsigned width;
+	unsigned height;
+	unsigned data_width; // padded to the block size
+	unsigned data_height;
+
+	// set by atlas_pack()
+	unsigned page;
+	unsigned x;
+	unsigned y;
+};
+
+struct atlas_page {
+	unsigned width;
+	unsigned height;
+	unsigned items_cnt;
+};
+
+struct atlas {
+	struct atlas_item *items;
+	size_t items_cnt;
+	struct atlas_page *pages;
+	size_t pages_cnt;
+	unsigned block_width;
+	unsigned block_height;
+	// private
+	struct atlas_opts opts;
+	struct jc *probe;
+	size_t items_cap;
+	char errmsg[256];
+};
+
+struct atlas *atlas_new(const struct atlas_opts *opts);
+// reads the header of the image
+bool atlas_add_image(struct atlas *self, const char *path);
+// decides where everything goes (shelves, tallest images first)
+bool atlas_pack(struct atlas *self);
+// the parts of the page not covered by any image are flat gray
+bool atlas_write_page(struct atlas *self, unsigned page, const char *outpath);
+void atlas_free(struct atlas *self);
+
+// why the last call failed
+const char *atlas_get_error(struct atlas *self);
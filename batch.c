@@ -0,0 +1,314 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+static bool batch_push(struct batch *self, char *path, off_t size)
+{
+	struct batch_item *newitems;
+
+	if (self->items_cnt == self->items_cap) {
+		size_t newcap = (self->items_cap) ? self->items_cap*2 : 64;
+
+		newitems = reallocarray(self->items, newcap, sizeof(*self->items));
+		if U (!newitems)
+			return false;
+
+		self->items = newitems;
+		self->items_cap = newcap;
+	}
+
+	self->items[self->items_cnt].path = path;
+	self->items[self->items_cnt].size = size;
+	self->items_cnt++;
+
+	return true;
+}
+
+static bool has_jpeg_suffix(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+
+	return dot && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0);
+}
+
+static bool batch_add_dir(struct batch *self, const char *path)
+{
+	DIR *d;
+	struct dirent *ent;
+	size_t pathlen = strlen(path);
+	bool rv = true;
+
+	if U (!(d = opendir(path))) {
+		fprintf(stderr, "batch: %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	while ((ent = readdir(d))) {
+		struct stat st;
+		char *sub;
+
+		if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' ||
+		    (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+			continue;
+		if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN &&
+		    !(ent->d_type == DT_REG && has_jpeg_suffix(ent->d_name)))
+			continue;
+
+		if U (!(sub = malloc(pathlen+1+strlen(ent->d_name)+1))) {
+			rv = false;
+			break;
+		}
+		sprintf(sub, "%s%s%s", path, (pathlen && path[pathlen-1] == '/') ? "" : "/", ent->d_name);
+
+		if U (lstat(sub, &st) == -1) {
+			fprintf(stderr, "batch: %s: %s\n", sub, strerror(errno));
+			free(sub);
+			rv = false;
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			rv &= batch_add_dir(self, sub);
+			free(sub);
+		} else if (S_ISREG(st.st_mode) && has_jpeg_suffix(ent->d_name)) {
+			if U (!batch_push(self, sub, st.st_size)) {
+				free(sub);
+				rv = false;
+				break;
+			}
+		} else {
+			free(sub);
+		}
+	}
+
+	closedir(d);
+
+	return rv;
+}
+
+// directories are searched recursively for .jpg/.jpeg files, anything else is
+// added as-is
+bool batch_add_path(struct batch *self, const char *path)
+{
+	struct stat st;
+	char *copy;
+
+	if U (stat(path, &st) == -1) {
+		fprintf(stderr, "batch: %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	if (S_ISDIR(st.st_mode))
+		return batch_add_dir(self, path);
+
+	if U (!(copy = strdup(path)))
+		return false;
+	if U (!batch_push(self, copy, st.st_size)) {
+		free(copy);
+		return false;
+	}
+
+	return true;
+}
+
+// NUL-separated list of paths (find -print0)
+bool batch_add_list0(struct batch *self, FILE *f)
+{
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	bool rv = true;
+
+	while ((len = getdelim(&line, &linecap, '\0', f)) > 0) {
+		if (line[len-1] == '\0')
+			len--;
+		if (len == 0)
+			continue;
+		line[len] = '\0';
+		rv &= batch_add_path(self, line);
+	}
+
+	free(line);
+
+	return rv;
+}
+
+void batch_free(struct batch *self)
+{
+	for (size_t i = 0; i < self->items_cnt; i++)
+		free(self->items[i].path);
+	free(self->items);
+
+	memset(self, 0, sizeof(*self));
+}
+
+// -----------------------------------------------------------------------------
+
+static int batch_compare_size_desc(const void *p1, const void *p2)
+{
+	const struct batch_item *a = p1, *b = p2;
+
+	return (a->size < b->size) - (a->size > b->size);
+}
+
+// biggest files first so that a big one doesn't end up running alone at the end
+void batch_sort_by_size(struct batch *self)
+{
+	qsort(self->items, self->items_cnt, sizeof(*self->items), batch_compare_size_desc);
+}
+
+// -----------------------------------------------------------------------------
+
+// work-stealing: items are dealt out round-robin to one queue per thread.
+// a thread takes from the front of its own queue and steals from the back of
+// the others once it runs out
+
+struct batch_queue {
+	pthread_mutex_t lock;
+	size_t *idx;
+	size_t head;
+	size_t tail;
+};
+
+struct batch_run_state {
+	struct batch *batch;
+	const struct batch_worker *worker;
+	struct batch_queue *queues;
+	int queues_cnt;
+};
+
+struct batch_thread_arg {
+	struct batch_run_state *st;
+	int self;
+};
+
+static bool batch_queue_pop(struct batch_queue *q, bool steal, size_t *idx_out)
+{
+	bool rv = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*idx_out = (steal) ? q->idx[--q->tail] : q->idx[q->head++];
+		rv = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return rv;
+}
+
+static bool batch_next(struct batch_run_state *st, int self, size_t *idx_out)
+{
+	if (batch_queue_pop(&st->queues[self], false, idx_out))
+		return true;
+
+	// nothing gets added while running, so one pass over empty queues means
+	// we're done
+	for (int i = 1; i < st->queues_cnt; i++) {
+		if (batch_queue_pop(&st->queues[(self+i)%st->queues_cnt], true, idx_out))
+			return true;
+	}
+
+	return false;
+}
+
+static void *batch_thread(void *arg)
+{
+	struct batch_thread_arg *ta = arg;
+	struct batch_run_state *st = ta->st;
+	const struct batch_worker *worker = st->worker;
+	void *ctx = NULL;
+	size_t i;
+
+	if (worker->ctx_new && U (!(ctx = worker->ctx_new(worker->arg))))
+		return (void *)1;
+
+	while (batch_next(st, ta->self, &i))
+		worker->fn(ctx, &st->batch->items[i], worker->arg);
+
+	if (worker->ctx_free)
+		worker->ctx_free(ctx);
+
+	return NULL;
+}
+
+int batch_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0) ? n : 1;
+}
+
+bool batch_run(struct batch *self, int nthreads, const struct batch_worker *worker)
+{
+	struct batch_run_state st = {
+		.batch = self,
+		.worker = worker,
+	};
+	struct batch_thread_arg *args = NULL;
+	pthread_t *threads = NULL;
+	size_t *idx = NULL;
+	bool rv = false;
+	int started;
+
+	if (nthreads <= 0)
+		nthreads = batch_default_threads();
+	if ((size_t)nthreads > self->items_cnt)
+		nthreads = (self->items_cnt) ? self->items_cnt : 1;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	args = calloc(nthreads, sizeof(*args));
+	st.queues = calloc(nthreads, sizeof(*st.queues));
+	idx = calloc(self->items_cnt+1, sizeof(*idx));
+	if U (!threads || !args || !st.queues || !idx)
+		goto out;
+	st.queues_cnt = nthreads;
+
+	// queue i gets items i, i+n, i+2n, ... (so each one is sorted too)
+	for (int q = 0, pos = 0; q < nthreads; q++) {
+		pthread_mutex_init(&st.queues[q].lock, NULL);
+		st.queues[q].idx = &idx[pos];
+		for (size_t i = q; i < self->items_cnt; i += nthreads)
+			idx[pos++] = i;
+		st.queues[q].tail = &idx[pos]-st.queues[q].idx;
+	}
+
+	rv = true;
+	for (started = 0; started < nthreads; started++) {
+		args[started].st = &st;
+		args[started].self = started;
+		if U (pthread_create(&threads[started], NULL, batch_thread, &args[started]) != 0) {
+			rv = false;
+			break;
+		}
+	}
+	for (int i = 0; i < started; i++) {
+		void *ret;
+
+		pthread_join(threads[i], &ret);
+		rv &= (ret == NULL);
+	}
+	// if no thread could be started, do the work here
+	if U (started == 0)
+		rv = (batch_thread(&args[0]) == NULL);
+
+	for (int q = 0; q < nthreads; q++)
+		pthread_mutex_destroy(&st.queues[q].lock);
+out:
+	free(idx);
+	free(st.queues);
+	free(args);
+	free(threads);
+
+	return rv;
+}
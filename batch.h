@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// list of files for the batch modes of the command-line tools
+
+struct batch_item {
+	char *path;
+	off_t size;
+};
+
+struct batch {
+	struct batch_item *items;
+	size_t items_cnt;
+	size_t items_cap;
+};
+
+bool batch_add_path(struct batch *self, const char *path);
+bool batch_add_list0(struct batch *self, FILE *f);
+void batch_sort_by_size(struct batch *self);
+void batch_free(struct batch *self);
+
+// calls fn for every item using nthreads threads (work-stealing, roughly in
+// list order). ctx_new/ctx_free are called once per thread to set up
+// per-thread state
+struct batch_worker {
+	void *(*ctx_new)(void *arg);
+	void (*ctx_free)(void *ctx);
+	void (*fn)(void *ctx, struct batch_item *item, void *arg);
+	void *arg;
+};
+
+int batch_default_threads(void);
+bool batch_run(struct batch *self, int nthreads, const struct batch_worker *worker);
@@ -0,0 +1,837 @@
+#include "bio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if WITH_URING
+ #include <liburing.h>
+ #include <sys/eventfd.h>
+#endif
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+#define TMPSUF ".tmp"
+
+// read-ahead limits. one file is always allowed so that big ones still get
+// through
+#define BIO_AHEAD_PER_THREAD 2
+#define BIO_AHEAD_BYTES (64<<20)
+
+// bio_write() blocks once this much is waiting to be written
+#define BIO_WRITE_BYTES (64<<20)
+
+// threads used without io_uring
+#define BIO_READERS 2
+#define BIO_WRITERS 2
+
+enum bio_slot_state {
+	BIO_IDLE, // not started
+	BIO_LOADING, // being read in the background
+	BIO_READY, // read (buf == NULL if it failed, bio_read() retries it)
+	BIO_TAKEN, // handed out or skipped
+};
+
+struct bio_slot {
+	unsigned char *buf;
+	size_t size;
+	unsigned char state;
+};
+
+struct bio_write_req {
+	struct bio_write_req *next;
+	char *path;
+	char *tmppath;
+	unsigned char *buf;
+	size_t size;
+};
+
+struct bio {
+	struct batch *batch;
+	struct bio_slot *slots;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // any state change, waiters recheck
+
+	size_t next_read; // first slot that might still be idle
+	size_t ahead_cnt; // loading or ready slots
+	size_t ahead_bytes;
+	size_t ahead_max;
+
+	struct bio_write_req *wq_head;
+	struct bio_write_req **wq_tail;
+	size_t wq_bytes; // queued, not yet started
+	unsigned writes_pending; // queued or in progress
+	unsigned write_errors;
+
+	bool stop;
+	bool async_writes; // something is there to take the write queue
+
+	pthread_t threads[BIO_READERS+BIO_WRITERS];
+	int threads_cnt;
+
+#if WITH_URING
+	bool uring;
+	struct io_uring ring;
+	int efd;
+#endif
+};
+
+// -----------------------------------------------------------------------------
+
+// the synchronous versions, used by the threads and as a fallback
+
+// errno is set on failure. nothing is printed, bio_read() does that so that
+// a failed read-ahead that gets retried is only reported once
+static bool bio_read_file(const char *path, unsigned char **buf_out, size_t *size_out)
+{
+	unsigned char *buf = NULL;
+	size_t size = 0, cap;
+	struct stat st;
+	int fd, e;
+
+	if U ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		goto fail;
+	if U (fstat(fd, &st) == -1)
+		goto fail;
+
+	// one extra byte to notice if the file grew
+	cap = st.st_size+1;
+	if U (!(buf = malloc(cap)))
+		goto fail;
+
+	for (;;) {
+		ssize_t n = read(fd, buf+size, cap-size);
+
+		if (n == 0)
+			break;
+		if U (n == -1) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		size += n;
+		if (size == cap) {
+			unsigned char *newbuf;
+
+			if U (!(newbuf = realloc(buf, cap*2)))
+				goto fail;
+			buf = newbuf;
+			cap *= 2;
+		}
+	}
+
+	close(fd);
+
+	*buf_out = buf;
+	*size_out = size;
+
+	return true;
+fail:
+	e = errno;
+	if (fd != -1)
+		close(fd);
+	free(buf);
+	errno = e;
+	return false;
+}
+
+static bool bio_write_file(const char *path, const char *tmppath, const unsigned char *buf, size_t size)
+{
+	size_t done = 0;
+	int fd;
+
+	if U ((fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) == -1)
+		goto fail;
+
+	while (done < size) {
+		ssize_t n = write(fd, buf+done, size-done);
+
+		if U (n == -1) {
+			if (errno == EINTR)
+				continue;
+			goto fail_unlink;
+		}
+		done += n;
+	}
+
+	if U (fsync(fd) == -1)
+		goto fail_unlink;
+	if U (close(fd) == -1) {
+		fd = -1;
+		goto fail_unlink;
+	}
+	fd = -1;
+
+	if U (rename(tmppath, path) == -1)
+		goto fail_unlink;
+
+	return true;
+fail_unlink:
+	fprintf(stderr, "batch: %s: %s\n", path, strerror(errno));
+	if (fd != -1)
+		close(fd);
+	unlink(tmppath);
+	return false;
+fail:
+	fprintf(stderr, "batch: %s: %s\n", path, strerror(errno));
+	return false;
+}
+
+static void bio_write_req_free(struct bio_write_req *w)
+{
+	free(w->buf);
+	free(w->path);
+	free(w);
+}
+
+// -----------------------------------------------------------------------------
+
+// read-ahead bookkeeping, called with the lock held
+
+static bool bio_ahead_has_room(struct bio *self)
+{
+	return self->ahead_cnt == 0 ||
+	    (self->ahead_cnt < self->ahead_max && self->ahead_bytes < BIO_AHEAD_BYTES);
+}
+
+// next slot to read ahead, or -1
+static ssize_t bio_ahead_next(struct bio *self)
+{
+	while (self->next_read < self->batch->items_cnt &&
+	    self->slots[self->next_read].state != BIO_IDLE)
+		self->next_read++;
+
+	if (self->next_read == self->batch->items_cnt || !bio_ahead_has_room(self))
+		return -1;
+
+	self->slots[self->next_read].state = BIO_LOADING;
+	self->ahead_cnt++;
+	self->ahead_bytes += self->batch->items[self->next_read].size;
+
+	return self->next_read++;
+}
+
+static void bio_ahead_done(struct bio *self, size_t i, unsigned char *buf, size_t size)
+{
+	self->slots[i].buf = buf;
+	self->slots[i].size = size;
+	self->slots[i].state = BIO_READY;
+	pthread_cond_broadcast(&self->cond);
+}
+
+// the slot is ready and gets taken
+static void bio_ahead_release(struct bio *self, size_t i)
+{
+	self->slots[i].state = BIO_TAKEN;
+	self->slots[i].buf = NULL;
+	self->ahead_cnt--;
+	self->ahead_bytes -= self->batch->items[i].size;
+}
+
+// -----------------------------------------------------------------------------
+
+// thread version
+
+static void *bio_reader_thread(void *arg)
+{
+	struct bio *self = arg;
+
+	pthread_mutex_lock(&self->lock);
+	while (!self->stop) {
+		unsigned char *buf = NULL;
+		size_t size = 0;
+		ssize_t i;
+
+		if ((i = bio_ahead_next(self)) == -1) {
+			if (self->next_read == self->batch->items_cnt)
+				break;
+			pthread_cond_wait(&self->cond, &self->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&self->lock);
+		// bio_read() tries again and reports it
+		if (!bio_read_file(self->batch->items[i].path, &buf, &size))
+			buf = NULL;
+		pthread_mutex_lock(&self->lock);
+
+		bio_ahead_done(self, i, buf, size);
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+static void *bio_writer_thread(void *arg)
+{
+	struct bio *self = arg;
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		struct bio_write_req *w;
+		bool ok;
+
+		if (!(w = self->wq_head)) {
+			if (self->stop)
+				break;
+			pthread_cond_wait(&self->cond, &self->lock);
+			continue;
+		}
+		if (!(self->wq_head = w->next))
+			self->wq_tail = &self->wq_head;
+		self->wq_bytes -= w->size;
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+
+		ok = bio_write_file(w->path, w->tmppath, w->buf, w->size);
+		bio_write_req_free(w);
+
+		pthread_mutex_lock(&self->lock);
+		self->writes_pending--;
+		self->write_errors += !ok;
+		pthread_cond_broadcast(&self->cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+#if WITH_URING
+
+// io_uring version: one thread owns the ring. files are opened into fixed
+// file slots and each file is one linked chain (open, read/write, [fsync],
+// close). renames are submitted once the write chain has succeeded
+// the other threads wake it up through an eventfd that always has a read
+// pending in the ring
+
+#define BIO_URING_ENTRIES 256
+#define BIO_URING_FILES 64
+
+enum bio_op_kind {
+	BIO_OP_WAKE,
+	BIO_OP_READ,
+	BIO_OP_WRITE,
+	BIO_OP_RENAME,
+	BIO_OP_UNLINK,
+};
+
+struct bio_op {
+	enum bio_op_kind kind;
+	int pending; // cqes still to come
+	int err; // first error
+	int file; // fixed file slot
+	size_t idx; // BIO_OP_READ
+	unsigned char *buf; // BIO_OP_READ
+	ssize_t got; // BIO_OP_READ
+	struct bio_write_req *w; // BIO_OP_WRITE/RENAME/UNLINK
+};
+
+// which sqe of a chain a cqe belongs to goes in the low bits of user_data
+#define BIO_STEP_MASK 7
+_Static_assert(_Alignof(struct bio_op) > BIO_STEP_MASK, "bio_op alignment");
+
+struct bio_uring_state {
+	struct bio *self;
+	int free_files[BIO_URING_FILES];
+	int free_files_cnt;
+	unsigned inflight; // ops other than the eventfd read
+	uint64_t wake_buf;
+	struct bio_op wake_op;
+};
+
+static void bio_sqe_set(struct io_uring_sqe *sqe, struct bio_op *op, int step, unsigned flags)
+{
+	io_uring_sqe_set_flags(sqe, flags);
+	io_uring_sqe_set_data(sqe, (void *)((uintptr_t)op|step));
+	op->pending++;
+}
+
+static void bio_uring_arm_wake(struct bio_uring_state *us)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&us->self->ring);
+
+	io_uring_prep_read(sqe, us->self->efd, &us->wake_buf, sizeof(us->wake_buf), 0);
+	bio_sqe_set(sqe, &us->wake_op, 0, 0);
+}
+
+static void bio_uring_start_read(struct bio_uring_state *us, size_t i)
+{
+	struct io_uring *ring = &us->self->ring;
+	struct batch_item *item = &us->self->batch->items[i];
+	struct io_uring_sqe *sqe;
+	struct bio_op *op;
+
+	// can't do it here, leave it to bio_read()
+	if U (!(op = calloc(1, sizeof(*op))) || !(op->buf = malloc(item->size+1))) {
+		free(op);
+		bio_ahead_done(us->self, i, NULL, 0);
+		return;
+	}
+	op->kind = BIO_OP_READ;
+	op->idx = i;
+	op->file = us->free_files[--us->free_files_cnt];
+
+	// hardlinks so that the close always runs
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_openat_direct(sqe, AT_FDCWD, item->path, O_RDONLY, 0, op->file);
+	bio_sqe_set(sqe, op, 0, IOSQE_IO_HARDLINK);
+
+	// one extra byte to notice if the file grew since it was listed
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_read(sqe, op->file, op->buf, item->size+1, 0);
+	bio_sqe_set(sqe, op, 1, IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_close_direct(sqe, op->file);
+	bio_sqe_set(sqe, op, 2, 0);
+
+	us->inflight++;
+}
+
+static void bio_uring_start_write(struct bio_uring_state *us, struct bio_write_req *w)
+{
+	struct io_uring *ring = &us->self->ring;
+	struct io_uring_sqe *sqe;
+	struct bio_op *op;
+
+	if U (!(op = calloc(1, sizeof(*op)))) {
+		bool ok = bio_write_file(w->path, w->tmppath, w->buf, w->size);
+
+		bio_write_req_free(w);
+		us->self->writes_pending--;
+		us->self->write_errors += !ok;
+		pthread_cond_broadcast(&us->self->cond);
+		return;
+	}
+	op->kind = BIO_OP_WRITE;
+	op->w = w;
+	op->file = us->free_files[--us->free_files_cnt];
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_openat_direct(sqe, AT_FDCWD, w->tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0666, op->file);
+	bio_sqe_set(sqe, op, 0, IOSQE_IO_HARDLINK);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_write(sqe, op->file, w->buf, w->size, 0);
+	bio_sqe_set(sqe, op, 1, IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_fsync(sqe, op->file, 0);
+	bio_sqe_set(sqe, op, 2, IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_close_direct(sqe, op->file);
+	bio_sqe_set(sqe, op, 3, 0);
+
+	us->inflight++;
+}
+
+static void bio_uring_finish_write(struct bio_uring_state *us, struct bio_op *op, bool ok)
+{
+	bio_write_req_free(op->w);
+	free(op);
+	us->inflight--;
+
+	us->self->writes_pending--;
+	us->self->write_errors += !ok;
+	pthread_cond_broadcast(&us->self->cond);
+}
+
+// called with the lock held when all cqes of an op have arrived
+static void bio_uring_op_done(struct bio_uring_state *us, struct bio_op *op)
+{
+	struct io_uring *ring = &us->self->ring;
+	struct io_uring_sqe *sqe;
+
+	switch (op->kind) {
+	case BIO_OP_WAKE:
+		break;
+	case BIO_OP_READ:
+		us->free_files[us->free_files_cnt++] = op->file;
+		// failed or the size changed: bio_read() will do it again
+		if U (op->err || (size_t)op->got != (size_t)us->self->batch->items[op->idx].size) {
+			free(op->buf);
+			op->buf = NULL;
+			op->got = 0;
+		}
+		bio_ahead_done(us->self, op->idx, op->buf, op->got);
+		free(op);
+		us->inflight--;
+		break;
+	case BIO_OP_WRITE:
+		us->free_files[us->free_files_cnt++] = op->file;
+		// the sqes for these were reserved by bio_uring_thread()
+		sqe = io_uring_get_sqe(ring);
+		if L (!op->err) {
+			op->kind = BIO_OP_RENAME;
+			io_uring_prep_renameat(sqe, AT_FDCWD, op->w->tmppath, AT_FDCWD, op->w->path, 0);
+		} else {
+			fprintf(stderr, "batch: %s: %s\n", op->w->path, strerror(-op->err));
+			op->kind = BIO_OP_UNLINK;
+			io_uring_prep_unlinkat(sqe, AT_FDCWD, op->w->tmppath, 0);
+		}
+		bio_sqe_set(sqe, op, 0, 0);
+		break;
+	case BIO_OP_RENAME:
+		if L (!op->err) {
+			bio_uring_finish_write(us, op, true);
+			break;
+		}
+		fprintf(stderr, "batch: %s: %s\n", op->w->path, strerror(-op->err));
+		op->kind = BIO_OP_UNLINK;
+		op->err = -EIO; // already reported
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_unlinkat(sqe, AT_FDCWD, op->w->tmppath, 0);
+		bio_sqe_set(sqe, op, 0, 0);
+		break;
+	case BIO_OP_UNLINK:
+		bio_uring_finish_write(us, op, false);
+		break;
+	}
+}
+
+static void bio_uring_cqe(struct bio_uring_state *us, struct io_uring_cqe *cqe)
+{
+	uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+	struct bio_op *op = (struct bio_op *)(data & ~(uintptr_t)BIO_STEP_MASK);
+	int step = data & BIO_STEP_MASK;
+	int res = cqe->res;
+
+	if (op->kind == BIO_OP_WAKE) {
+		op->pending--;
+		if U (res < 0 && res != -EINTR && res != -EAGAIN)
+			fprintf(stderr, "batch: eventfd read: %s\n", strerror(-res));
+		bio_uring_arm_wake(us);
+		return;
+	}
+
+	if (op->kind == BIO_OP_READ && step == 1 && res >= 0)
+		op->got = res;
+	else if (op->kind == BIO_OP_WRITE && step == 1 && res >= 0 && (size_t)res != op->w->size)
+		res = -EIO; // short write
+	// closing an fd that failed to open is not the interesting error
+	if U (res < 0 && !op->err)
+		op->err = res;
+
+	if (--op->pending == 0)
+		bio_uring_op_done(us, op);
+}
+
+// the ring is unusable: let bio_read() redo the reads that were in flight and
+// fail the writes. buffers the kernel may still touch are leaked
+static void bio_uring_give_up(struct bio *self)
+{
+	for (size_t i = 0; i < self->batch->items_cnt; i++)
+		if (self->slots[i].state == BIO_LOADING)
+			bio_ahead_done(self, i, NULL, 0);
+
+	while (self->wq_head) {
+		struct bio_write_req *w = self->wq_head;
+
+		self->wq_head = w->next;
+		fprintf(stderr, "batch: %s: not written\n", w->path);
+		bio_write_req_free(w);
+	}
+	self->wq_tail = &self->wq_head;
+	self->wq_bytes = 0;
+
+	self->write_errors += self->writes_pending;
+	self->writes_pending = 0;
+	self->async_writes = false;
+	pthread_cond_broadcast(&self->cond);
+}
+
+static void *bio_uring_thread(void *arg)
+{
+	struct bio *self = arg;
+	struct bio_uring_state us = {
+		.self = self,
+		.wake_op = {.kind = BIO_OP_WAKE},
+	};
+	struct io_uring *ring = &self->ring;
+
+	for (int i = 0; i < BIO_URING_FILES; i++)
+		us.free_files[us.free_files_cnt++] = BIO_URING_FILES-1-i;
+
+	pthread_mutex_lock(&self->lock);
+	bio_uring_arm_wake(&us);
+
+	for (;;) {
+		struct io_uring_cqe *cqe;
+		int rv;
+
+		if (self->stop && us.inflight == 0 && !self->wq_head)
+			break;
+
+		// writes first, they free up memory. room is kept for the
+		// rename/unlink that follows each write
+		while (self->wq_head && us.free_files_cnt > 0 &&
+		    io_uring_sq_space_left(ring) >= 4+us.inflight+1) {
+			struct bio_write_req *w = self->wq_head;
+
+			if (!(self->wq_head = w->next))
+				self->wq_tail = &self->wq_head;
+			self->wq_bytes -= w->size;
+			pthread_cond_broadcast(&self->cond);
+			bio_uring_start_write(&us, w);
+		}
+		while (!self->stop && us.free_files_cnt > 0 &&
+		    io_uring_sq_space_left(ring) >= 3+us.inflight+1) {
+			ssize_t i = bio_ahead_next(self);
+
+			if (i == -1)
+				break;
+			bio_uring_start_read(&us, i);
+		}
+
+		pthread_mutex_unlock(&self->lock);
+		rv = io_uring_submit_and_wait(ring, 1);
+		pthread_mutex_lock(&self->lock);
+
+		if U (rv < 0 && rv != -EINTR && rv != -EBUSY && rv != -EAGAIN) {
+			fprintf(stderr, "batch: io_uring_submit: %s\n", strerror(-rv));
+			bio_uring_give_up(self);
+			break;
+		}
+
+		while (io_uring_peek_cqe(ring, &cqe) == 0) {
+			bio_uring_cqe(&us, cqe);
+			io_uring_cqe_seen(ring, cqe);
+		}
+	}
+
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+static void bio_wake(struct bio *self)
+{
+	if (self->uring)
+		eventfd_write(self->efd, 1);
+}
+
+static bool bio_uring_init(struct bio *self)
+{
+	if ((self->efd = eventfd(0, EFD_CLOEXEC)) == -1)
+		return false;
+	if (io_uring_queue_init(BIO_URING_ENTRIES, &self->ring, 0) < 0)
+		goto fail_efd;
+	if (io_uring_register_files_sparse(&self->ring, BIO_URING_FILES) < 0)
+		goto fail_ring;
+	if (pthread_create(&self->threads[0], NULL, bio_uring_thread, self) != 0)
+		goto fail_ring;
+	self->threads_cnt = 1;
+	self->uring = true;
+	self->async_writes = true;
+
+	return true;
+fail_ring:
+	io_uring_queue_exit(&self->ring);
+fail_efd:
+	close(self->efd);
+	return false;
+}
+
+#else
+
+static void bio_wake(struct bio *self)
+{
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+
+struct bio *bio_new(struct batch *batch, int nthreads)
+{
+	struct bio *self;
+
+	if U (!(self = calloc(1, sizeof(*self))))
+		return NULL;
+	if U (!(self->slots = calloc(batch->items_cnt+1, sizeof(*self->slots)))) {
+		free(self);
+		return NULL;
+	}
+
+	self->batch = batch;
+	self->ahead_max = ((nthreads > 0) ? nthreads : batch_default_threads())*BIO_AHEAD_PER_THREAD;
+	self->wq_tail = &self->wq_head;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+
+#if WITH_URING
+	if (bio_uring_init(self))
+		return self;
+#endif
+
+	// if no thread starts, bio_read() reads everything itself
+	for (int i = 0; i < BIO_READERS+BIO_WRITERS; i++) {
+		void *(*fn)(void *) = (i < BIO_READERS) ? bio_reader_thread : bio_writer_thread;
+
+		if (pthread_create(&self->threads[self->threads_cnt], NULL, fn, self) == 0) {
+			self->threads_cnt++;
+			self->async_writes |= (fn == bio_writer_thread);
+		}
+	}
+
+	return self;
+}
+
+bool bio_read(struct bio *self, struct batch_item *item, unsigned char **buf, size_t *size)
+{
+	size_t i = item-self->batch->items;
+	struct bio_slot *slot = &self->slots[i];
+
+	pthread_mutex_lock(&self->lock);
+	while (slot->state == BIO_LOADING)
+		pthread_cond_wait(&self->cond, &self->lock);
+
+	if (slot->state == BIO_READY) {
+		*buf = slot->buf;
+		*size = slot->size;
+		bio_ahead_release(self, i);
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+		bio_wake(self);
+		if (*buf)
+			return true;
+	} else {
+		slot->state = BIO_TAKEN;
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	if U (!bio_read_file(item->path, buf, size)) {
+		fprintf(stderr, "batch: %s: %s\n", item->path, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+void bio_skip(struct bio *self, struct batch_item *item)
+{
+	size_t i = item-self->batch->items;
+	struct bio_slot *slot = &self->slots[i];
+
+	pthread_mutex_lock(&self->lock);
+	while (slot->state == BIO_LOADING)
+		pthread_cond_wait(&self->cond, &self->lock);
+
+	if (slot->state == BIO_READY) {
+		free(slot->buf);
+		bio_ahead_release(self, i);
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+		bio_wake(self);
+		return;
+	}
+
+	slot->state = BIO_TAKEN;
+	pthread_mutex_unlock(&self->lock);
+}
+
+bool bio_write(struct bio *self, const char *path, const void *buf, size_t size)
+{
+	struct bio_write_req *w;
+	size_t pathlen = strlen(path);
+
+	if U (!(w = calloc(1, sizeof(*w))))
+		goto sync;
+	if U (!(w->path = malloc(2*pathlen+sizeof(TMPSUF)+1)) || !(w->buf = malloc(size))) {
+		free(w->path);
+		free(w);
+		goto sync;
+	}
+	w->tmppath = w->path+pathlen+1;
+	memcpy(w->path, path, pathlen+1);
+	memcpy(w->tmppath, path, pathlen);
+	memcpy(w->tmppath+pathlen, TMPSUF, sizeof(TMPSUF));
+	memcpy(w->buf, buf, size);
+	w->size = size;
+
+	pthread_mutex_lock(&self->lock);
+	if U (!self->async_writes) {
+		bool ok;
+
+		pthread_mutex_unlock(&self->lock);
+		ok = bio_write_file(w->path, w->tmppath, w->buf, w->size);
+		bio_write_req_free(w);
+		return ok;
+	}
+	while (self->wq_bytes > 0 && self->wq_bytes+size > BIO_WRITE_BYTES)
+		pthread_cond_wait(&self->cond, &self->lock);
+	*self->wq_tail = w;
+	self->wq_tail = &w->next;
+	self->wq_bytes += size;
+	self->writes_pending++;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	bio_wake(self);
+
+	return true;
+sync:
+	{
+		char *tmppath = alloca(pathlen+sizeof(TMPSUF));
+
+		memcpy(tmppath, path, pathlen);
+		memcpy(tmppath+pathlen, TMPSUF, sizeof(TMPSUF));
+
+		return bio_write_file(path, tmppath, buf, size);
+	}
+}
+
+bool bio_finish(struct bio *self)
+{
+	bool rv;
+
+	pthread_mutex_lock(&self->lock);
+	while (self->writes_pending > 0)
+		pthread_cond_wait(&self->cond, &self->lock);
+	rv = (self->write_errors == 0);
+	pthread_mutex_unlock(&self->lock);
+
+	return rv;
+}
+
+void bio_free(struct bio *self)
+{
+	if U (!self)
+		return;
+
+	pthread_mutex_lock(&self->lock);
+	self->stop = true;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	bio_wake(self);
+
+	for (int i = 0; i < self->threads_cnt; i++)
+		pthread_join(self->threads[i], NULL);
+
+#if WITH_URING
+	if (self->uring) {
+		io_uring_queue_exit(&self->ring);
+		close(self->efd);
+	}
+#endif
+
+	// read ahead but never asked for
+	for (size_t i = 0; i < self->batch->items_cnt; i++)
+		if (self->slots[i].state == BIO_READY)
+			free(self->slots[i].buf);
+
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	free(self->slots);
+	free(self);
+}
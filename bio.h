@@ -0,0 +1,34 @@
+#pragma once
+
+#include "batch.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// file I/O for the batch modes, done in the background so the worker threads
+// don't have to wait for it
+// input files are read ahead in list order. output files are written to
+// "path.tmp", fsynced and renamed over "path"
+// uses io_uring if built with WITH_URING=1 (and the kernel supports it),
+// plain threads otherwise
+
+struct bio;
+
+struct bio *bio_new(struct batch *batch, int nthreads);
+
+// contents of the item's file. waits for the read-ahead, or reads it right
+// here if it hasn't been started yet
+// the buffer is the caller's to free()
+bool bio_read(struct bio *self, struct batch_item *item, unsigned char **buf, size_t *size);
+
+// the item won't be read with bio_read() after all (result was cached etc.)
+void bio_skip(struct bio *self, struct batch_item *item);
+
+// queues a copy of buf to be written to path. errors are printed and counted
+// for bio_finish()
+bool bio_write(struct bio *self, const char *path, const void *buf, size_t size);
+
+// waits for all queued writes. false if any of them failed
+bool bio_finish(struct bio *self);
+
+void bio_free(struct bio *self);
@@ -0,0 +1,141 @@
+#include "dctresample.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+// the jpeg dct as a matrix: X = T x T^T for a block x of (level shifted)
+// samples. T is orthonormal, so x = T^T X T
+//
+// averaging pairs of samples from two neighbouring blocks a and b is
+// y = S0 a + S1 b, where S0 and S1 are the two 8x8 halves of the 8x16 matrix
+// with 1/2 at (i, 2i) and (i, 2i+1). on the coefficients that's
+// Y = M0 A + M1 B with Mk = T Sk T^T. horizontally it's the same from the
+// right (A M0^T + B M1^T)
+//
+// repeating every pixel of half k of a block is 2 Sk^T, so doubling is
+// Y = 2 Mk^T A (and A 2 Mk from the right)
+static float dctresample_m[2][DCTSIZE][DCTSIZE];
+static float dctresample_mt[2][DCTSIZE][DCTSIZE]; // transposed
+static pthread_once_t dctresample_once = PTHREAD_ONCE_INIT;
+
+static void dctresample_init(void)
+{
+	double t[DCTSIZE][DCTSIZE];
+
+	for (int u = 0; u < DCTSIZE; u++)
+		for (int x = 0; x < DCTSIZE; x++)
+			t[u][x] = ((u == 0) ? sqrt(0.125) : 0.5) * cos((2*x+1)*u*M_PI/16);
+
+	// Sk has its 1/2s in rows 4k..4k+3
+	for (int k = 0; k < 2; k++) {
+		for (int u = 0; u < DCTSIZE; u++) {
+			for (int v = 0; v < DCTSIZE; v++) {
+				double sum = 0;
+
+				for (int i = 0; i < DCTSIZE/2; i++)
+					sum += t[u][i+k*DCTSIZE/2]*0.5*(t[v][2*i] + t[v][2*i+1]);
+
+				dctresample_m[k][u][v] = sum;
+				dctresample_mt[k][v][u] = sum;
+			}
+		}
+	}
+}
+
+static inline void dctresample_dequantize(float *out, const JCOEF *in, const UINT16 *q)
+{
+	for (int k = 0; k < DCTSIZE2; k++)
+		out[k] = in[k]*q[k];
+}
+
+// (baseline huffman coding can't take more than 1023)
+static inline void dctresample_quantize(JCOEF *out, const float *in, const UINT16 *q)
+{
+	for (int k = 0; k < DCTSIZE2; k++) {
+		float v = in[k]/q[k];
+		int iv = (v >= 0) ? (int)(v + 0.5f) : -(int)(-v + 0.5f);
+
+		out[k] = (iv > 1023) ? 1023 : (iv < -1023) ? -1023 : iv;
+	}
+}
+
+void dctresample_halve(const JCOEF *const in[4], int nx, int ny,
+	const UINT16 *qin, const UINT16 *qout, JCOEF *out)
+{
+	float h[2][DCTSIZE2]; // each row of input blocks, done horizontally
+	float y[DCTSIZE2];
+	float *res;
+
+	pthread_once(&dctresample_once, dctresample_init);
+
+	// H[u][:] = sum over s, v of A_s[u][v] * Ms^T[v][:]
+	// the inner loops go along rows of 8 floats, which vectorize
+	for (int r = 0; r < ny; r++) {
+		float x[DCTSIZE2];
+
+		if (nx == 1) {
+			dctresample_dequantize(h[r], in[r*2], qin);
+			continue;
+		}
+
+		memset(h[r], 0, sizeof(h[r]));
+		for (int s = 0; s < 2; s++) {
+			dctresample_dequantize(x, in[r*2+s], qin);
+			for (int u = 0; u < DCTSIZE; u++)
+				for (int v = 0; v < DCTSIZE; v++)
+					for (int w = 0; w < DCTSIZE; w++)
+						h[r][u*DCTSIZE+w] += x[u*DCTSIZE+v]*dctresample_mt[s][v][w];
+		}
+	}
+
+	// Y[u][:] = sum over r, i of Mr[u][i] * H_r[i][:]
+	if (ny == 1) {
+		res = h[0];
+	} else {
+		memset(y, 0, sizeof(y));
+		for (int r = 0; r < 2; r++)
+			for (int u = 0; u < DCTSIZE; u++)
+				for (int i = 0; i < DCTSIZE; i++)
+					for (int w = 0; w < DCTSIZE; w++)
+						y[u*DCTSIZE+w] += dctresample_m[r][u][i]*h[r][i*DCTSIZE+w];
+		res = y;
+	}
+
+	dctresample_quantize(out, res, qout);
+}
+
+void dctresample_double(const JCOEF *in, int nx, int ny, int qx, int qy,
+	const UINT16 *qin, const UINT16 *qout, JCOEF *out)
+{
+	float x[DCTSIZE2];
+	float h[DCTSIZE2];
+	float y[DCTSIZE2];
+	float *res = x;
+
+	pthread_once(&dctresample_once, dctresample_init);
+
+	dctresample_dequantize(x, in, qin);
+
+	// H[u][:] = sum over v of X[u][v] * 2 Mqx[v][:]
+	if (nx == 2) {
+		memset(h, 0, sizeof(h));
+		for (int u = 0; u < DCTSIZE; u++)
+			for (int v = 0; v < DCTSIZE; v++)
+				for (int w = 0; w < DCTSIZE; w++)
+					h[u*DCTSIZE+w] += 2*x[u*DCTSIZE+v]*dctresample_m[qx][v][w];
+		res = h;
+	}
+
+	// Y[u][:] = sum over i of 2 Mqy^T[u][i] * H[i][:]
+	if (ny == 2) {
+		memset(y, 0, sizeof(y));
+		for (int u = 0; u < DCTSIZE; u++)
+			for (int i = 0; i < DCTSIZE; i++)
+				for (int w = 0; w < DCTSIZE; w++)
+					y[u*DCTSIZE+w] += 2*dctresample_mt[qy][u][i]*res[i*DCTSIZE+w];
+		res = y;
+	}
+
+	dctresample_quantize(out, res, qout);
+}
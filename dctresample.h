@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+// resampling of quantized 8x8 blocks without going through pixels
+
+// combines 2x2 (or 2x1, 1x2) neighbouring blocks of one component into one
+// block covering the same area, as if the pixels had been averaged in 2x2
+// (2x1, 1x2) boxes. in is { top left, top right, bottom left, bottom right }.
+// with nx or ny 1, the blocks past the first column or row aren't used and
+// can be NULL
+// qin and qout are the quantization tables (natural order) of the input and
+// output blocks. they can be the same
+void dctresample_halve(const JCOEF *const in[4], int nx, int ny,
+	const UINT16 *qin, const UINT16 *qout, JCOEF *out);
+
+// the other way: one half (with nx or ny 2) or quarter of the block, stretched
+// to a whole block by repeating every pixel. qx and qy pick the half: 0 for
+// left/top, 1 for right/bottom. halving two doubled halves gives back the
+// original block (before quantization)
+void dctresample_double(const JCOEF *in, int nx, int ny, int qx, int qy,
+	const UINT16 *qin, const UINT16 *qout, JCOEF *out);
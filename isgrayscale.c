@@ -1,108 +1,308 @@
 #include "isgrayscale.h"
+#include "batch.h"
+#include "bio.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <setjmp.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <jpeglib.h>
+#include <jerror.h>
 
 #define U(x) (__builtin_expect(!!(x), 0))
 #define L(x) (__builtin_expect(!!(x), 1))
 
+// https://github.com/libjpeg-turbo/libjpeg-turbo/blob/c23672c/jutils.c#L84
+#define round_up(a, b) (((a) + (b) - 1) - (((a) + (b) - 1) & ((b) - 1)))
+
+struct isgrayscale_ctx {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	jmp_buf catch;
+	char errmsg[JMSG_LENGTH_MAX];
+
+	// libjpeg won't switch an existing source manager to another kind, so
+	// one of each is kept and put back before reusing it
+	struct jpeg_source_mgr *stdio_src;
+	struct jpeg_source_mgr *mem_src;
+
+	unsigned char *buf;
+	size_t buf_size;
+	JSAMPROW *rows;
+	int rows_cnt;
+};
+
+// errors and warnings go in ctx->errmsg instead of stderr
+
 __attribute__((cold))
 static void isgrayscale_error_handler(j_common_ptr cinfo)
 {
-	char errmsg[JMSG_LENGTH_MAX];
+	struct isgrayscale_ctx *ctx = cinfo->client_data;
 
-	cinfo->err->format_message(cinfo, errmsg);
-	fprintf(stderr, "isgrayscale: libjpeg error: %s\n", errmsg);
-	longjmp(*(jmp_buf *)cinfo->client_data, 1);
+	cinfo->err->format_message(cinfo, ctx->errmsg);
+	longjmp(ctx->catch, 1);
 }
 
-enum grayscale_status isgrayscale(const char *path)
+static void isgrayscale_output_message(j_common_ptr cinfo)
 {
-	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	FILE *f;
-	unsigned char **bufs;
-	int output_height, output_width;
-	unsigned error = 0;
+	struct isgrayscale_ctx *ctx = cinfo->client_data;
+
+	cinfo->err->format_message(cinfo, ctx->errmsg);
+}
+
+__attribute__((format(printf, 2, 3)))
+static void isgrayscale_set_error(struct isgrayscale_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(ctx->errmsg, sizeof(ctx->errmsg), fmt, ap);
+	va_end(ap);
+}
+
+// the 1/8 scale image is made of block averages, so chroma that rounds away at
+// full resolution can still leave a small difference in it. anything above
+// this is color no matter what the full decode would say
+#define PREFILTER_THRESHOLD 8
+
+// one contiguous RGBX buffer for rec_outbuf_height rows, kept in the context
+// and reused for the next file
+static bool isgrayscale_ctx_alloc_bufs(struct isgrayscale_ctx *ctx)
+{
+	j_decompress_ptr cinfo = &ctx->cinfo;
+	size_t rowsize = cinfo->output_width*4;
+	size_t need = round_up(cinfo->rec_outbuf_height*rowsize, 16*8);
+
+	if (need > ctx->buf_size || cinfo->rec_outbuf_height > ctx->rows_cnt) {
+		unsigned char *buf;
+		JSAMPROW *rows;
+
+		// (aligned_alloc() is C11, not declared with -std=gnu90)
+		if U (posix_memalign((void **)&buf, 16*8, need) != 0)
+			buf = NULL;
+		rows = calloc(cinfo->rec_outbuf_height, sizeof(*rows));
+		if U (!buf || !rows) {
+			free(buf);
+			free(rows);
+			return false;
+		}
+
+		free(ctx->buf);
+		free(ctx->rows);
+		ctx->buf = buf;
+		ctx->buf_size = need;
+		ctx->rows = rows;
+		ctx->rows_cnt = cinfo->rec_outbuf_height;
+	}
+
+	for (int i = 0; i < cinfo->rec_outbuf_height; i++)
+		ctx->rows[i] = &ctx->buf[i*rowsize];
+
+	return true;
+}
+
+// decode at 1/8 scale (dc only, no idct) and look for obvious color
+// leaves the decompressor in the same state as before jpeg_read_header()
+static bool isgrayscale_prefilter(struct isgrayscale_ctx *ctx)
+{
+	j_decompress_ptr cinfo = &ctx->cinfo;
 	unsigned char *onebuf;
-	jmp_buf catch;
-	volatile enum {
-		state_init = 0,
-		decompress_created,
-		decompress_started,
-	} state = state_init;
+	int output_width;
+	unsigned error = 0;
+
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = 8;
+
+	jpeg_start_decompress(cinfo);
+
+	output_width = cinfo->output_width;
+	__builtin_assume(output_width > 0);
+
+	if U (!isgrayscale_ctx_alloc_bufs(ctx))
+		ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+	onebuf = ctx->buf;
+
+	while (cinfo->output_scanline < cinfo->output_height) {
+		int lines;
+
+		lines = jpeg_read_scanlines(cinfo, ctx->rows, cinfo->rec_outbuf_height);
+		for (int j = 0; j < lines*output_width*4; j += 4) {
+			int r, g, b;
+			r = onebuf[j];
+			g = onebuf[j+1];
+			b = onebuf[j+2];
+			error |= (abs(r-g) > PREFILTER_THRESHOLD);
+			error |= (abs(r-b) > PREFILTER_THRESHOLD);
+		}
+		if U (error)
+			break;
+	}
+
+	jpeg_abort_decompress(cinfo);
+
+	return (error != 0);
+}
+
+// -----------------------------------------------------------------------------
+
+struct isgrayscale_ctx *isgrayscale_ctx_new(void)
+{
+	struct isgrayscale_ctx *ctx;
+
+	if U (!(ctx = calloc(1, sizeof(*ctx))))
+		return NULL;
+
+	ctx->cinfo.err = jpeg_std_error(&ctx->jerr);
+	ctx->jerr.error_exit = isgrayscale_error_handler;
+	ctx->jerr.output_message = isgrayscale_output_message;
+
+	ctx->cinfo.client_data = ctx;
+	if U (setjmp(ctx->catch) != 0) {
+		free(ctx);
+		return NULL;
+	}
+	jpeg_create_decompress(&ctx->cinfo);
+
+	return ctx;
+}
+
+void isgrayscale_ctx_free(struct isgrayscale_ctx *ctx)
+{
+	if U (!ctx)
+		return;
+
+	jpeg_destroy_decompress(&ctx->cinfo);
+
+	free(ctx->buf);
+	free(ctx->rows);
+	free(ctx);
+}
+
+static enum grayscale_status isgrayscale_ctx_check_src(struct isgrayscale_ctx *ctx,
+	FILE *f,
+	const unsigned char *buf, size_t size);
+
+enum grayscale_status isgrayscale_ctx_check(struct isgrayscale_ctx *ctx, const char *path)
+{
+	enum grayscale_status rv;
+	FILE *f;
 
 	f = fopen(path, "r");
 	if U (!f) {
-		perror("isgrayscale: failed to open input file");
+		isgrayscale_set_error(ctx, "failed to open input file: %s", strerror(errno));
 		return gss_error;
 	}
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jerr.error_exit = isgrayscale_error_handler;
-
-	cinfo.client_data = &catch;
-	if U (setjmp(catch) != 0) {
-		switch (state) {
-		case decompress_started:
-			state = decompress_created;
-			if (cinfo.output_scanline < output_height)
-				jpeg_abort_decompress(&cinfo);
-			else
-				jpeg_finish_decompress(&cinfo);
-		case decompress_created:
-			state = state_init;
-			jpeg_destroy_decompress(&cinfo);
-		case state_init:
-			break;
-		}
-		fclose(f);
-		return gss_error;
+	rv = isgrayscale_ctx_check_src(ctx, f, NULL, 0);
+
+	fclose(f);
+
+	return rv;
+}
+
+enum grayscale_status isgrayscale_ctx_check_buf(struct isgrayscale_ctx *ctx,
+	const unsigned char *buf, size_t size)
+{
+	return isgrayscale_ctx_check_src(ctx, NULL, buf, size);
+}
+
+// reads from f if it's not NULL, buf otherwise
+static void isgrayscale_ctx_set_src(struct isgrayscale_ctx *ctx,
+	FILE *f,
+	const unsigned char *buf, size_t size)
+{
+	j_decompress_ptr cinfo = &ctx->cinfo;
+
+	if (f) {
+		cinfo->src = ctx->stdio_src;
+		jpeg_stdio_src(cinfo, f);
+		ctx->stdio_src = cinfo->src;
+	} else {
+		cinfo->src = ctx->mem_src;
+		// (older libjpegs take a non-const buffer but don't write to it)
+		jpeg_mem_src(cinfo, (unsigned char *)buf, size);
+		ctx->mem_src = cinfo->src;
 	}
+}
 
-	jpeg_create_decompress(&cinfo);
-	state = decompress_created;
+static enum grayscale_status isgrayscale_ctx_check_src(struct isgrayscale_ctx *ctx,
+	FILE *f,
+	const unsigned char *buf, size_t size)
+{
+	j_decompress_ptr cinfo = &ctx->cinfo;
+	int output_height, output_width;
+	unsigned error = 0;
+	unsigned char *onebuf;
 
-	jpeg_stdio_src(&cinfo, f);
-	jpeg_read_header(&cinfo, TRUE);
+	ctx->errmsg[0] = '\0';
 
-	if U (cinfo.jpeg_color_space == JCS_GRAYSCALE) {
-		fclose(f);
+	// jpeg_abort_decompress() is fine from any state and leaves the
+	// decompressor ready for the next file
+	if U (setjmp(ctx->catch) != 0) {
+		jpeg_abort_decompress(cinfo);
+		return gss_error;
+	}
+
+	isgrayscale_ctx_set_src(ctx, f, buf, size);
+	jpeg_read_header(cinfo, TRUE);
+
+	if U (cinfo->jpeg_color_space == JCS_GRAYSCALE) {
+		jpeg_abort_decompress(cinfo);
 		return gss_yes;
 	}
 
-	if U (cinfo.out_color_space != JCS_RGB) {
-		fprintf(stderr, "isgrayscale: unsupported color space\n");
-		fclose(f);
+	if U (cinfo->out_color_space != JCS_RGB) {
+		isgrayscale_set_error(ctx, "unsupported color space");
+		jpeg_abort_decompress(cinfo);
 		return gss_error;
 	}
 
-	cinfo.out_color_space = JCS_EXT_RGBX;
-//	cinfo.dct_method = JDCT_IFAST; // causes disagreements with imagemagick
-	cinfo.do_fancy_upsampling = FALSE;
-	cinfo.do_block_smoothing = FALSE;
+	cinfo->out_color_space = JCS_EXT_RGBX;
+	cinfo->do_fancy_upsampling = FALSE;
+	cinfo->do_block_smoothing = FALSE;
+
+	if (isgrayscale_prefilter(ctx))
+		return gss_no;
+
+	// no obvious color, rewind and do it properly
+
+	if (f) {
+		if U (fseek(f, 0, SEEK_SET) == -1) {
+			isgrayscale_set_error(ctx, "failed to rewind input file: %s", strerror(errno));
+			return gss_error;
+		}
+	}
+	isgrayscale_ctx_set_src(ctx, f, buf, size);
+	jpeg_read_header(cinfo, TRUE);
+
+	cinfo->out_color_space = JCS_EXT_RGBX;
+//	cinfo->dct_method = JDCT_IFAST; // causes disagreements with imagemagick
+	cinfo->do_fancy_upsampling = FALSE;
+	cinfo->do_block_smoothing = FALSE;
 
-	jpeg_start_decompress(&cinfo);
-	state = decompress_started;
+	jpeg_start_decompress(cinfo);
 
-	output_width = cinfo.output_width;
-	output_height = cinfo.output_height;
+	output_width = cinfo->output_width;
+	output_height = cinfo->output_height;
 
 	__builtin_assume(output_width > 0);
 
-	bufs = alloca(cinfo.rec_outbuf_height*sizeof(void *));
-	onebuf = __builtin_alloca_with_align(cinfo.rec_outbuf_height*(output_width*4), 16*8);
-	for (int i = 0; i < cinfo.rec_outbuf_height; i++)
-		bufs[i] = &onebuf[i*(output_width*4)];
+	if U (!isgrayscale_ctx_alloc_bufs(ctx))
+		ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+	onebuf = ctx->buf;
 
-	while (cinfo.output_scanline < output_height) {
+	while (cinfo->output_scanline < output_height) {
 		int lines;
 
-		lines = jpeg_read_scanlines(&cinfo, bufs, cinfo.rec_outbuf_height);
+		lines = jpeg_read_scanlines(cinfo, ctx->rows, cinfo->rec_outbuf_height);
 		for (int j = 0; j < lines*output_width*4; j += 4) {
 			unsigned r, g, b;
 			r = onebuf[j];
@@ -115,27 +315,453 @@ enum grayscale_status isgrayscale(const char *path)
 			break;
 	}
 
-	state = decompress_created;
-	if (cinfo.output_scanline < output_height)
-		jpeg_abort_decompress(&cinfo);
-	else
-		jpeg_finish_decompress(&cinfo);
+	jpeg_abort_decompress(cinfo);
 
-	state = state_init;
-	jpeg_destroy_decompress(&cinfo);
+	return (error == 0) ? gss_yes : gss_no;
+}
 
-	fclose(f);
+const char *isgrayscale_ctx_error(struct isgrayscale_ctx *ctx)
+{
+	return ctx->errmsg;
+}
 
-	return (error == 0) ? gss_yes : gss_no;
+// isgrayscale() keeps a context per thread, freed when the thread exits
+
+static pthread_key_t isgrayscale_tls_key;
+static pthread_once_t isgrayscale_tls_once = PTHREAD_ONCE_INIT;
+static bool isgrayscale_tls_ok;
+
+static void isgrayscale_tls_destroy(void *ctx)
+{
+	isgrayscale_ctx_free(ctx);
+}
+
+static void isgrayscale_tls_init(void)
+{
+	isgrayscale_tls_ok = (pthread_key_create(&isgrayscale_tls_key, isgrayscale_tls_destroy) == 0);
+}
+
+static struct isgrayscale_ctx *isgrayscale_tls_ctx(void)
+{
+	struct isgrayscale_ctx *ctx;
+
+	pthread_once(&isgrayscale_tls_once, isgrayscale_tls_init);
+	if U (!isgrayscale_tls_ok)
+		return NULL;
+
+	if L ((ctx = pthread_getspecific(isgrayscale_tls_key)))
+		return ctx;
+
+	if U (!(ctx = isgrayscale_ctx_new()))
+		return NULL;
+	if U (pthread_setspecific(isgrayscale_tls_key, ctx) != 0) {
+		isgrayscale_ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+enum grayscale_status isgrayscale(const char *path)
+{
+	struct isgrayscale_ctx *ctx;
+
+	if U (!(ctx = isgrayscale_tls_ctx()))
+		return gss_error;
+
+	return isgrayscale_ctx_check(ctx, path);
+}
+
+const char *isgrayscale_error(void)
+{
+	struct isgrayscale_ctx *ctx;
+
+	if U (!isgrayscale_tls_ok || !(ctx = pthread_getspecific(isgrayscale_tls_key)))
+		return "out of memory";
+
+	return ctx->errmsg;
+}
+
+// -----------------------------------------------------------------------------
+
+// result cache for batch mode
+// file identity is (device, inode, size, mtime). the cache file is a header
+// followed by fixed-size records and is rewritten with tmp+rename at the end
+
+#define CACHE_MAGIC "IGSCACHE"
+#define CACHE_VERSION 1
+
+struct cache_record {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_ns;
+	uint32_t status;
+	uint32_t stale;
+};
+_Static_assert(sizeof(struct cache_record) == 40, "");
+
+struct cache {
+	const char *path;
+
+	// loaded from disk, read-only while the batch runs (except for .stale)
+	struct cache_record *table;
+	size_t table_mask;
+	size_t table_cnt;
+
+	// results added by this run
+	pthread_mutex_t lock;
+	struct cache_record *added;
+	size_t added_cnt;
+	size_t added_cap;
+};
+
+static size_t cache_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (ino ^ (dev << 32 | dev >> 32))*0x9e3779b97f4a7c15ull;
+
+	return h ^ (h >> 29);
+}
+
+static void cache_key(struct cache_record *rec, const struct stat *st)
+{
+	rec->dev = st->st_dev;
+	rec->ino = st->st_ino;
+	rec->size = st->st_size;
+	rec->mtime_ns = (int64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+}
+
+static struct cache_record *cache_find_slot(struct cache *self, uint64_t dev, uint64_t ino)
+{
+	size_t i = cache_hash(dev, ino) & self->table_mask;
+
+	// status == 0 (gss_yes) is valid, so empty slots are marked by dev=ino=0
+	while (self->table[i].dev != 0 || self->table[i].ino != 0) {
+		if (self->table[i].dev == dev && self->table[i].ino == ino)
+			return &self->table[i];
+		i = (i+1) & self->table_mask;
+	}
+
+	return &self->table[i];
+}
+
+static bool cache_load(struct cache *self, const char *path)
+{
+	struct cache_record rec;
+	char magic[8];
+	uint32_t version;
+	size_t cap;
+	struct stat st;
+	FILE *f;
+
+	memset(self, 0, sizeof(*self));
+	self->path = path;
+	pthread_mutex_init(&self->lock, NULL);
+
+	cap = 1024;
+	if ((f = fopen(path, "r"))) {
+		if (fstat(fileno(f), &st) == 0)
+			while (cap < (st.st_size/sizeof(rec))*2)
+				cap *= 2;
+
+		if (fread(magic, sizeof(magic), 1, f) != 1 ||
+		    fread(&version, sizeof(version), 1, f) != 1 ||
+		    memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+		    version != CACHE_VERSION) {
+			fprintf(stderr, "isgrayscale: %s: not a cache file, ignoring it\n", path);
+			fclose(f);
+			f = NULL;
+		}
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "isgrayscale: %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	if U (!(self->table = calloc(cap, sizeof(*self->table)))) {
+		if (f)
+			fclose(f);
+		return false;
+	}
+	self->table_mask = cap-1;
+
+	while (f && fread(&rec, sizeof(rec), 1, f) == 1) {
+		struct cache_record *slot;
+
+		if U (rec.dev == 0 && rec.ino == 0)
+			continue;
+		if U (self->table_cnt >= cap/2)
+			break;
+
+		slot = cache_find_slot(self, rec.dev, rec.ino);
+		if (slot->dev == 0 && slot->ino == 0)
+			self->table_cnt++;
+		*slot = rec;
+		slot->stale = 0;
+	}
+
+	if (f)
+		fclose(f);
+
+	return true;
+}
+
+static bool cache_lookup(struct cache *self, const struct stat *st, enum grayscale_status *status_out)
+{
+	struct cache_record key;
+	struct cache_record *slot;
+
+	cache_key(&key, st);
+
+	slot = cache_find_slot(self, key.dev, key.ino);
+	if (slot->dev == 0 && slot->ino == 0)
+		return false;
+
+	if (slot->size != key.size || slot->mtime_ns != key.mtime_ns) {
+		// file changed, drop the old result when saving
+		__atomic_store_n(&slot->stale, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	*status_out = slot->status;
+
+	return true;
+}
+
+static void cache_add(struct cache *self, const struct stat *st, enum grayscale_status status)
+{
+	struct cache_record *rec;
+
+	pthread_mutex_lock(&self->lock);
+
+	if (self->added_cnt == self->added_cap) {
+		size_t newcap = (self->added_cap) ? self->added_cap*2 : 256;
+		struct cache_record *newadded;
+
+		newadded = reallocarray(self->added, newcap, sizeof(*self->added));
+		if U (!newadded)
+			goto out;
+
+		self->added = newadded;
+		self->added_cap = newcap;
+	}
+
+	rec = &self->added[self->added_cnt++];
+	memset(rec, 0, sizeof(*rec));
+	cache_key(rec, st);
+	rec->status = status;
+out:
+	pthread_mutex_unlock(&self->lock);
+}
+
+static bool cache_save(struct cache *self)
+{
+	uint32_t version = CACHE_VERSION;
+	size_t pathlen;
+	char *tmppath;
+	bool ok = true;
+	FILE *f;
+
+	pathlen = strlen(self->path);
+	tmppath = alloca(pathlen+sizeof(".tmp"));
+	memcpy(tmppath, self->path, pathlen);
+	memcpy(tmppath+pathlen, ".tmp", sizeof(".tmp"));
+
+	if U (!(f = fopen(tmppath, "w"))) {
+		perror("isgrayscale: failed to open cache file");
+		return false;
+	}
+
+	ok &= (fwrite(CACHE_MAGIC, 8, 1, f) == 1);
+	ok &= (fwrite(&version, sizeof(version), 1, f) == 1);
+
+	for (size_t i = 0; i <= self->table_mask; i++) {
+		struct cache_record *rec = &self->table[i];
+
+		if ((rec->dev == 0 && rec->ino == 0) || rec->stale)
+			continue;
+		ok &= (fwrite(rec, sizeof(*rec), 1, f) == 1);
+	}
+	if (self->added_cnt)
+		ok &= (fwrite(self->added, sizeof(*self->added), self->added_cnt, f) == self->added_cnt);
+
+	ok &= (fclose(f) == 0);
+
+	if U (!ok || rename(tmppath, self->path) == -1) {
+		perror("isgrayscale: failed to write cache file");
+		unlink(tmppath);
+		return false;
+	}
+
+	return true;
+}
+
+static void cache_free(struct cache *self)
+{
+	free(self->table);
+	free(self->added);
+	pthread_mutex_destroy(&self->lock);
+}
+
+// -----------------------------------------------------------------------------
+
+static const char *const gss_names[] = {
+	[gss_yes] = "yes",
+	[gss_no] = "no",
+	[gss_error] = "error",
+};
+
+struct batch_state {
+	struct cache *cache;
+	struct bio *bio;
+	enum grayscale_status worst;
+};
+
+static void *batch_ctx_new(void *arg)
+{
+	return isgrayscale_ctx_new();
+}
+
+static void batch_ctx_free(void *ctx)
+{
+	isgrayscale_ctx_free(ctx);
+}
+
+static void batch_check(void *ctx, struct batch_item *item, void *arg)
+{
+	struct batch_state *bs = arg;
+	enum grayscale_status rv;
+	struct stat st;
+	bool have_st = false;
+
+	unsigned char *buf;
+	size_t size;
+
+	if (bs->cache && (have_st = (stat(item->path, &st) == 0)) &&
+	    cache_lookup(bs->cache, &st, &rv)) {
+		bio_skip(bs->bio, item);
+		goto done;
+	}
+
+	if L (bio_read(bs->bio, item, &buf, &size)) {
+		rv = isgrayscale_ctx_check_buf(ctx, buf, size);
+		free(buf);
+		if U (rv == gss_error)
+			fprintf(stderr, "isgrayscale: %s: %s\n", item->path, isgrayscale_ctx_error(ctx));
+	} else {
+		rv = gss_error;
+	}
+
+	if (have_st && rv != gss_error)
+		cache_add(bs->cache, &st, rv);
+done:
+	flockfile(stdout);
+	printf("%s\t%s\n", item->path, gss_names[rv]);
+	funlockfile(stdout);
+
+	if U (rv == gss_error)
+		__atomic_store_n(&bs->worst, gss_error, __ATOMIC_RELAXED);
 }
 
 __attribute__((weak))
 int main(int argc, char **argv)
 {
-	if U (argc != 2) {
-		fprintf(stderr, "usage: isgrayscale <file>\n");
-		return gss_error;
+	struct batch batch = {0};
+	struct cache cache;
+	struct batch_state bs = {
+		.cache = NULL,
+		.bio = NULL,
+		.worst = gss_yes,
+	};
+	const struct batch_worker worker = {
+		.ctx_new = batch_ctx_new,
+		.ctx_free = batch_ctx_free,
+		.fn = batch_check,
+		.arg = &bs,
+	};
+	const char *cachepath = NULL;
+	bool bflag = false;
+	bool list0 = false;
+	int nthreads = 0;
+
+	while (argc > 1) {
+		if (argv[1][0] != '-') break;
+		else if (strcmp(argv[1], "-b") == 0) bflag = true;
+		else if (strcmp(argv[1], "-0") == 0) list0 = true;
+		else if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+			cachepath = argv[2];
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+			if ((nthreads = atoi(argv[2])) <= 0) {
+				fprintf(stderr, "isgrayscale: bad thread count \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			argc--;
+			argv++;
+		}
+		else {
+			fprintf(stderr, "isgrayscale: unknown option \"%s\"\n", argv[1]);
+			goto usage;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (!bflag) {
+		enum grayscale_status rv;
+
+		if (argc != 2 || cachepath)
+			goto usage;
+		if U ((rv = isgrayscale(argv[1])) == gss_error)
+			fprintf(stderr, "isgrayscale: %s: %s\n", argv[1], isgrayscale_error());
+		return rv;
+	}
+
+	if (argc == 1 && !list0)
+		goto usage;
+
+	if (cachepath) {
+		if (!cache_load(&cache, cachepath))
+			return gss_error;
+		bs.cache = &cache;
 	}
 
-	return isgrayscale(argv[1]);
+	for (int i = 1; i < argc; i++) {
+		if (!batch_add_path(&batch, argv[i]))
+			bs.worst = gss_error;
+	}
+	if (list0 && !batch_add_list0(&batch, stdin))
+		bs.worst = gss_error;
+
+	if U (!(bs.bio = bio_new(&batch, nthreads))) {
+		fprintf(stderr, "isgrayscale: bio_new failed\n");
+		bs.worst = gss_error;
+	} else if (!batch_run(&batch, nthreads, &worker)) {
+		fprintf(stderr, "isgrayscale: batch_run failed\n");
+		bs.worst = gss_error;
+	}
+	bio_free(bs.bio);
+
+	if (bs.cache) {
+		if (!cache_save(bs.cache))
+			bs.worst = gss_error;
+		cache_free(bs.cache);
+	}
+
+	batch_free(&batch);
+
+	return (bs.worst == gss_error) ? gss_error : 0;
+usage:
+	fprintf(stderr,
+	    "usage: isgrayscale <file>\n"
+	    "       isgrayscale -b [-j threads] [-c cachefile] [-0] [path...]\n"
+	    "options:\n"
+	    "    -b       batch mode: print \"path<tab>yes|no|error\" for each file\n"
+	    "    -j N     number of threads to use in batch mode (default: one per cpu)\n"
+	    "    -c FILE  batch mode: remember results in FILE and skip unchanged files\n"
+	    "    -0       batch mode: read a NUL-separated list of paths from stdin\n"
+	    "directories are searched recursively for .jpg and .jpeg files\n"
+	    );
+	return gss_error;
 }
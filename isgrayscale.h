@@ -1,9 +1,24 @@
 #pragma once
 
+#include <stddef.h>
+
 enum grayscale_status {
 	gss_yes = 0,
 	gss_no = 1,
 	gss_error = 2,
 };
 
+// keeps a context per thread, so it's safe to call from any thread
 enum grayscale_status isgrayscale(const char *path);
+// why the last isgrayscale() on this thread returned gss_error
+const char *isgrayscale_error(void);
+
+// same thing, but the decompressor and buffers are kept around between calls
+// one context per thread
+struct isgrayscale_ctx *isgrayscale_ctx_new(void);
+enum grayscale_status isgrayscale_ctx_check(struct isgrayscale_ctx *ctx, const char *path);
+enum grayscale_status isgrayscale_ctx_check_buf(struct isgrayscale_ctx *ctx,
+	const unsigned char *buf, size_t size);
+// why the last check with this context returned gss_error
+const char *isgrayscale_ctx_error(struct isgrayscale_ctx *ctx);
+void isgrayscale_ctx_free(struct isgrayscale_ctx *ctx);
@@ -1,13 +1,21 @@
 #include "jcanvas.h"
+#include "dctresample.h"
+#include "jcf.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <jpeglib.h>
+#include <jerror.h>
 
 #if !defined(WITH_D)
  #define WITH_D 0
@@ -76,88 +84,472 @@ _Static_assert(!ispow2(17), "");
 
 // -----------------------------------------------------------------------------
 
+struct jc_errmgr {
+	struct jpeg_error_mgr jerr; // must be the first member
+	struct jc_try *top;
+	char msg[JMSG_LENGTH_MAX];
+};
+
+// most threads jc_add_image_async() uses for one canvas
+#define JC_MAX_THREADS 8
+
+// how far a worker has got with an image from jc_add_image_async()
+enum jc_image_state {
+	JC_IMAGE_QUEUED,
+	JC_IMAGE_HEADER, // width, height and cost are valid
+	JC_IMAGE_DONE, // coefficients read
+	JC_IMAGE_FAILED, // err.msg says why
+};
+
 struct jc {
 	struct jpeg_compress_struct dstinfo;
 	jvirt_barray_ptr *dst_coef_arrays;
+	// the blocks of dst_coef_arrays if they were spilled to a file
+	void *spill_map;
+	size_t spill_size;
 
 	struct jc_image {
-		struct jpeg_decompress_struct srcinfo;
-		jvirt_barray_ptr *src_coef_arrays;
-	} *images;
+		struct jpeg_decompress_struct srcinfo; // only valid if created
+		jvirt_barray_ptr *src_coef_arrays; // NULL if not loaded right now
+		bool created;
+
+		unsigned width;
+		unsigned height;
+		size_t cost; // size of the coefficient arrays
+		char *path; // for loading it at save time (with a memory budget)
+		const unsigned char *buf; // or this, for jc_add_image_mem()
+		size_t bufsize;
+		bool mapped; // buf is a .jcf file mapped by jc_image_open()
+		bool jcf; // buf is a jcf, whose blocks are used where they are
+
+		// images from jc_add_image_async() belong to a worker (and use
+		// their own error manager) until jc_wait_image() takes them back
+		bool async;
+		enum jc_image_state state; // protected by pool.lock
+		struct jc_errmgr err;
+		FILE *f;
+		struct jc_image *next; // in pool.queue
+	} **images; // pointers so that workers can keep theirs when this grows
 	unsigned images_cnt;
-
-#define x_y_w_to_i(x, y, w) ((y)*(w) + (x))
-#define i_w_to_x_y(i, w, xp, yp) ({ *(xp) = (i)%(w); *(yp) = ((i)-*(xp))/(w); })
-	struct jc_block {
-		short src_x;
-		short src_y;
-		unsigned short img_idx;
-		unsigned short initialized;
-	} *blocks;
-	unsigned blocks_cnt;
+	size_t images_loaded_cost;
+
+	// where each 8x8 block of the output comes from. split into square tiles
+	// whose block arrays are only allocated when something is drawn to part
+	// of the tile. a tile covered by a single drawimage call just stores the
+	// offset instead
+	struct jc_tile {
+		struct jc_block {
+			int32_t src_x;
+			int32_t src_y;
+			uint32_t img; // image index + 1, 0 if not drawn to yet, JC_MAP_BLANK
+		} *blocks;
+		// if blocks is NULL: block (x, y) comes from (x+off_x, y+off_y)
+		int32_t off_x;
+		int32_t off_y;
+		uint32_t img;
+	} *tiles;
+	unsigned tiles_w;
+	unsigned tiles_h;
 	unsigned blocks_arr_width;
 	unsigned blocks_arr_height;
 
+	// output buffer of jc_new_mem() canvases
+	struct jc_mem_dest {
+		struct jpeg_destination_mgr pub; // must be the first member
+		unsigned char *buf;
+		size_t size;
+		size_t cap;
+		bool done;
+	} mem;
+
 	struct {
-		FILE *f;
+		FILE *f; // NULL for jc_new_mem()
 		int w;
 		int h;
+		bool saved;
+		char *spill_dir; // see jc_set_spill()
+		size_t spill_limit;
+		size_t budget; // 0 = keep every image loaded
+		bool resample_chroma; // see jc_set_resample_chroma()
+		bool jcf; // write f as a jcf (jc_new() with a .jcf path)
 	} params;
 
-	struct jc_errmgr {
-		struct jpeg_error_mgr jerr; // must be the first member
-		bool valid;
-		jmp_buf ret;
-	} err;
+	struct jc_errmgr err;
+
+	// workers for jc_add_image_async(), started by its first call
+	struct jc_pool {
+		pthread_t threads[JC_MAX_THREADS];
+		int nthreads;
+		pthread_mutex_t lock;
+		pthread_cond_t cond; // the queue or the state of an image changed
+		struct jc_image *queue;
+		struct jc_image *queue_tail;
+		bool quit;
+	} pool;
+
+	// jc_save_variants(). the variants are encoded on threads of their own
+	// while jc_save() writes the canvas' own output
+	struct jc_variants {
+		struct jc_variant_job *jobs;
+		size_t cnt;
+		// of dstinfo.dest, which is replaced to wait for the variants
+		// before jpeg_finish_compress() frees the coefficient arrays
+		void (*term_destination)(j_compress_ptr cinfo);
+	} variants;
 };
 
-#if 1
- #define JC_TRY(self) if (self->err.valid = true, __builtin_expect(setjmp(self->err.ret) == 0, 1))
- #define JC_CATCH(self) else if (self->err.valid = false, 1)
- #define JC_ENDTRY(self) self->err.valid = false
-#else
- #define JC_TRY(self) if (1)
- #define JC_CATCH(self) else if (0)
- #define JC_ENDTRY(self)
-#endif
+// one variant being encoded. it reads the same coefficient arrays as dstinfo
+// with its own compressor
+struct jc_variant_job {
+	struct jpeg_compress_struct cinfo;
+	struct jc_errmgr err;
+	struct jc_mem_dest mem; // if the variant has no path
+	FILE *f;
+
+	struct jc *canvas;
+	const struct jc_variant *variant;
+
+	pthread_t thread;
+	bool started;
+	bool ok;
+};
+
+// all state is in the jc, so different canvases can be used from different
+// threads at the same time (one canvas is still one thread at a time). the
+// workers of jc_add_image_async() only touch the images given to them and
+// read dstinfo, which doesn't change while they're running
+
+// every libjpeg call goes inside one of these. they nest: the error handler
+// jumps to the innermost one and pops it. locals changed inside the try and
+// read in the catch need to be volatile
+// JC_ENDTRY is needed on the success path only but is harmless after a catch
+// self is the jc, or a jc_image or jc_variant_job using its own error manager
+struct jc_try {
+	jmp_buf buf;
+	struct jc_try *prev;
+};
+
+#define JC_TRY(self, tr) if ((tr).prev = (self)->err.top, (self)->err.top = &(tr), L(setjmp((tr).buf) == 0))
+#define JC_CATCH(self, tr) else
+#define JC_ENDTRY(self, tr) ((self)->err.top = ((self)->err.top == &(tr)) ? (tr).prev : (self)->err.top)
 
 __attribute__((cold))
 static void jc_error_handler(j_common_ptr cinfo)
 {
-	struct jpeg_error_mgr *errmgr = cinfo->err;
-	struct jc_errmgr *err = (struct jc_errmgr *)errmgr;
-	char errmsg[JMSG_LENGTH_MAX];
+	struct jc_errmgr *err = (struct jc_errmgr *)cinfo->err;
+	struct jc_try *tr = err->top;
 
-	if L (err->valid) {
-		err->valid = false;
-		longjmp(err->ret, 1);
-	} else {
-		cinfo->err->format_message(cinfo, errmsg);
-		fprintf(stderr, "jcanvas: unexpected error: %s\n", errmsg);
+	cinfo->err->format_message(cinfo, err->msg);
+
+	if U (!tr) {
+		// libjpeg called outside JC_TRY. can't return from here
+		fprintf(stderr, "jcanvas: unexpected error: %s\n", err->msg);
 		abort();
 	}
+
+	err->top = tr->prev;
+	longjmp(tr->buf, 1);
+}
+
+static void jc_output_message(j_common_ptr cinfo)
+{
+	struct jc_errmgr *err = (struct jc_errmgr *)cinfo->err;
+
+	cinfo->err->format_message(cinfo, err->msg);
+}
+
+static struct jpeg_error_mgr *jc_errmgr_init(struct jc_errmgr *err)
+{
+	jpeg_std_error(&err->jerr);
+	err->jerr.error_exit = jc_error_handler;
+	err->jerr.output_message = jc_output_message;
+	err->top = NULL;
+
+	return &err->jerr;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void jc_set_error(struct jc *self, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(self->err.msg, sizeof(self->err.msg), fmt, ap);
+	va_end(ap);
+}
+
+const char *jc_get_error(struct jc *self)
+{
+	if U (!self)
+		return "out of memory";
+
+	return self->err.msg;
 }
 
+// rows of the output coefficient arrays written at a time, in iMCU rows
+#define JC_STRIP_IMCU_ROWS 16
+
 // -----------------------------------------------------------------------------
 
-struct jc *jc_new(const char *savepath, int w, int h)
+// img of blocks drawn with JC_BLANK
+#define JC_MAP_BLANK UINT32_MAX
+
+// block map tiles are JC_TILE_SIZE*JC_TILE_SIZE blocks (48 KiB when allocated)
+#define JC_TILE_SHIFT 6
+#define JC_TILE_SIZE (1u<<JC_TILE_SHIFT)
+#define JC_TILE_MASK (JC_TILE_SIZE-1)
+
+static inline struct jc_tile *jc_map_tile(struct jc *self, unsigned x, unsigned y)
+{
+	return &self->tiles[(size_t)(y>>JC_TILE_SHIFT)*self->tiles_w + (x>>JC_TILE_SHIFT)];
+}
+
+// false if the block hasn't been drawn to
+static inline bool jc_map_get(struct jc *self, unsigned x, unsigned y, struct jc_block *out)
+{
+	struct jc_tile *tile = jc_map_tile(self, x, y);
+
+	if (tile->blocks) {
+		*out = tile->blocks[(y&JC_TILE_MASK)*JC_TILE_SIZE + (x&JC_TILE_MASK)];
+	} else {
+		out->src_x = x+tile->off_x;
+		out->src_y = y+tile->off_y;
+		out->img = tile->img;
+	}
+
+	return (out->img != 0);
+}
+
+// gives the tile its own block array
+static bool jc_map_expand(struct jc *self, struct jc_tile *tile)
+{
+	size_t i = tile-self->tiles;
+	unsigned x0 = (i%self->tiles_w)<<JC_TILE_SHIFT;
+	unsigned y0 = (i/self->tiles_w)<<JC_TILE_SHIFT;
+	struct jc_block *blocks;
+
+	if U (!(blocks = malloc(JC_TILE_SIZE*JC_TILE_SIZE*sizeof(*blocks))))
+		return false;
+
+	for (unsigned y = 0; y < JC_TILE_SIZE; y++) {
+		for (unsigned x = 0; x < JC_TILE_SIZE; x++) {
+			struct jc_block *b = &blocks[y*JC_TILE_SIZE + x];
+
+			b->src_x = x0+x+tile->off_x;
+			b->src_y = y0+y+tile->off_y;
+			b->img = tile->img;
+		}
+	}
+
+	tile->blocks = blocks;
+
+	return true;
+}
+
+static bool jc_map_set(struct jc *self, unsigned x, unsigned y, const struct jc_block *b)
+{
+	struct jc_tile *tile = jc_map_tile(self, x, y);
+
+	if (!tile->blocks) {
+		if (b->img == tile->img &&
+		    (b->img == 0 || (b->src_x == x+tile->off_x && b->src_y == y+tile->off_y)))
+			return true;
+		if U (!jc_map_expand(self, tile))
+			return false;
+	}
+
+	tile->blocks[(y&JC_TILE_MASK)*JC_TILE_SIZE + (x&JC_TILE_MASK)] = *b;
+
+	return true;
+}
+
+// block (x, y) in the rectangle comes from (x+off_x, y+off_y) of image img
+static bool jc_map_fill(struct jc *self,
+	unsigned x0, unsigned y0,
+	unsigned width, unsigned height,
+	int32_t off_x, int32_t off_y,
+	uint32_t img)
+{
+	for (unsigned ty = y0>>JC_TILE_SHIFT; ty <= (y0+height-1)>>JC_TILE_SHIFT; ty++) {
+		for (unsigned tx = x0>>JC_TILE_SHIFT; tx <= (x0+width-1)>>JC_TILE_SHIFT; tx++) {
+			struct jc_tile *tile = &self->tiles[(size_t)ty*self->tiles_w + tx];
+			// part of the tile that's inside the canvas
+			unsigned tx0 = tx<<JC_TILE_SHIFT;
+			unsigned ty0 = ty<<JC_TILE_SHIFT;
+			unsigned tx1 = MIN(tx0+JC_TILE_SIZE, self->blocks_arr_width);
+			unsigned ty1 = MIN(ty0+JC_TILE_SIZE, self->blocks_arr_height);
+			// part of that which is drawn to
+			unsigned ix0 = MAX(x0, tx0);
+			unsigned iy0 = MAX(y0, ty0);
+			unsigned ix1 = MIN(x0+width, tx1);
+			unsigned iy1 = MIN(y0+height, ty1);
+
+			if (ix0 == tx0 && iy0 == ty0 && ix1 == tx1 && iy1 == ty1) {
+				free(tile->blocks);
+				tile->blocks = NULL;
+				tile->off_x = off_x;
+				tile->off_y = off_y;
+				tile->img = img;
+				continue;
+			}
+
+			if U (!tile->blocks && !jc_map_expand(self, tile))
+				return false;
+
+			for (unsigned y = iy0; y < iy1; y++) {
+				struct jc_block *row = &tile->blocks[(y&JC_TILE_MASK)*JC_TILE_SIZE];
+
+				for (unsigned x = ix0; x < ix1; x++) {
+					row[x&JC_TILE_MASK].src_x = x+off_x;
+					row[x&JC_TILE_MASK].src_y = y+off_y;
+					row[x&JC_TILE_MASK].img = img;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+// copies a rectangle of the map to another place in it, top row first
+static bool jc_map_copy(struct jc *self,
+	unsigned destX, unsigned destY,
+	unsigned srcX, unsigned srcY,
+	unsigned width, unsigned height)
+{
+	struct jc_block *row;
+	bool ok = true;
+
+	if (destX == srcX && destY == srcY)
+		return true;
+
+	if U (!(row = malloc(width*sizeof(*row))))
+		return false;
+
+	for (unsigned y = 0; ok && y < height; y++) {
+		for (unsigned x = 0; x < width; x++)
+			jc_map_get(self, srcX+x, srcY+y, &row[x]);
+		for (unsigned x = 0; ok && x < width; x++)
+			ok = jc_map_set(self, destX+x, destY+y, &row[x]);
+	}
+
+	free(row);
+
+	return ok;
+}
+
+// has every block been drawn to
+static bool jc_map_complete(struct jc *self)
+{
+	for (unsigned ty = 0; ty < self->tiles_h; ty++) {
+		for (unsigned tx = 0; tx < self->tiles_w; tx++) {
+			struct jc_tile *tile = &self->tiles[(size_t)ty*self->tiles_w + tx];
+			unsigned w = MIN(JC_TILE_SIZE, self->blocks_arr_width-(tx<<JC_TILE_SHIFT));
+			unsigned h = MIN(JC_TILE_SIZE, self->blocks_arr_height-(ty<<JC_TILE_SHIFT));
+
+			if (!tile->blocks) {
+				if (tile->img == 0)
+					return false;
+				continue;
+			}
+			for (unsigned y = 0; y < h; y++)
+				for (unsigned x = 0; x < w; x++)
+					if (tile->blocks[y*JC_TILE_SIZE + x].img == 0)
+						return false;
+		}
+	}
+
+	return true;
+}
+
+static void jc_map_free(struct jc *self)
+{
+	size_t cnt = (size_t)self->tiles_w*self->tiles_h;
+
+	for (size_t i = 0; i < cnt; i++)
+		free(self->tiles[i].blocks);
+	free(self->tiles);
+
+	self->tiles = NULL;
+	self->tiles_w = 0;
+	self->tiles_h = 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// destination manager for jc_new_mem(). the buffer grows as needed and
+// belongs to the canvas until jc_take_output()
+
+#define JC_MEM_DEST_INITIAL (64*1024)
+
+static void jc_mem_init_destination(j_compress_ptr cinfo)
+{
+	struct jc_mem_dest *dest = (struct jc_mem_dest *)cinfo->dest;
+
+	if (!dest->buf) {
+		if U (!(dest->buf = malloc(JC_MEM_DEST_INITIAL)))
+			ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+		dest->cap = JC_MEM_DEST_INITIAL;
+	}
+
+	dest->pub.next_output_byte = dest->buf;
+	dest->pub.free_in_buffer = dest->cap;
+	dest->size = 0;
+	dest->done = false;
+}
+
+static boolean jc_mem_empty_output_buffer(j_compress_ptr cinfo)
+{
+	struct jc_mem_dest *dest = (struct jc_mem_dest *)cinfo->dest;
+	unsigned char *newbuf;
+
+	// called when the whole buffer is full
+	if U (!(newbuf = realloc(dest->buf, dest->cap*2)))
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+	dest->pub.next_output_byte = newbuf+dest->cap;
+	dest->pub.free_in_buffer = dest->cap;
+	dest->buf = newbuf;
+	dest->cap *= 2;
+
+	return TRUE;
+}
+
+static void jc_mem_term_destination(j_compress_ptr cinfo)
+{
+	struct jc_mem_dest *dest = (struct jc_mem_dest *)cinfo->dest;
+
+	dest->size = dest->cap-dest->pub.free_in_buffer;
+	dest->done = true;
+}
+
+static struct jc *jc_new_common(FILE *f, int w, int h)
 {
 	struct jc *self;
-	FILE *f;
+	struct jc_try tr;
 
 	if U (!(self = calloc(1, sizeof(*self))))
 		return NULL;
 
-	if U (!(f = fopen(savepath, "w"))) {
+	self->dstinfo.err = jc_errmgr_init(&self->err);
+
+	JC_TRY(self, tr) {
+		jpeg_create_compress(&self->dstinfo);
+		// the blocks of jcf images are read through dstinfo too
+		jcf_hook((j_common_ptr)&self->dstinfo);
+		if (f) {
+			jpeg_stdio_dest(&self->dstinfo, f);
+		} else {
+			self->mem.pub.init_destination = jc_mem_init_destination;
+			self->mem.pub.empty_output_buffer = jc_mem_empty_output_buffer;
+			self->mem.pub.term_destination = jc_mem_term_destination;
+			self->dstinfo.dest = &self->mem.pub;
+		}
+	} JC_CATCH(self, tr) {
+		jpeg_destroy_compress(&self->dstinfo);
 		free(self);
 		return NULL;
-	}
-
-	self->dstinfo.err = jpeg_std_error(&self->err.jerr);
-	self->err.jerr.error_exit = jc_error_handler;
-
-	jpeg_create_compress(&self->dstinfo);
-	jpeg_stdio_dest(&self->dstinfo, f);
+	} JC_ENDTRY(self, tr);
 
 	self->params.f = f;
 	self->params.w = w;
@@ -166,65 +558,628 @@ struct jc *jc_new(const char *savepath, int w, int h)
 	return self;
 }
 
+struct jc *jc_new(const char *savepath, int w, int h)
+{
+	struct jc *self;
+	FILE *f;
+
+	if U (!(f = fopen(savepath, "w")))
+		return NULL;
+
+	if U (!(self = jc_new_common(f, w, h))) {
+		fclose(f);
+		return NULL;
+	}
+	self->params.jcf = jcf_path(savepath);
+
+	return self;
+}
+
+struct jc *jc_new_mem(int w, int h)
+{
+	return jc_new_common(NULL, w, h);
+}
+
+unsigned char *jc_take_output(struct jc *self, size_t *size)
+{
+	unsigned char *buf;
+
+	if U (!self)
+		return NULL;
+	if U (self->params.f || !self->mem.done) {
+		jc_set_error(self, "no output in memory (not a jc_new_mem() canvas, or not saved)");
+		return NULL;
+	}
+
+	buf = self->mem.buf;
+	*size = self->mem.size;
+
+	self->mem.buf = NULL;
+	self->mem.done = false;
+
+	return buf;
+}
+
+bool jc_set_spill(struct jc *self, const char *dir, size_t limit)
+{
+	char *copy = NULL;
+
+	if U (!self)
+		return false;
+	if U (self->images_cnt != 0) {
+		jc_set_error(self, "spilling has to be set up before adding images");
+		return false;
+	}
+	if U (dir && !(copy = strdup(dir))) {
+		jc_set_error(self, "out of memory");
+		return false;
+	}
+
+	free(self->params.spill_dir);
+	self->params.spill_dir = copy;
+	self->params.spill_limit = limit;
+
+	return true;
+}
+
 // -----------------------------------------------------------------------------
 
 static struct jc_image *jc_alloc_next_image(struct jc *self);
 static const char *jc_check_supported(struct jc *self, j_decompress_ptr img);
-static const char *jc_check_compatible(struct jc *self, j_decompress_ptr img0, j_decompress_ptr imgx);
+static const char *jc_check_compatible(struct jc *self, j_compress_ptr ref, j_decompress_ptr imgx);
 static bool jc_alloc_output(struct jc *self, struct jc_image *image);
+static size_t jc_image_cost(j_decompress_ptr srcinfo);
+static bool jc_wait_image(struct jc *self, struct jc_image *image, enum jc_image_state want);
+static void jc_pool_stop(struct jc *self);
 
-int jc_add_image(struct jc *self, const char *path)
+// opens path for reading. a .jcf is mapped into image->buf instead and *f is
+// left NULL. false and errno on failure
+static bool jc_image_open(struct jc_image *image, const char *path, FILE **f)
+{
+	*f = NULL;
+
+	if (jcf_path(path)) {
+		if U (!(image->buf = jcf_map(path, &image->bufsize)))
+			return false;
+		image->mapped = true;
+		return true;
+	}
+
+	return (*f = fopen(path, "r")) != NULL;
+}
+
+static void jc_image_unmap(struct jc_image *image)
+{
+	if (image->mapped) {
+		jcf_unmap((void *)image->buf, image->bufsize);
+		image->buf = NULL;
+		image->mapped = false;
+	}
+}
+
+// from f, or from image->buf if f is NULL (which can also be a jcf)
+static void jc_image_read_header(struct jc_image *image, FILE *f)
+{
+	if (!f && jcf_is_jcf(image->buf, image->bufsize)) {
+		image->jcf = true;
+		jcf_read_header(&image->srcinfo, image->buf, image->bufsize);
+		return;
+	}
+
+	if (f) {
+		jpeg_stdio_src(&image->srcinfo, f);
+	} else {
+		// (older libjpegs take a non-const buffer but don't write to it)
+		jpeg_mem_src(&image->srcinfo, (unsigned char *)image->buf, image->bufsize);
+	}
+	jpeg_read_header(&image->srcinfo, /* require_image */ TRUE);
+}
+
+// after jc_image_read_header(). the file can be closed afterwards
+static jvirt_barray_ptr *jc_image_read_coefficients(struct jc_image *image, FILE *f)
+{
+	jvirt_barray_ptr *coef_arrays;
+
+	// (nothing writes to the source arrays)
+	if (image->jcf)
+		return jcf_read_coefficients(&image->srcinfo, (void *)image->buf);
+
+	coef_arrays = jpeg_read_coefficients(&image->srcinfo);
+	if (f)
+		jpeg_stdio_src(&image->srcinfo, NULL);
+
+	return coef_arrays;
+}
+
+// jcf images cost nothing: their blocks are in the buffer, which for a .jcf
+// path is a mapping of the file
+static size_t jc_image_cost_of(struct jc_image *image)
+{
+	return (image->jcf) ? 0 : jc_image_cost(&image->srcinfo);
+}
+
+// reads from path, or from buf if path is NULL
+static int jc_add_image_common(struct jc *self, const char *path, const void *buf, size_t size)
 {
 	FILE *f;
 	struct jc_image *image;
+	struct jc_try tr;
 	const char *reason;
+	bool keep;
 
 	if U (!self)
 		return -1;
 
-	if U (!(f = fopen(path, "r")))
+	if U (!(image = jc_alloc_next_image(self))) {
+		jc_set_error(self, "out of memory");
 		return -1;
+	}
 
-	if U (!(image = jc_alloc_next_image(self))) {
-		fclose(f);
+	if (!path) {
+		f = NULL;
+		path = "(buffer)";
+		image->buf = buf;
+		image->bufsize = size;
+	} else if U (!jc_image_open(image, path, &f)) {
+		jc_set_error(self, "%s: %s", path, strerror(errno));
+		free(image);
 		return -1;
 	}
 
 	image->srcinfo.err = &self->err.jerr;
-	jpeg_create_decompress(&image->srcinfo);
-	jpeg_stdio_src(&image->srcinfo, f);
 
-	JC_TRY(self) {
-		jpeg_read_header(&image->srcinfo, /* require_image */ TRUE);
-	} JC_CATCH(self) {
+	JC_TRY(self, tr) {
+		jpeg_create_decompress(&image->srcinfo);
+		jc_image_read_header(image, f);
+	} JC_CATCH(self, tr) {
+		jpeg_destroy_decompress(&image->srcinfo);
+		jc_image_unmap(image);
+		free(image);
+		if (f)
+			fclose(f);
+		return -1;
+	} JC_ENDTRY(self, tr);
+
+	image->created = true;
+
+	if U ((reason = jc_check_supported(self, &image->srcinfo)) ||
+	      (self->images_cnt > 0 && (reason = jc_check_compatible(self, &self->dstinfo, &image->srcinfo)))) {
+		jc_set_error(self, "%s: %s", path, reason);
+		goto err;
+	}
+
+	image->width = image->srcinfo.image_width;
+	image->height = image->srcinfo.image_height;
+	image->cost = jc_image_cost_of(image);
+
+	// with a budget, images that don't fit are only looked at again when saving
+	keep = (self->params.budget == 0 ||
+	    self->images_loaded_cost+image->cost <= self->params.budget);
+
+	if (self->params.budget != 0 && f && !(image->path = strdup(path))) {
+		jc_set_error(self, "out of memory");
+		goto err;
+	}
+
+	if (keep) {
+		JC_TRY(self, tr) {
+			image->src_coef_arrays = jc_image_read_coefficients(image, f);
+		} JC_CATCH(self, tr) {
+			goto err;
+		} JC_ENDTRY(self, tr);
+
+		self->images_loaded_cost += image->cost;
+	}
+
+	if (f) {
+		fclose(f);
+		f = NULL;
+	}
+
+	// the output takes its parameters from the first image
+	if (self->images_cnt == 0) {
+		if U (!jc_alloc_output(self, image))
+			goto err;
+	}
+
+	if (!keep) {
 		jpeg_destroy_decompress(&image->srcinfo);
+		image->created = false;
+	}
+
+	return self->images_cnt++;
+err:
+	if (image->src_coef_arrays)
+		self->images_loaded_cost -= image->cost;
+	jpeg_destroy_decompress(&image->srcinfo);
+	jc_image_unmap(image);
+	free(image->path);
+	free(image);
+	if (f)
 		fclose(f);
+	return -1;
+}
+
+int jc_add_image(struct jc *self, const char *path)
+{
+	return jc_add_image_common(self, path, NULL, 0);
+}
+
+int jc_add_image_mem(struct jc *self, const void *buf, size_t size)
+{
+	return jc_add_image_common(self, NULL, buf, size);
+}
+
+// -----------------------------------------------------------------------------
+
+// runs on a worker. the image's header may have been read already (the first
+// image's is, by jc_add_image_async())
+static void jc_read_image_async(struct jc *self, struct jc_image *image)
+{
+	struct jc_try tr;
+	const char *reason;
+	enum jc_image_state state;
+
+	if (!image->created) {
+		if U (!jc_image_open(image, image->path, &image->f)) {
+			snprintf(image->err.msg, sizeof(image->err.msg), "%s", strerror(errno));
+			goto fail;
+		}
+
+		JC_TRY(image, tr) {
+			jpeg_create_decompress(&image->srcinfo);
+			jc_image_read_header(image, image->f);
+		} JC_CATCH(image, tr) {
+			jpeg_destroy_decompress(&image->srcinfo);
+			goto fail;
+		} JC_ENDTRY(image, tr);
+
+		image->created = true;
+
+		if U ((reason = jc_check_supported(self, &image->srcinfo)) ||
+		      (reason = jc_check_compatible(self, &self->dstinfo, &image->srcinfo))) {
+			snprintf(image->err.msg, sizeof(image->err.msg), "%s", reason);
+			goto fail;
+		}
+
+		image->width = image->srcinfo.image_width;
+		image->height = image->srcinfo.image_height;
+		image->cost = jc_image_cost_of(image);
+
+		pthread_mutex_lock(&self->pool.lock);
+		image->state = JC_IMAGE_HEADER;
+		pthread_cond_broadcast(&self->pool.cond);
+		pthread_mutex_unlock(&self->pool.lock);
+	}
+
+	JC_TRY(image, tr) {
+		image->src_coef_arrays = jc_image_read_coefficients(image, image->f);
+	} JC_CATCH(image, tr) {
+		goto fail;
+	} JC_ENDTRY(image, tr);
+
+	state = JC_IMAGE_DONE;
+	goto out;
+fail:
+	state = JC_IMAGE_FAILED;
+out:
+	if (image->f) {
+		fclose(image->f);
+		image->f = NULL;
+	}
+
+	pthread_mutex_lock(&self->pool.lock);
+	image->state = state;
+	pthread_cond_broadcast(&self->pool.cond);
+	pthread_mutex_unlock(&self->pool.lock);
+}
+
+static void *jc_worker(void *arg)
+{
+	struct jc *self = arg;
+	struct jc_pool *pool = &self->pool;
+
+	for (;;) {
+		struct jc_image *image;
+
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->queue && !pool->quit)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->quit) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		image = pool->queue;
+		if (!(pool->queue = image->next))
+			pool->queue_tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		jc_read_image_async(self, image);
+	}
+
+	return NULL;
+}
+
+static bool jc_pool_start(struct jc *self)
+{
+	struct jc_pool *pool = &self->pool;
+	long ncpu;
+	int n;
+
+	if (pool->nthreads)
+		return true;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = (ncpu > 0) ? MIN(ncpu, JC_MAX_THREADS) : 1;
+
+	if U (pthread_mutex_init(&pool->lock, NULL) != 0)
+		return false;
+	if U (pthread_cond_init(&pool->cond, NULL) != 0) {
+		pthread_mutex_destroy(&pool->lock);
+		return false;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if U (pthread_create(&pool->threads[i], NULL, jc_worker, self) != 0)
+			break;
+		pool->nthreads++;
+	}
+	if U (pool->nthreads == 0) {
+		pthread_cond_destroy(&pool->cond);
+		pthread_mutex_destroy(&pool->lock);
+		return false;
+	}
+
+	return true;
+}
+
+// images still in the queue are left alone
+static void jc_pool_stop(struct jc *self)
+{
+	struct jc_pool *pool = &self->pool;
+
+	if (!pool->nthreads)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	pool->nthreads = 0;
+}
+
+// waits until a worker has got at least this far with the image. once it's
+// done, the image is the canvas' own again like one from jc_add_image()
+static bool jc_wait_image(struct jc *self, struct jc_image *image, enum jc_image_state want)
+{
+	enum jc_image_state state;
+
+	if L (!image->async)
+		return true;
+
+	pthread_mutex_lock(&self->pool.lock);
+	while ((state = image->state) < want)
+		pthread_cond_wait(&self->pool.cond, &self->pool.lock);
+	pthread_mutex_unlock(&self->pool.lock);
+
+	if U (state == JC_IMAGE_FAILED) {
+		jc_set_error(self, "%s: %s", image->path, image->err.msg);
+		return false;
+	}
+
+	if (state == JC_IMAGE_DONE) {
+		image->srcinfo.err = &self->err.jerr;
+		image->async = false;
+		self->images_loaded_cost += image->cost;
+	}
+
+	return true;
+}
+
+int jc_add_image_async(struct jc *self, const char *path)
+{
+	struct jc_image *image;
+	struct jc_try tr;
+	const char *reason;
+
+	if U (!self)
+		return -1;
+
+	// with a budget, what's kept is decided while adding
+	if (self->params.budget != 0)
+		return jc_add_image(self, path);
+
+	if U (!jc_pool_start(self)) {
+		jc_set_error(self, "couldn't start the worker threads");
 		return -1;
-	} JC_ENDTRY(self);
+	}
+
+	if U (!(image = jc_alloc_next_image(self)) ||
+	      !(image->path = strdup(path))) {
+		jc_set_error(self, "out of memory");
+		free(image);
+		return -1;
+	}
+
+	image->srcinfo.err = jc_errmgr_init(&image->err);
+
+	// the output takes its parameters from the first image, so its header
+	// is read right away
+	if (self->images_cnt == 0) {
+		if U (!jc_image_open(image, path, &image->f)) {
+			jc_set_error(self, "%s: %s", path, strerror(errno));
+			goto err;
+		}
+
+		JC_TRY(image, tr) {
+			jpeg_create_decompress(&image->srcinfo);
+			jc_image_read_header(image, image->f);
+		} JC_CATCH(image, tr) {
+			jc_set_error(self, "%s", image->err.msg);
+			jpeg_destroy_decompress(&image->srcinfo);
+			goto err;
+		} JC_ENDTRY(image, tr);
+
+		image->created = true;
+
+		if U ((reason = jc_check_supported(self, &image->srcinfo))) {
+			jc_set_error(self, "%s: %s", path, reason);
+			goto err;
+		}
+
+		image->width = image->srcinfo.image_width;
+		image->height = image->srcinfo.image_height;
+		image->cost = jc_image_cost_of(image);
+
+		if U (!jc_alloc_output(self, image))
+			goto err;
+
+		image->state = JC_IMAGE_HEADER;
+	} else {
+		image->state = JC_IMAGE_QUEUED;
+	}
+
+	image->async = true;
+
+	pthread_mutex_lock(&self->pool.lock);
+	if (self->pool.queue_tail)
+		self->pool.queue_tail->next = image;
+	else
+		self->pool.queue = image;
+	self->pool.queue_tail = image;
+	pthread_cond_broadcast(&self->pool.cond);
+	pthread_mutex_unlock(&self->pool.lock);
+
+	return self->images_cnt++;
+err:
+	if (image->created)
+		jpeg_destroy_decompress(&image->srcinfo);
+	if (image->f)
+		fclose(image->f);
+	jc_image_unmap(image);
+	free(image->path);
+	free(image);
+	return -1;
+}
+
+bool jc_set_memory_budget(struct jc *self, size_t budget)
+{
+	if U (!self)
+		return false;
+	if U (self->images_cnt != 0) {
+		jc_set_error(self, "the memory budget has to be set before adding images");
+		return false;
+	}
+
+	self->params.budget = budget;
+
+	return true;
+}
+
+bool jc_set_resample_chroma(struct jc *self, bool enable)
+{
+	if U (!self)
+		return false;
+	if U (self->images_cnt != 0) {
+		jc_set_error(self, "chroma resampling has to be enabled before adding images");
+		return false;
+	}
+
+	self->params.resample_chroma = enable;
+
+	return true;
+}
+
+// what jpeg_read_coefficients() will allocate for the image (roughly)
+static size_t jc_image_cost(j_decompress_ptr srcinfo)
+{
+	size_t cost = 0;
+
+	for (int ci = 0; ci < srcinfo->num_components; ci++) {
+		jpeg_component_info *compptr = &srcinfo->comp_info[ci];
+
+		cost += (size_t)round_up(compptr->width_in_blocks, compptr->h_samp_factor) *
+		    round_up(compptr->height_in_blocks, compptr->v_samp_factor) *
+		    sizeof(JBLOCK);
+	}
+
+	return cost;
+}
+
+// reads the coefficients of an image that jc_add_image() didn't keep
+static bool jc_load_image(struct jc *self, struct jc_image *image)
+{
+	const char *name = (image->path) ? image->path : "(buffer)";
+	struct jc_try tr;
+	FILE *f;
+
+D	assert(!image->created && (image->path || image->buf));
+
+	if (!image->path) {
+		f = NULL;
+	} else if U (!(f = fopen(image->path, "r"))) {
+		jc_set_error(self, "%s: %s", image->path, strerror(errno));
+		return false;
+	}
+
+	memset(&image->srcinfo, 0, sizeof(image->srcinfo));
+	image->srcinfo.err = &self->err.jerr;
+
+	JC_TRY(self, tr) {
+		jpeg_create_decompress(&image->srcinfo);
+		jc_image_read_header(image, f);
+
+		if U (image->srcinfo.image_width != image->width ||
+		      image->srcinfo.image_height != image->height ||
+		      jc_check_compatible(self, &self->dstinfo, &image->srcinfo)) {
+			jc_set_error(self, "%s: file changed after jc_add_image()", name);
+			jpeg_destroy_decompress(&image->srcinfo);
+			if (f)
+				fclose(f);
+			JC_ENDTRY(self, tr);
+			return false;
+		}
+
+		image->src_coef_arrays = jc_image_read_coefficients(image, f);
+	} JC_CATCH(self, tr) {
+		jpeg_destroy_decompress(&image->srcinfo);
+		image->src_coef_arrays = NULL;
+		if (f)
+			fclose(f);
+		return false;
+	} JC_ENDTRY(self, tr);
+
+	if (f)
+		fclose(f);
 
-	image->src_coef_arrays = jpeg_read_coefficients(&image->srcinfo);
-	jpeg_stdio_src(&image->srcinfo, NULL);
-	fclose(f); f = NULL;
+	image->created = true;
+	self->images_loaded_cost += image->cost;
 
-	if U ((reason = jc_check_supported(self, &image->srcinfo)) ||
-	      (self->images_cnt > 0 && (reason = jc_check_compatible(self, &self->images[0].srcinfo, &image->srcinfo)))) {
-		jpeg_destroy_decompress(&image->srcinfo);
-		return -1;
-	}
+	return true;
+}
 
-	if (self->images_cnt == 0) {
-		if U (!jc_alloc_output(self, image)) {
-			jpeg_destroy_decompress(&image->srcinfo);
-			return -1;
-		}
-	}
+static void jc_unload_image(struct jc *self, struct jc_image *image)
+{
+	if (image->src_coef_arrays)
+		self->images_loaded_cost -= image->cost;
+	if (image->created)
+		jpeg_destroy_decompress(&image->srcinfo);
 
-	return self->images_cnt++;
+	image->src_coef_arrays = NULL;
+	image->created = false;
 }
 
+// the image goes in images[images_cnt]. the caller increments that if
+// adding it works out, or frees the image if not
 static struct jc_image *jc_alloc_next_image(struct jc *self)
 {
-	struct jc_image *newimages;
+	struct jc_image **newimages;
 	struct jc_image *image;
 
 	newimages = reallocarray(self->images, self->images_cnt+1, sizeof(*self->images));
@@ -233,8 +1188,9 @@ static struct jc_image *jc_alloc_next_image(struct jc *self)
 
 	self->images = newimages;
 
-	image = &self->images[self->images_cnt];
-	memset(image, 0, sizeof(*image));
+	if U (!(image = calloc(1, sizeof(*image))))
+		return NULL;
+	self->images[self->images_cnt] = image;
 
 	return image;
 }
@@ -253,34 +1209,73 @@ static const char *jc_check_supported(struct jc *self, j_decompress_ptr img)
 	return NULL;
 }
 
-static const char *jc_check_compatible(struct jc *self, j_decompress_ptr img0, j_decompress_ptr imgx)
+// log2 of how many 8x8 blocks of the full-resolution grid one block of a
+// component covers (in one direction), -1 if it's not 1, 2 or 4
+static int jc_sampling_shift(int max_samp_factor, int samp_factor)
+{
+	if U (max_samp_factor % samp_factor != 0)
+		return -1;
+
+	switch (max_samp_factor/samp_factor) {
+	case 1: return 0;
+	case 2: return 1;
+	case 4: return 2;
+	}
+
+	return -1;
+}
+
+// ref is the output, which has the first image's parameters
+static const char *jc_check_compatible(struct jc *self, j_compress_ptr ref, j_decompress_ptr imgx)
 {
-	if U (imgx->jpeg_color_space != img0->jpeg_color_space)
+	if U (imgx->jpeg_color_space != ref->jpeg_color_space)
 		return "image has a different color space";
-	if U (imgx->num_components != img0->num_components)
+	if U (imgx->num_components != ref->num_components)
 		return "image has a different number of components";
 
 	if U (imgx->jpeg_color_space == JCS_UNKNOWN)
 		return "can't combine images with unknown color spaces";
 
-	for (int i = 0; i < img0->num_components; i++) {
-		jpeg_component_info *c0 = &img0->comp_info[i];
+	for (int i = 0; i < ref->num_components; i++) {
+		jpeg_component_info *cr = &ref->comp_info[i];
 		jpeg_component_info *cx = &imgx->comp_info[i];
-		void *q0, *qx;
+		void *qr, *qx;
 		size_t qsz;
 
-		if U (c0->h_samp_factor != cx->h_samp_factor)
-			goto err_sampling;
-		if U (c0->v_samp_factor != cx->v_samp_factor)
-			goto err_sampling;
-		if U (c0->quant_tbl_no != cx->quant_tbl_no)
+		if (self->params.resample_chroma) {
+			// blocks that cover a different area get resampled and
+			// requantized, so only the ones copied as is need the same
+			// quantization table
+			int rx = jc_sampling_shift(ref->max_h_samp_factor, cr->h_samp_factor);
+			int ry = jc_sampling_shift(ref->max_v_samp_factor, cr->v_samp_factor);
+			int xx = jc_sampling_shift(imgx->max_h_samp_factor, cx->h_samp_factor);
+			int xy = jc_sampling_shift(imgx->max_v_samp_factor, cx->v_samp_factor);
+
+			if U (rx == -1 || ry == -1 || xx == -1 || xy == -1)
+				goto err_sampling;
+			if (rx != xx || ry != xy) {
+				if U (i == 0)
+					return "image has differently sampled luma";
+				// one step (2x) at most, and the same way in both directions
+				if U (rx-xx > 1 || xx-rx > 1 || ry-xy > 1 || xy-ry > 1 ||
+				      (rx-xx)*(ry-xy) < 0)
+					return "can't resample between these subsamplings";
+				continue;
+			}
+		} else {
+			if U (cr->h_samp_factor != cx->h_samp_factor)
+				goto err_sampling;
+			if U (cr->v_samp_factor != cx->v_samp_factor)
+				goto err_sampling;
+		}
+		if U (cr->quant_tbl_no != cx->quant_tbl_no)
 			goto err_quant_no;
 
-		q0 = img0->quant_tbl_ptrs[c0->quant_tbl_no]->quantval;
-		qx = imgx->quant_tbl_ptrs[c0->quant_tbl_no]->quantval;
-		qsz = sizeof(img0->quant_tbl_ptrs[0]->quantval);
+		qr = ref->quant_tbl_ptrs[cr->quant_tbl_no]->quantval;
+		qx = imgx->quant_tbl_ptrs[cr->quant_tbl_no]->quantval;
+		qsz = sizeof(ref->quant_tbl_ptrs[0]->quantval);
 
-		if U (memcmp(q0, qx, qsz) != 0)
+		if U (memcmp(qr, qx, qsz) != 0)
 			goto err_quanttable;
 	}
 
@@ -293,15 +1288,65 @@ err_quant_no:
 	return "components use different quantization table indexes";
 }
 
-static bool jc_alloc_blocks(struct jc *self, int w, int h);
+static bool jc_alloc_map(struct jc *self, int w, int h);
+
+// the output's blocks in a deleted temporary file, mapped shared so that the
+// kernel can write them out to it instead of keeping them all in memory
+static bool jc_spill_map(struct jc *self, size_t size)
+{
+	char *path;
+	void *map;
+	int fd, e;
+
+	if U (!(path = malloc(strlen(self->params.spill_dir)+sizeof("/jcanvas.XXXXXX")))) {
+		jc_set_error(self, "out of memory");
+		return false;
+	}
+	sprintf(path, "%s/jcanvas.XXXXXX", self->params.spill_dir);
+
+	if U ((fd = mkstemp(path)) == -1) {
+		jc_set_error(self, "%s: %s", path, strerror(errno));
+		free(path);
+		return false;
+	}
+	unlink(path);
+
+	map = MAP_FAILED;
+	if L (ftruncate(fd, size) != -1)
+		map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	e = errno;
+	close(fd);
+	if U (map == MAP_FAILED) {
+		jc_set_error(self, "%s: %s", path, strerror(e));
+		free(path);
+		return false;
+	}
+	free(path);
+
+	self->spill_map = map;
+	self->spill_size = size;
+
+	return true;
+}
+
+static void jc_spill_unmap(struct jc *self)
+{
+	if (self->spill_map)
+		munmap(self->spill_map, self->spill_size);
+	self->spill_map = NULL;
+	self->spill_size = 0;
+}
 
 static bool jc_alloc_output(struct jc *self, struct jc_image *image)
 {
 	struct jpeg_decompress_struct *srcinfo = &image->srcinfo;
 	jvirt_barray_ptr *coef_arrays;
+	struct jc_try tr;
 	int w = self->params.w;
 	int h = self->params.h;
 	int dataw, datah;
+	JDIMENSION blocks_per_row[MAX_COMPONENTS], rows[MAX_COMPONENTS], maxaccess[MAX_COMPONENTS];
+	size_t offset[MAX_COMPONENTS], size = 0;
 
 	if (w == -1)
 		w = image->srcinfo.image_width;
@@ -310,13 +1355,10 @@ static bool jc_alloc_output(struct jc *self, struct jc_image *image)
 
 	dataw = round_up(w, srcinfo->max_h_samp_factor*DCTSIZE);
 	datah = round_up(h, srcinfo->max_v_samp_factor*DCTSIZE);
-	if U (!jc_alloc_blocks(self, dataw, datah))
+	if U (!jc_alloc_map(self, dataw, datah)) {
+		jc_set_error(self, "out of memory");
 		return false;
-
-	coef_arrays = self->dstinfo.mem->alloc_small(
-	    (j_common_ptr)&self->dstinfo,
-	    JPOOL_IMAGE,
-	    srcinfo->num_components*sizeof(jvirt_barray_ptr));
+	}
 
 	for (int ci = 0; ci < srcinfo->num_components; ci++) {
 		jpeg_component_info *compptr = &srcinfo->comp_info[ci];
@@ -333,30 +1375,68 @@ D		assert(!(h > srcinfo->image_height) || height_in_blocks >= compptr->height_in
 D		assert(!(h == srcinfo->image_height) || height_in_blocks == compptr->height_in_blocks);
 D		assert(!(h < srcinfo->image_height) || height_in_blocks <= compptr->height_in_blocks);
 
-		coef_arrays[ci] = self->dstinfo.mem->request_virt_barray(
-		    (j_common_ptr)&self->dstinfo,
-		    /* pool_id */ JPOOL_IMAGE,
-		    /* pre_zero */ FALSE,
-		    /* blocksperrow */ width_in_blocks*compptr->h_samp_factor,
-		    /* numrows */ height_in_blocks*compptr->v_samp_factor,
-		    /* maxaccess */ height_in_blocks*compptr->v_samp_factor);
+		blocks_per_row[ci] = width_in_blocks*compptr->h_samp_factor;
+		rows[ci] = height_in_blocks*compptr->v_samp_factor;
+		maxaccess[ci] = MIN(height_in_blocks, JC_STRIP_IMCU_ROWS)*compptr->v_samp_factor;
+		// (page aligned in case they're spilled)
+		offset[ci] = size;
+		size += round_up((size_t)blocks_per_row[ci]*rows[ci]*sizeof(JBLOCK), 4096);
 	}
 
-	jpeg_copy_critical_parameters(srcinfo, &self->dstinfo);
+	jc_spill_unmap(self);
+	if (self->params.spill_dir && size > self->params.spill_limit &&
+	    U (!jc_spill_map(self, size)))
+		return false;
+
+	JC_TRY(self, tr) {
+		coef_arrays = self->dstinfo.mem->alloc_small(
+		    (j_common_ptr)&self->dstinfo,
+		    JPOOL_IMAGE,
+		    srcinfo->num_components*sizeof(jvirt_barray_ptr));
+
+		for (int ci = 0; ci < srcinfo->num_components; ci++) {
+			if (self->spill_map) {
+				coef_arrays[ci] = jcf_plane_array(
+				    (j_common_ptr)&self->dstinfo,
+				    (JBLOCKROW)((unsigned char *)self->spill_map+offset[ci]),
+				    blocks_per_row[ci], rows[ci]);
+				continue;
+			}
+			coef_arrays[ci] = self->dstinfo.mem->request_virt_barray(
+			    (j_common_ptr)&self->dstinfo,
+			    /* pool_id */ JPOOL_IMAGE,
+			    /* pre_zero */ FALSE,
+			    /* blocksperrow */ blocks_per_row[ci],
+			    /* numrows */ rows[ci],
+			    /* maxaccess */ maxaccess[ci]);
+		}
+
+		jpeg_copy_critical_parameters(srcinfo, &self->dstinfo);
 
-	self->dstinfo.image_width = w;
-	self->dstinfo.image_height = h;
+		self->dstinfo.image_width = w;
+		self->dstinfo.image_height = h;
 
 #if JPEG_LIB_VERSION >= 70
-	self->dstinfo.jpeg_width = w;
-	self->dstinfo.jpeg_height = h;
+		self->dstinfo.jpeg_width = w;
+		self->dstinfo.jpeg_height = h;
 #endif
 
-	JC_TRY(self) {
-		jpeg_write_coefficients(&self->dstinfo, coef_arrays);
-	} JC_CATCH(self) {
+		// a jcf is written at save time (jpeg_write_coefficients() would
+		// start the jpg right away), but the arrays are needed now, and
+		// the max sampling factors that it would have worked out
+		if (self->params.jcf) {
+			self->dstinfo.max_h_samp_factor = srcinfo->max_h_samp_factor;
+			self->dstinfo.max_v_samp_factor = srcinfo->max_v_samp_factor;
+			self->dstinfo.mem->realize_virt_arrays((j_common_ptr)&self->dstinfo);
+		} else {
+			jpeg_write_coefficients(&self->dstinfo, coef_arrays);
+		}
+	} JC_CATCH(self, tr) {
+		// back to the state jc_new() left it in
+		jpeg_abort_compress(&self->dstinfo);
+		jc_spill_unmap(self);
 		return false;
-	} JC_ENDTRY(self);
+	} JC_ENDTRY(self, tr);
 
 	self->dst_coef_arrays = coef_arrays;
 	self->params.w = w;
@@ -365,21 +1445,24 @@ D		assert(!(h < srcinfo->image_height) || height_in_blocks <= compptr->height_in
 	return true;
 }
 
-static bool jc_alloc_blocks(struct jc *self, int w, int h)
+static bool jc_alloc_map(struct jc *self, int w, int h)
 {
-	struct jc_block *blocks;
 	unsigned blkw = jdiv_round_up(w, 8);
 	unsigned blkh = jdiv_round_up(h, 8);
-	unsigned blocks_cnt = blkw*blkh;
+	unsigned tiles_w = jdiv_round_up(blkw, JC_TILE_SIZE);
+	unsigned tiles_h = jdiv_round_up(blkh, JC_TILE_SIZE);
+	struct jc_tile *tiles;
 
-	blocks = calloc(blocks_cnt, sizeof(*blocks));
-	if U (!blocks)
+	// tiles start out as not drawn to (img = 0, no block array)
+	tiles = calloc((size_t)tiles_w*tiles_h, sizeof(*tiles));
+	if U (!tiles)
 		return false;
 
-	free(self->blocks);
+	jc_map_free(self);
 
-	self->blocks = blocks;
-	self->blocks_cnt = blocks_cnt;
+	self->tiles = tiles;
+	self->tiles_w = tiles_w;
+	self->tiles_h = tiles_h;
 	self->blocks_arr_width = blkw;
 	self->blocks_arr_height = blkh;
 
@@ -390,33 +1473,35 @@ static bool jc_alloc_blocks(struct jc *self, int w, int h)
 
 bool jc_get_info(struct jc *self, int idx, struct jc_info_struct *info_out)
 {
-	j_decompress_ptr srcinfo;
 	j_compress_ptr dstinfo;
 
 	memset(info_out, 0, sizeof(*info_out));
 
 	if U (!self)
 		return false;
-	if U (self->images_cnt == 0)
+	if U (self->images_cnt == 0) {
+		jc_set_error(self, "no images added");
 		return false;
+	}
 
-	if (idx >= 0 && idx < self->images_cnt) {
-		srcinfo = &self->images[idx].srcinfo;
-
-		info_out->width = srcinfo->image_width;
-		info_out->height = srcinfo->image_height;
-	} else if (idx == JC_SELF) {
-		srcinfo = &self->images[0].srcinfo;
-		dstinfo = &self->dstinfo;
+	dstinfo = &self->dstinfo;
 
+	if (idx >= 0 && idx < self->images_cnt) {
+		if U (!jc_wait_image(self, self->images[idx], JC_IMAGE_HEADER))
+			return false;
+		info_out->width = self->images[idx]->width;
+		info_out->height = self->images[idx]->height;
+	} else if (idx == JC_SELF || idx == JC_BLANK) {
 		info_out->width = dstinfo->image_width;
 		info_out->height = dstinfo->image_height;
 	} else {
+		jc_set_error(self, "bad image index %d", idx);
 		return false;
 	}
 
-	info_out->block_width = srcinfo->max_h_samp_factor*DCTSIZE;
-	info_out->block_height = srcinfo->max_v_samp_factor*DCTSIZE;
+	// all images have the same sampling factors as the output
+	info_out->block_width = dstinfo->max_h_samp_factor*DCTSIZE;
+	info_out->block_height = dstinfo->max_v_samp_factor*DCTSIZE;
 
 	info_out->data_width = round_up(info_out->width, info_out->block_width);
 	info_out->data_height = round_up(info_out->height, info_out->block_height);
@@ -434,32 +1519,32 @@ bool jc_drawimage(struct jc *self, int idx,
 	struct jc_info_struct destinfo;
 	struct jc_info_struct srcinfo;
 	int error = 0;
-	int offX, offY;
-	unsigned blkw;
+	bool ok;
 
 	if U (!jc_get_info(self, JC_SELF, &destinfo) ||
 	      !jc_get_info(self, idx, &srcinfo))
 		return false;
 
+	// (written so that nothing can overflow)
+	if U (srcX > srcinfo.data_width || srcY > srcinfo.data_height ||
+	      destX > destinfo.data_width || destY > destinfo.data_height)
+		goto err_bounds;
+
 	if (width == -1)
 		width = MIN(srcinfo.data_width-srcX, destinfo.data_width-destX);
 	if (height == -1)
 		height = MIN(srcinfo.data_height-srcY, destinfo.data_height-destY);
 
-	if U (srcX+width > srcinfo.data_width)
-		return false;
-	if U (srcY+height > srcinfo.data_height)
-		return false;
+	if U (width <= 0 || height <= 0)
+		goto err_bounds;
 
-	if U (destX+width > destinfo.data_width)
-		return false;
-	if U (destY+height > destinfo.data_height)
-		return false;
+	if U ((unsigned)width > srcinfo.data_width-srcX ||
+	      (unsigned)height > srcinfo.data_height-srcY)
+		goto err_bounds;
 
-	if U (width <= 0)
-		return false;
-	if U (height <= 0)
-		return false;
+	if U ((unsigned)width > destinfo.data_width-destX ||
+	      (unsigned)height > destinfo.data_height-destY)
+		goto err_bounds;
 
 	error |= srcX&(srcinfo.block_width-1);
 	error |= srcY&(srcinfo.block_height-1);
@@ -470,8 +1555,11 @@ bool jc_drawimage(struct jc *self, int idx,
 	error |= width&(srcinfo.block_width-1);
 	error |= height&(srcinfo.block_height-1);
 
-	if U (error != 0)
+	if U (error != 0) {
+		jc_set_error(self, "rectangle isn't aligned to the %ux%u block size",
+		    srcinfo.block_width, srcinfo.block_height);
 		return false;
+	}
 
 	srcX >>= 3;
 	srcY >>= 3;
@@ -480,45 +1568,143 @@ bool jc_drawimage(struct jc *self, int idx,
 	width >>= 3;
 	height >>= 3;
 
-	blkw = self->blocks_arr_width;
+D	assert(destX+width <= self->blocks_arr_width);
+D	assert(destY+height <= self->blocks_arr_height);
+
+	if (idx == JC_BLANK) {
+		ok = jc_map_fill(self, destX, destY, width, height, 0, 0, JC_MAP_BLANK);
+	} else if (idx != JC_SELF) {
+		ok = jc_map_fill(self, destX, destY, width, height,
+		    (int32_t)srcX-(int32_t)destX,
+		    (int32_t)srcY-(int32_t)destY,
+		    idx+1);
+	} else {
+D		assert(srcX+width <= self->blocks_arr_width);
+D		assert(srcY+height <= self->blocks_arr_height);
+
+		ok = jc_map_copy(self, destX, destY, srcX, srcY, width, height);
+	}
+	if U (!ok) {
+		// some of the rectangle may have been drawn already
+		jc_set_error(self, "out of memory");
+		return false;
+	}
+
+	return true;
+err_bounds:
+	jc_set_error(self, "rectangle is outside the image");
+	return false;
+}
+
+// -----------------------------------------------------------------------------
+
+// the map is in units of the block size because every drawimage rectangle is
+// aligned to it, so all the 8x8 blocks of a unit come from the same place
+
+bool jc_get_map(struct jc *self, struct jc_map_entry *out, size_t cnt)
+{
+	struct jc_info_struct destinfo;
+	unsigned units_w, units_h;
+	unsigned bw, bh; // unit size in 8x8 blocks
 
-	if (idx != JC_SELF) {
-		for (offY = 0; offY < height; offY++) {
-D			assert(destY+offY < self->blocks_arr_height);
-			for (offX = 0; offX < width; offX++) {
-				unsigned i = x_y_w_to_i(destX+offX, destY+offY, blkw);
+	if U (!jc_get_info(self, JC_SELF, &destinfo))
+		return false;
 
-D				assert(destX+offX < self->blocks_arr_width);
-D				assert(i < self->blocks_cnt);
+	units_w = destinfo.data_width/destinfo.block_width;
+	units_h = destinfo.data_height/destinfo.block_height;
+	bw = destinfo.block_width>>3;
+	bh = destinfo.block_height>>3;
 
-				self->blocks[i].src_x = srcX+offX;
-				self->blocks[i].src_y = srcY+offY;
-				self->blocks[i].img_idx = idx;
-				self->blocks[i].initialized = 1;
+	if U (cnt != (size_t)units_w*units_h) {
+		jc_set_error(self, "the map should have %zu entries, not %zu",
+		    (size_t)units_w*units_h, cnt);
+		return false;
+	}
 
-D				assert(self->blocks[i].src_x*8 < srcinfo.data_width);
-D				assert(self->blocks[i].src_y*8 < srcinfo.data_height);
+	for (unsigned y = 0; y < units_h; y++) {
+		for (unsigned x = 0; x < units_w; x++) {
+			struct jc_map_entry *e = &out[(size_t)y*units_w + x];
+			struct jc_block b;
+
+			if (!jc_map_get(self, x*bw, y*bh, &b)) {
+				e->img = -1;
+				e->src_x = e->src_y = 0;
+			} else if (b.img == JC_MAP_BLANK) {
+				e->img = JC_BLANK;
+				e->src_x = e->src_y = 0;
+			} else {
+				e->img = b.img-1;
+				e->src_x = b.src_x/(int32_t)bw;
+				e->src_y = b.src_y/(int32_t)bh;
 			}
 		}
-	} else {
-D		assert(srcX+width <= self->blocks_arr_width);
-D		assert(destX+width <= self->blocks_arr_width);
+	}
 
-D		assert(srcY+height <= self->blocks_arr_height);
-D		assert(destY+height <= self->blocks_arr_height);
+	return true;
+}
+
+bool jc_drawmap(struct jc *self, const struct jc_map_entry *map, size_t cnt)
+{
+	struct jc_info_struct destinfo;
+	unsigned units_w, units_h;
+	unsigned bw, bh;
+
+	if U (!jc_get_info(self, JC_SELF, &destinfo))
+		return false;
+
+	units_w = destinfo.data_width/destinfo.block_width;
+	units_h = destinfo.data_height/destinfo.block_height;
+	bw = destinfo.block_width>>3;
+	bh = destinfo.block_height>>3;
+
+	if U (cnt != (size_t)units_w*units_h) {
+		jc_set_error(self, "the map should have %zu entries, not %zu",
+		    (size_t)units_w*units_h, cnt);
+		return false;
+	}
 
-#pragma nounroll
-		for (offY = 0; offY < height; offY++) {
-			unsigned srcI = x_y_w_to_i(srcX, srcY+offY, blkw);
-			unsigned destI = x_y_w_to_i(destX, destY+offY, blkw);
+	// check everything first so that a bad map doesn't draw anything
+	for (size_t i = 0; i < cnt; i++) {
+		const struct jc_map_entry *e = &map[i];
+		struct jc_image *image;
 
-D			assert(srcI < self->blocks_cnt);
-D			assert(destI < self->blocks_cnt);
+		if (e->img == -1 || e->img == JC_BLANK)
+			continue;
+		if U (e->img < 0 || e->img >= self->images_cnt) {
+			jc_set_error(self, "map entry %zu: bad image index %d", i, e->img);
+			return false;
+		}
+		image = self->images[e->img];
+		if U (!jc_wait_image(self, image, JC_IMAGE_HEADER))
+			return false;
+		if U (e->src_x < 0 || e->src_y < 0 ||
+		      (unsigned)e->src_x >= jdiv_round_up(image->width, destinfo.block_width) ||
+		      (unsigned)e->src_y >= jdiv_round_up(image->height, destinfo.block_height)) {
+			jc_set_error(self, "map entry %zu is outside the image", i);
+			return false;
+		}
+	}
 
-			memcpy(
-			    &self->blocks[destI],
-			    &self->blocks[srcI],
-			    width*sizeof(*self->blocks));
+	for (unsigned y = 0; y < units_h; y++) {
+		for (unsigned x = 0; x < units_w; x++) {
+			const struct jc_map_entry *e = &map[(size_t)y*units_w + x];
+			bool ok;
+
+			if (e->img == -1)
+				continue;
+
+			if (e->img == JC_BLANK) {
+				ok = jc_map_fill(self, x*bw, y*bh, bw, bh, 0, 0, JC_MAP_BLANK);
+			} else {
+				ok = jc_map_fill(self, x*bw, y*bh, bw, bh,
+				    ((int32_t)e->src_x-(int32_t)x)*(int32_t)bw,
+				    ((int32_t)e->src_y-(int32_t)y)*(int32_t)bh,
+				    e->img+1);
+			}
+			if U (!ok) {
+				jc_set_error(self, "out of memory");
+				return false;
+			}
 		}
 	}
 
@@ -528,93 +1714,607 @@ D			assert(destI < self->blocks_cnt);
 // -----------------------------------------------------------------------------
 
 static bool jc_apply_blocks(struct jc *self);
+static bool jc_variants_start(struct jc *self, const struct jc_variant *variants, size_t cnt);
+static void jc_variants_join(struct jc *self);
+static bool jc_variants_finish(struct jc *self, struct jc_variant *variants, bool ok);
 
-bool jc_save_and_free(struct jc *self)
+static bool jc_save_common(struct jc *self, struct jc_variant *variants, size_t cnt)
 {
-	bool rv = false;
+	volatile bool rv = false;
+	struct jc_try tr;
+
+	if U (!self)
+		return false;
+	if U (self->params.saved) {
+		jc_set_error(self, "already saved");
+		return false;
+	}
+	if U (self->images_cnt == 0) {
+		jc_set_error(self, "no images added");
+		return false;
+	}
+
+	for (unsigned i = 0; i < self->images_cnt; i++)
+		if U (!jc_wait_image(self, self->images[i], JC_IMAGE_DONE))
+			return false;
 
-	if L (self) {
-		if L (self->images_cnt != 0 && jc_apply_blocks(self)) {
-			jpeg_finish_compress(&self->dstinfo);
+	self->params.saved = true;
+
+	JC_TRY(self, tr) {
+		if L (jc_apply_blocks(self) && jc_variants_start(self, variants, cnt)) {
+			if (self->params.jcf)
+				jcf_write_coefficients(&self->dstinfo, self->dst_coef_arrays);
+			else
+				jpeg_finish_compress(&self->dstinfo);
 			rv = true;
 		}
-		jpeg_destroy_compress(&self->dstinfo);
+	} JC_CATCH(self, tr) {
+		jc_variants_join(self);
+		jpeg_abort_compress(&self->dstinfo);
+	} JC_ENDTRY(self, tr);
 
-		for (int i = 0; i < self->images_cnt; i++)
-			jpeg_destroy_decompress(&self->images[i].srcinfo);
+	if (self->variants.jobs)
+		rv = jc_variants_finish(self, variants, rv);
 
-		fclose(self->params.f);
+	return rv;
+}
 
-		free(self->images);
-		free(self->blocks);
-		free(self);
+bool jc_save(struct jc *self)
+{
+	return jc_save_common(self, NULL, 0);
+}
+
+bool jc_save_variants(struct jc *self, struct jc_variant *variants, size_t cnt)
+{
+	for (size_t i = 0; i < cnt; i++) {
+		variants[i].buf = NULL;
+		variants[i].size = 0;
+	}
+
+	return jc_save_common(self, variants, cnt);
+}
+
+void jc_free(struct jc *self)
+{
+	if U (!self)
+		return;
+
+	// (the workers read dstinfo)
+	jc_pool_stop(self);
+
+	jpeg_destroy_compress(&self->dstinfo);
+
+	for (int i = 0; i < self->images_cnt; i++) {
+		struct jc_image *image = self->images[i];
+
+		jc_unload_image(self, image);
+		if (image->f)
+			fclose(image->f);
+		jc_image_unmap(image);
+		free(image->path);
+		free(image);
 	}
 
+	if (self->params.f)
+		fclose(self->params.f);
+	free(self->mem.buf);
+	free(self->params.spill_dir);
+	jc_spill_unmap(self);
+
+	jc_map_free(self);
+	free(self->images);
+	free(self);
+}
+
+bool jc_save_and_free(struct jc *self)
+{
+	bool rv;
+
+	rv = jc_save(self);
+	jc_free(self);
+
 	return rv;
 }
 
-static bool jc_apply_blocks(struct jc *self)
+bool jc_save_variants_and_free(struct jc *self, struct jc_variant *variants, size_t cnt)
+{
+	bool rv;
+
+	rv = jc_save_variants(self, variants, cnt);
+	jc_free(self);
+
+	return rv;
+}
+
+// -----------------------------------------------------------------------------
+
+// jpeg_copy_critical_parameters() from the canvas' compressor instead of a
+// decompressor
+static void jc_copy_output_params(j_compress_ptr src, j_compress_ptr dst, bool grayscale)
+{
+	dst->image_width = src->image_width;
+	dst->image_height = src->image_height;
+	dst->input_components = src->num_components;
+	dst->in_color_space = src->jpeg_color_space;
+	jpeg_set_defaults(dst);
+	jpeg_set_colorspace(dst, (grayscale) ? JCS_GRAYSCALE : src->jpeg_color_space);
+
+#if JPEG_LIB_VERSION >= 70
+	dst->jpeg_width = src->jpeg_width;
+	dst->jpeg_height = src->jpeg_height;
+#endif
+	dst->data_precision = src->data_precision;
+	dst->CCIR601_sampling = src->CCIR601_sampling;
+
+	for (int tblno = 0; tblno < NUM_QUANT_TBLS; tblno++) {
+		if (!src->quant_tbl_ptrs[tblno])
+			continue;
+		if (!dst->quant_tbl_ptrs[tblno])
+			dst->quant_tbl_ptrs[tblno] = jpeg_alloc_quant_table((j_common_ptr)dst);
+		memcpy(dst->quant_tbl_ptrs[tblno]->quantval,
+		    src->quant_tbl_ptrs[tblno]->quantval,
+		    sizeof(dst->quant_tbl_ptrs[tblno]->quantval));
+	}
+
+	for (int ci = 0; ci < dst->num_components; ci++) {
+		dst->comp_info[ci].component_id = src->comp_info[ci].component_id;
+		dst->comp_info[ci].h_samp_factor = (grayscale) ? 1 : src->comp_info[ci].h_samp_factor;
+		dst->comp_info[ci].v_samp_factor = (grayscale) ? 1 : src->comp_info[ci].v_samp_factor;
+		dst->comp_info[ci].quant_tbl_no = src->comp_info[ci].quant_tbl_no;
+	}
+
+	dst->write_JFIF_header = src->write_JFIF_header;
+	dst->JFIF_major_version = src->JFIF_major_version;
+	dst->JFIF_minor_version = src->JFIF_minor_version;
+	dst->density_unit = src->density_unit;
+	dst->X_density = src->X_density;
+	dst->Y_density = src->Y_density;
+	dst->write_Adobe_marker = src->write_Adobe_marker;
+}
+
+static void *jc_variant_run(void *arg)
+{
+	struct jc_variant_job *job = arg;
+	struct jc *self = job->canvas;
+	struct jc_try tr;
+
+	job->cinfo.err = jc_errmgr_init(&job->err);
+
+	JC_TRY(job, tr) {
+		jpeg_create_compress(&job->cinfo);
+		// (the output's arrays may be spilled ones)
+		jcf_hook((j_common_ptr)&job->cinfo);
+		if (job->f) {
+			jpeg_stdio_dest(&job->cinfo, job->f);
+		} else {
+			job->mem.pub.init_destination = jc_mem_init_destination;
+			job->mem.pub.empty_output_buffer = jc_mem_empty_output_buffer;
+			job->mem.pub.term_destination = jc_mem_term_destination;
+			job->cinfo.dest = &job->mem.pub;
+		}
+
+		jc_copy_output_params(&self->dstinfo, &job->cinfo, job->variant->grayscale);
+		if (job->variant->path && jcf_path(job->variant->path)) {
+			jcf_write_coefficients(&job->cinfo, self->dst_coef_arrays);
+		} else {
+			job->cinfo.optimize_coding = job->variant->optimize;
+			if (job->variant->progressive)
+				jpeg_simple_progression(&job->cinfo);
+
+			jpeg_write_coefficients(&job->cinfo, self->dst_coef_arrays);
+			jpeg_finish_compress(&job->cinfo);
+		}
+		job->ok = true;
+	} JC_CATCH(job, tr) {
+	} JC_ENDTRY(job, tr);
+
+	jpeg_destroy_compress(&job->cinfo);
+
+	return NULL;
+}
+
+// dstinfo is the first member of the jc
+static void jc_variants_term_destination(j_compress_ptr cinfo)
+{
+	struct jc *self = (struct jc *)cinfo;
+
+	jc_variants_join(self);
+	self->variants.term_destination(cinfo);
+}
+
+// opens the files and starts the encoders, each on a thread of its own (or
+// right here if one can't be started)
+static bool jc_variants_start(struct jc *self, const struct jc_variant *variants, size_t cnt)
+{
+	struct jc_variant_job *jobs;
+
+	if (cnt == 0)
+		return true;
+
+	if U (!(jobs = calloc(cnt, sizeof(*jobs)))) {
+		jc_set_error(self, "out of memory");
+		return false;
+	}
+	self->variants.jobs = jobs;
+	self->variants.cnt = cnt;
+
+	for (size_t i = 0; i < cnt; i++) {
+		jobs[i].canvas = self;
+		jobs[i].variant = &variants[i];
+		if (variants[i].path && U (!(jobs[i].f = fopen(variants[i].path, "w")))) {
+			jc_set_error(self, "%s: %s", variants[i].path, strerror(errno));
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < cnt; i++) {
+		jobs[i].started = (pthread_create(&jobs[i].thread, NULL, jc_variant_run, &jobs[i]) == 0);
+		if (!jobs[i].started)
+			jc_variant_run(&jobs[i]);
+	}
+
+	self->variants.term_destination = self->dstinfo.dest->term_destination;
+	self->dstinfo.dest->term_destination = jc_variants_term_destination;
+
+	return true;
+}
+
+static void jc_variants_join(struct jc *self)
+{
+	for (size_t i = 0; i < self->variants.cnt; i++) {
+		struct jc_variant_job *job = &self->variants.jobs[i];
+
+		if (job->started) {
+			pthread_join(job->thread, NULL);
+			job->started = false;
+		}
+	}
+}
+
+// ok is whether the canvas' own output was written. the buffers are only
+// handed out if everything was
+static bool jc_variants_finish(struct jc *self, struct jc_variant *variants, bool ok)
+{
+	jc_variants_join(self);
+
+	for (size_t i = 0; i < self->variants.cnt; i++) {
+		struct jc_variant_job *job = &self->variants.jobs[i];
+		const char *name = (variants[i].path) ? variants[i].path : "(memory)";
+
+		if (ok && U (!job->ok)) {
+			jc_set_error(self, "%s: %s", name, job->err.msg);
+			ok = false;
+		}
+		if (job->f && U (fclose(job->f) != 0) && ok) {
+			jc_set_error(self, "%s: %s", name, strerror(errno));
+			ok = false;
+		}
+	}
+
+	for (size_t i = 0; i < self->variants.cnt; i++) {
+		struct jc_variant_job *job = &self->variants.jobs[i];
+
+		if (ok && !variants[i].path) {
+			variants[i].buf = job->mem.buf;
+			variants[i].size = job->mem.size;
+		} else {
+			free(job->mem.buf);
+		}
+	}
+
+	free(self->variants.jobs);
+	self->variants.jobs = NULL;
+	self->variants.cnt = 0;
+
+	return ok;
+}
+
+// one output block from an image whose blocks of this component cover a
+// different area (with jc_set_resample_chroma()). src_x and src_y are in 8x8
+// blocks of the full-resolution grid, dst_s_x and dst_s_y are the output's
+// block size shifts. blocks past the edge of the image's data repeat the last
+// row/column
+static void jc_resample_block(struct jc *self, struct jc_image *img, int ci,
+	int32_t src_x, int32_t src_y,
+	int dst_s_x, int dst_s_y,
+	JCOEFPTR dst)
+{
+	j_decompress_ptr srcinfo = &img->srcinfo;
+	jpeg_component_info *scomp = &srcinfo->comp_info[ci];
+	jpeg_component_info *dcomp = &self->dstinfo.comp_info[ci];
+	const UINT16 *qin = srcinfo->quant_tbl_ptrs[scomp->quant_tbl_no]->quantval;
+	const UINT16 *qout = self->dstinfo.quant_tbl_ptrs[dcomp->quant_tbl_no]->quantval;
+	int src_s_x = jc_sampling_shift(srcinfo->max_h_samp_factor, scomp->h_samp_factor);
+	int src_s_y = jc_sampling_shift(srcinfo->max_v_samp_factor, scomp->v_samp_factor);
+	int32_t bx = src_x>>src_s_x;
+	int32_t by = src_y>>src_s_y;
+	// output blocks covering twice the area take two image blocks
+	int nx = (dst_s_x > src_s_x) ? 2 : 1;
+	int ny = (dst_s_y > src_s_y) ? 2 : 1;
+	JBLOCK in[4];
+	const JCOEF *inp[4] = { in[0], in[1], in[2], in[3] };
+
+	// copied out one at a time because each access may invalidate the last
+	// one (with a backing store)
+	for (int y = 0; y < ny; y++) {
+		for (int x = 0; x < nx; x++) {
+			JBLOCKARRAY src_row;
+
+			src_row = srcinfo->mem->access_virt_barray(
+			    (j_common_ptr)srcinfo, img->src_coef_arrays[ci],
+			    /* start_row */ MIN(by+y, (int32_t)scomp->height_in_blocks-1),
+			    /* num_rows */ 1,
+			    /* writable */ FALSE);
+			jcopy_block_row(&src_row[0][MIN(bx+x, (int32_t)scomp->width_in_blocks-1)],
+			    &in[y*2+x], 1);
+		}
+	}
+
+	if (src_s_x == dst_s_x && src_s_y == dst_s_y) {
+		// same area (luma, for one): copied as is
+		memcpy(dst, in[0], sizeof(JBLOCK));
+	} else if (dst_s_x >= src_s_x && dst_s_y >= src_s_y) {
+		dctresample_halve(inp, nx, ny, qin, qout, dst);
+	} else {
+		// image blocks covering twice the area: the half the output block
+		// is in
+		dctresample_double(in[0],
+		    (dst_s_x < src_s_x) ? 2 : 1,
+		    (dst_s_y < src_s_y) ? 2 : 1,
+		    (src_x>>dst_s_x)&1,
+		    (src_y>>dst_s_y)&1,
+		    qin, qout, dst);
+	}
+}
+
+// copies the blocks that come from images that are loaded right now. with
+// only, just in the tiles it's set for
+static void jc_copy_blocks(struct jc *self, const bool *only)
 {
-	struct jc_image *images = self->images;
-	j_decompress_ptr srcinfo0 = &self->images[0].srcinfo;
+	struct jc_image **images = self->images;
+	j_compress_ptr dstinfo = &self->dstinfo;
 
 	const __auto_type access_virt_barray = self->dstinfo.mem->access_virt_barray;
 
 	int blkw = self->blocks_arr_width;
 	int blkh = self->blocks_arr_height;
 
-	int init;
-
 D	assert(access_virt_barray != NULL); // double free
 
-	init = 1;
-	for (int i = 0; i < self->blocks_cnt; i++)
-		init &= self->blocks[i].initialized;
-	if U (!init)
-		return false;
-
-	for (int ci = 0; ci < self->dstinfo.num_components; ci++) {
-		jpeg_component_info *compptr = &self->dstinfo.comp_info[ci];
+	for (int ci = 0; ci < dstinfo->num_components; ci++) {
+		jpeg_component_info *compptr = &dstinfo->comp_info[ci];
 
 		// how many 8x8 blocks in one subsampled block
-		int x_howmany = divide_by_sampling_factor(srcinfo0->max_h_samp_factor, compptr->h_samp_factor);
-		int y_howmany = divide_by_sampling_factor(srcinfo0->max_v_samp_factor, compptr->v_samp_factor);
+		int x_howmany = divide_by_sampling_factor(dstinfo->max_h_samp_factor, compptr->h_samp_factor);
+		int y_howmany = divide_by_sampling_factor(dstinfo->max_v_samp_factor, compptr->v_samp_factor);
 
 		// shift amount for converting between 8x8 and subsampled block sizes
 		int x_howmany_s = x_howmany>>1;
 		int y_howmany_s = y_howmany>>1;
 
-		JBLOCKARRAY dst_row;
-		dst_row = access_virt_barray(
-		    (j_common_ptr)&self->dstinfo, self->dst_coef_arrays[ci],
-		    /* start_row */ 0,
-		    /* num_rows */ blkh>>y_howmany_s,
-		    /* writable */ TRUE);
-
-		for (int dy = 0; dy < blkh; dy += y_howmany) {
-			for (int dx = 0; dx < blkw; dx += x_howmany) {
-				int i = x_y_w_to_i(dx, dy, blkw);
-				struct jc_image *img = &images[self->blocks[i].img_idx];
-				int sx = self->blocks[i].src_x;
-				int sy = self->blocks[i].src_y;
-				JBLOCKARRAY src_row;
-
-D				assert(i >= 0 && i < self->blocks_cnt);
-
-				src_row = access_virt_barray(
-				    (j_common_ptr)&img->srcinfo, img->src_coef_arrays[ci],
-				    /* start_row */ sy>>y_howmany_s,
-				    /* num_rows */ 1,
-				    /* writable */ FALSE);
-
-				jcopy_block_row(
-				    &src_row[0][sx>>x_howmany_s],
-				    &dst_row[dy>>y_howmany_s][dx>>x_howmany_s], 1);
+		// the output is written one strip at a time so that only that much
+		// of it has to be in memory (with a backing store)
+		int rows = blkh>>y_howmany_s;
+		int strip = JC_STRIP_IMCU_ROWS*compptr->v_samp_factor;
+
+		for (int row0 = 0; row0 < rows; row0 += strip) {
+			int nrows = MIN(strip, rows-row0);
+			JBLOCKARRAY dst_rows;
+			int dx, dy;
+
+			dst_rows = access_virt_barray(
+			    (j_common_ptr)dstinfo, self->dst_coef_arrays[ci],
+			    /* start_row */ row0,
+			    /* num_rows */ nrows,
+			    /* writable */ TRUE);
+
+			for (dy = row0<<y_howmany_s; dy < (row0+nrows)<<y_howmany_s; dy += y_howmany) {
+				JBLOCKROW dst_row = dst_rows[(dy>>y_howmany_s)-row0];
+
+				for (dx = 0; dx < blkw; dx += x_howmany) {
+					struct jc_block b;
+					struct jc_image *img;
+					JBLOCKARRAY src_row;
+
+					if (only && !only[(dy>>JC_TILE_SHIFT)*self->tiles_w + (dx>>JC_TILE_SHIFT)]) {
+						// on to the next tile
+						dx = MIN((dx|JC_TILE_MASK)+1, (unsigned)blkw) - x_howmany;
+						continue;
+					}
+
+					jc_map_get(self, dx, dy, &b);
+					if (b.img == JC_MAP_BLANK) {
+						memset(&dst_row[dx>>x_howmany_s], 0, sizeof(JBLOCK));
+						continue;
+					}
+D					assert(b.img != 0 && b.img <= self->images_cnt);
+					img = images[b.img-1];
+					if (!img->src_coef_arrays)
+						continue;
+
+					// (only with jc_set_resample_chroma())
+					if U (img->srcinfo.max_h_samp_factor != dstinfo->max_h_samp_factor ||
+					      img->srcinfo.max_v_samp_factor != dstinfo->max_v_samp_factor ||
+					      img->srcinfo.comp_info[ci].h_samp_factor != compptr->h_samp_factor ||
+					      img->srcinfo.comp_info[ci].v_samp_factor != compptr->v_samp_factor) {
+						jc_resample_block(self, img, ci, b.src_x, b.src_y,
+						    x_howmany_s, y_howmany_s,
+						    dst_row[dx>>x_howmany_s]);
+						continue;
+					}
+
+					src_row = access_virt_barray(
+					    (j_common_ptr)&img->srcinfo, img->src_coef_arrays[ci],
+					    /* start_row */ b.src_y>>y_howmany_s,
+					    /* num_rows */ 1,
+					    /* writable */ FALSE);
+
+					jcopy_block_row(
+					    &src_row[0][b.src_x>>x_howmany_s],
+					    &dst_row[dx>>x_howmany_s], 1);
+				}
+D				assert(dx == self->blocks_arr_width);
+			}
+		}
+	}
+}
+
+static inline void jc_tile_list_add(uint32_t img, uint32_t t, uint32_t *seen,
+	size_t *first, uint32_t *list)
+{
+	if (img == JC_MAP_BLANK || seen[img-1] == t+1)
+		return;
+	seen[img-1] = t+1;
+	if (list)
+		list[first[img-1]++] = t;
+	else
+		first[img]++;
+}
+
+// lists the tiles that each image is drawn to: those of image i are
+// (*list_out)[(*first_out)[i]] up to (*first_out)[i+1], none for images that
+// nothing was drawn from. both are freed by the caller
+static bool jc_map_list_tiles(struct jc *self, size_t **first_out, uint32_t **list_out)
+{
+	size_t ntiles = (size_t)self->tiles_w*self->tiles_h;
+	size_t *first;
+	uint32_t *list = NULL;
+	uint32_t *seen;
+
+	first = calloc(self->images_cnt+1, sizeof(*first));
+	seen = malloc(MAX(self->images_cnt, 1)*sizeof(*seen));
+	if U (!first || !seen)
+		goto fail;
+
+	// counted first, then listed, with first[] as the write position
+	for (int pass = 0; pass < 2; pass++) {
+		memset(seen, 0, self->images_cnt*sizeof(*seen));
+
+		for (uint32_t t = 0; t < ntiles; t++) {
+			struct jc_tile *tile = &self->tiles[t];
+			unsigned tx = t%self->tiles_w;
+			unsigned ty = t/self->tiles_w;
+			unsigned w = MIN(JC_TILE_SIZE, self->blocks_arr_width-(tx<<JC_TILE_SHIFT));
+			unsigned h = MIN(JC_TILE_SIZE, self->blocks_arr_height-(ty<<JC_TILE_SHIFT));
+
+			if (!tile->blocks) {
+				jc_tile_list_add(tile->img, t, seen, first, list);
+				continue;
+			}
+			for (unsigned y = 0; y < h; y++)
+				for (unsigned x = 0; x < w; x++)
+					jc_tile_list_add(tile->blocks[y*JC_TILE_SIZE + x].img,
+					    t, seen, first, list);
+		}
+
+		if (pass == 0) {
+			for (size_t i = 1; i <= self->images_cnt; i++)
+				first[i] += first[i-1];
+			if U (!(list = malloc(MAX(first[self->images_cnt], 1)*sizeof(*list))))
+				goto fail;
+		} else {
+			// each first[i] was moved up to where image i+1's tiles start
+			memmove(&first[1], &first[0], self->images_cnt*sizeof(*first));
+			first[0] = 0;
+		}
+	}
+
+	free(seen);
+	*first_out = first;
+	*list_out = list;
+
+	return true;
+fail:
+	free(first);
+	free(list);
+	free(seen);
+	return false;
+}
+
+static bool jc_apply_blocks(struct jc *self)
+{
+	size_t ntiles = (size_t)self->tiles_w*self->tiles_h;
+	size_t *first;
+	uint32_t *list;
+	bool *used = NULL;
+	bool *only;
+	unsigned next;
+
+	if U (!jc_map_complete(self)) {
+		jc_set_error(self, "some parts of the canvas weren't drawn to");
+		return false;
+	}
+
+	// everything loaded by jc_add_image() first
+	jc_copy_blocks(self, NULL);
+
+	if (self->params.budget == 0)
+		return true;
+
+	// then the rest, as many images at a time as fit in the budget (at
+	// least one). images that aren't drawn from are never loaded, and each
+	// batch only goes over the tiles that it's drawn to
+
+	if U (!jc_map_list_tiles(self, &first, &list)) {
+		jc_set_error(self, "out of memory");
+		return false;
+	}
+	only = malloc(ntiles*sizeof(*only));
+	if U (!only || !(used = malloc(MAX(self->images_cnt, 1)*sizeof(*used)))) {
+		free(first);
+		free(list);
+		free(only);
+		jc_set_error(self, "out of memory");
+		return false;
+	}
+
+	for (unsigned i = 0; i < self->images_cnt; i++) {
+		used[i] = (first[i] != first[i+1]);
+		if (self->images[i]->src_coef_arrays) {
+			used[i] = false;
+			jc_unload_image(self, self->images[i]);
+		}
+	}
+
+	next = 0;
+	for (;;) {
+		unsigned start = next;
+		unsigned loaded = 0;
+
+		memset(only, 0, ntiles*sizeof(*only));
+
+		for (; next < self->images_cnt; next++) {
+			struct jc_image *image = self->images[next];
+
+			if (!used[next])
+				continue;
+			if (loaded > 0 && self->images_loaded_cost+image->cost > self->params.budget)
+				break;
+			if U (!jc_load_image(self, image)) {
+				free(first);
+				free(list);
+				free(used);
+				free(only);
+				return false;
 			}
-D			assert(dx == self->blocks_arr_width);
+			for (size_t k = first[next]; k < first[next+1]; k++)
+				only[list[k]] = true;
+			loaded++;
 		}
-D		assert(dy == self->blocks_arr_height);
+		if (loaded == 0)
+			break;
+
+		jc_copy_blocks(self, only);
+
+		for (unsigned i = start; i < next; i++)
+			if (self->images[i]->src_coef_arrays)
+				jc_unload_image(self, self->images[i]);
 	}
 
+	free(first);
+	free(list);
+	free(used);
+	free(only);
+
 	return true;
 }
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 enum jc_special_idx {
 	JC_SELF = -2,
+	// draws flat gray blocks (all coefficients zero). the source rectangle
+	// is the canvas itself but only its size matters
+	JC_BLANK = -3,
 };
 
 struct jc_info_struct {
@@ -17,11 +21,86 @@ struct jc_info_struct {
 	unsigned short block_height;
 };
 
+// a canvas is used by one thread at a time. different canvases can be used
+// from different threads concurrently
+// a savepath ending in .jcf is written as a jcf (raw coefficients, see jcf.h)
 struct jc *jc_new(const char *savepath, int w, int h);
+// same but the output is kept in memory, see jc_take_output()
+struct jc *jc_new_mem(int w, int h);
+
+// if the output's coefficients take more than limit bytes, they're kept in a
+// temporary file in dir instead (deleted right away and mapped, so the kernel
+// writes blocks out to it and drops them from memory as needed). NULL turns
+// it off. the source images are limited with jc_set_memory_budget(), and .jcf
+// ones are mapped anyway. must be called before jc_add_image()
+bool jc_set_spill(struct jc *self, const char *dir, size_t limit);
+
+// limit for the coefficients of the source images kept in memory at once, in
+// bytes. images added after the budget is used up are only checked and then
+// closed, and get loaded again a few at a time by jc_save(). the output's own
+// coefficients aren't counted. must be called before jc_add_image()
+bool jc_set_memory_budget(struct jc *self, size_t budget);
+
+// lets images with differently subsampled chroma be added (4:2:0 and 4:4:4,
+// for example). when saving, their chroma blocks are resampled to the output's
+// layout on the coefficients (2x2 averages down, repeated pixels up) and
+// requantized with its tables, which then don't have to match either. luma is
+// still copied as is. must be called before jc_add_image()
+bool jc_set_resample_chroma(struct jc *self, bool enable);
+
+// .jcf files are mapped instead of read, and their blocks are used from the
+// mapping (they don't count towards the memory budget)
 int jc_add_image(struct jc *self, const char *path);
+// reads the image (a jpg or a jcf) from memory. the buffer isn't copied and has to stay valid
+// until jc_free()
+int jc_add_image_mem(struct jc *self, const void *buf, size_t size);
+// returns right away and reads the image on a worker thread. jc_get_info() and
+// jc_drawimage() wait for its header, and jc_save() for the whole image.
+// errors from reading it show up there. with a memory budget, this is the
+// same as jc_add_image()
+int jc_add_image_async(struct jc *self, const char *path);
 bool jc_get_info(struct jc *self, int idx, struct jc_info_struct *info_out);
 bool jc_drawimage(struct jc *self, int idx,
 	unsigned destX, unsigned destY,
 	unsigned srcX, unsigned srcY,
 	int width, int height);
+
+// the block map, in units of block_width x block_height (see jc_get_info):
+// where each unit of the canvas comes from, row by row
+struct jc_map_entry {
+	int img; // image index, JC_BLANK, or -1 if not drawn to
+	int src_x; // in units
+	int src_y;
+};
+// out has room for (data_width/block_width)*(data_height/block_height)
+// entries of the canvas
+bool jc_get_map(struct jc *self, struct jc_map_entry *out, size_t cnt);
+// draws every unit of the canvas from where the map says. entries with img
+// -1 are left alone. faster than one jc_drawimage() per unit
+bool jc_drawmap(struct jc *self, const struct jc_map_entry *map, size_t cnt);
+
+// writes the output file. can only be done once
+bool jc_save(struct jc *self);
+void jc_free(struct jc *self);
 bool jc_save_and_free(struct jc *self);
+// another encoding of the canvas, for jc_save_variants()
+struct jc_variant {
+	const char *path; // NULL to keep it in memory. .jcf paths get a jcf
+	bool optimize; // optimized huffman tables
+	bool progressive;
+	bool grayscale; // luma only
+	// with path NULL, the output after a successful save. the caller frees
+	// it with free()
+	unsigned char *buf;
+	size_t size;
+};
+// jc_save() that also writes every variant. they're encoded in parallel with
+// the canvas' own output, from the same coefficients. fails if any of them
+// does, and then no buffers are returned
+bool jc_save_variants(struct jc *self, struct jc_variant *variants, size_t cnt);
+bool jc_save_variants_and_free(struct jc *self, struct jc_variant *variants, size_t cnt);
+// the output of a saved jc_new_mem() canvas. the caller frees it with free()
+unsigned char *jc_take_output(struct jc *self, size_t *size);
+
+// why the last call with this canvas failed
+const char *jc_get_error(struct jc *self);
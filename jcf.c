@@ -0,0 +1,429 @@
+#include "jcf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// https://github.com/libjpeg-turbo/libjpeg-turbo/blob/c23672c/jutils.c#L75
+#define jdiv_round_up(a, b) (((a) + (b) - 1) / (b))
+// (not just powers of 2, sampling factors can be 3)
+#define round_up(a, b) (jdiv_round_up(a, b) * (b))
+
+_Static_assert(sizeof(JCOEF) == 2, "");
+_Static_assert(sizeof(struct jcf_header) == 728, "");
+_Static_assert(offsetof(struct jcf_header, comp) % 8 == 0, "");
+
+// errors go through libjpeg's error manager, as "addon" messages
+enum {
+	JERR_JCF_NOT_JCF = 1000,
+	JERR_JCF_BYTE_ORDER,
+	JERR_JCF_ALIGN,
+	JERR_JCF_CORRUPT,
+	JERR_JCF_TRUNCATED,
+	JERR_JCF_UNSUPPORTED,
+};
+static const char *const jcf_messages[] = {
+	"Not a JCF file",
+	"JCF file has the wrong byte order",
+	"JCF buffer isn't aligned",
+	"Corrupt JCF header",
+	"JCF file is truncated",
+	"Image can't be stored in a JCF file",
+};
+
+static void jcf_set_messages(j_common_ptr cinfo)
+{
+	cinfo->err->addon_message_table = jcf_messages;
+	cinfo->err->first_addon_message = JERR_JCF_NOT_JCF;
+	cinfo->err->last_addon_message = JERR_JCF_NOT_JCF+sizeof(jcf_messages)/sizeof(jcf_messages[0])-1;
+}
+
+bool jcf_is_jcf(const void *buf, size_t size)
+{
+	return (size >= 4 && memcmp(buf, JCF_MAGIC, 4) == 0);
+}
+
+bool jcf_path(const char *path)
+{
+	const char *dot = strrchr(path, '.');
+
+	return dot && strcasecmp(dot, ".jcf") == 0;
+}
+
+void *jcf_map(const char *path, size_t *size)
+{
+	struct stat st;
+	void *buf;
+	int fd, e;
+
+	if U ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if U (fstat(fd, &st) == -1) {
+		e = errno;
+		close(fd);
+		errno = e;
+		return NULL;
+	}
+
+	buf = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	e = errno;
+	close(fd);
+	if U (buf == MAP_FAILED) {
+		errno = e;
+		return NULL;
+	}
+
+	*size = st.st_size;
+
+	return buf;
+}
+
+void jcf_unmap(void *buf, size_t size)
+{
+	if (buf)
+		munmap(buf, size);
+}
+
+// -----------------------------------------------------------------------------
+
+// libjpeg's virtual arrays are private to its memory manager, so the planes
+// are handed out as arrays of this type instead, and the access_virt_barray
+// method of the objects that use them is replaced with one that knows them.
+// libjpeg's own arrays start with a pointer to their buffer, which can't be
+// the address of jcf_array_tag
+struct jcf_array {
+	const void *tag; // &jcf_array_tag
+	JBLOCKROW *rows;
+	JDIMENSION num_rows;
+};
+
+static const char jcf_array_tag;
+
+// the same for every object, it's libjpeg's
+static JBLOCKARRAY (*jcf_libjpeg_access)(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+	JDIMENSION start_row, JDIMENSION num_rows, boolean writable);
+
+static JBLOCKARRAY jcf_access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+	JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+	struct jcf_array *arr = (struct jcf_array *)ptr;
+
+	if (arr->tag != &jcf_array_tag)
+		return __atomic_load_n(&jcf_libjpeg_access, __ATOMIC_RELAXED)(cinfo, ptr, start_row, num_rows, writable);
+
+	if U (start_row+num_rows > arr->num_rows || num_rows == 0)
+		ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+
+	return arr->rows+start_row;
+}
+
+void jcf_hook(j_common_ptr cinfo)
+{
+	if (cinfo->mem->access_virt_barray == jcf_access_virt_barray)
+		return;
+
+	__atomic_store_n(&jcf_libjpeg_access, cinfo->mem->access_virt_barray, __ATOMIC_RELAXED);
+	cinfo->mem->access_virt_barray = jcf_access_virt_barray;
+}
+
+// -----------------------------------------------------------------------------
+
+static const struct jcf_header *jcf_check(j_common_ptr cinfo, const void *buf, size_t size)
+{
+	const struct jcf_header *hdr = buf;
+	unsigned max_h = 1, max_v = 1;
+
+	jcf_set_messages(cinfo);
+
+	if U (!jcf_is_jcf(buf, size))
+		ERREXIT(cinfo, JERR_JCF_NOT_JCF);
+	if U (size < sizeof(*hdr))
+		ERREXIT(cinfo, JERR_JCF_TRUNCATED);
+	if U ((uintptr_t)buf % 8 != 0)
+		ERREXIT(cinfo, JERR_JCF_ALIGN);
+	if U (hdr->byte_order != JCF_BYTE_ORDER)
+		ERREXIT(cinfo, JERR_JCF_BYTE_ORDER);
+	if U (hdr->size > size)
+		ERREXIT(cinfo, JERR_JCF_TRUNCATED);
+
+	if U (hdr->width == 0 || hdr->width > JPEG_MAX_DIMENSION ||
+	      hdr->height == 0 || hdr->height > JPEG_MAX_DIMENSION ||
+	      hdr->num_components < 1 || hdr->num_components > 4)
+		ERREXIT(cinfo, JERR_JCF_CORRUPT);
+
+	for (unsigned ci = 0; ci < hdr->num_components; ci++) {
+		const struct jcf_component *comp = &hdr->comp[ci];
+
+		if U (comp->h_samp_factor < 1 || comp->h_samp_factor > 4 ||
+		      comp->v_samp_factor < 1 || comp->v_samp_factor > 4)
+			ERREXIT(cinfo, JERR_JCF_CORRUPT);
+		max_h = MAX(max_h, comp->h_samp_factor);
+		max_v = MAX(max_v, comp->v_samp_factor);
+	}
+
+	for (unsigned ci = 0; ci < hdr->num_components; ci++) {
+		const struct jcf_component *comp = &hdr->comp[ci];
+		uint32_t width_in_blocks = jdiv_round_up(jdiv_round_up(hdr->width*comp->h_samp_factor, max_h), DCTSIZE);
+		uint32_t height_in_blocks = jdiv_round_up(jdiv_round_up(hdr->height*comp->v_samp_factor, max_v), DCTSIZE);
+
+		if U (comp->quant_tbl_no >= 4 || !(hdr->quant_tbls & (1u << comp->quant_tbl_no)) ||
+		      comp->width_in_blocks != width_in_blocks ||
+		      comp->height_in_blocks != height_in_blocks ||
+		      comp->blocks_per_row < round_up(width_in_blocks, comp->h_samp_factor) ||
+		      comp->rows < round_up(height_in_blocks, comp->v_samp_factor) ||
+		      comp->offset % JCF_ALIGN != 0 || comp->offset < sizeof(*hdr))
+			ERREXIT(cinfo, JERR_JCF_CORRUPT);
+		if U (comp->offset > hdr->size ||
+		      (uint64_t)comp->blocks_per_row*comp->rows*sizeof(JBLOCK) > hdr->size-comp->offset)
+			ERREXIT(cinfo, JERR_JCF_TRUNCATED);
+	}
+
+	return hdr;
+}
+
+void jcf_read_header(j_decompress_ptr cinfo, const void *buf, size_t size)
+{
+	const struct jcf_header *hdr = jcf_check((j_common_ptr)cinfo, buf, size);
+	int max_h = 1, max_v = 1;
+
+	cinfo->image_width = hdr->width;
+	cinfo->image_height = hdr->height;
+	cinfo->num_components = hdr->num_components;
+	cinfo->jpeg_color_space = hdr->color_space;
+	cinfo->out_color_space = (hdr->color_space == JCS_YCbCr) ? JCS_RGB : hdr->color_space;
+	cinfo->data_precision = 8;
+	cinfo->arith_code = FALSE;
+	cinfo->progressive_mode = FALSE;
+	cinfo->CCIR601_sampling = FALSE;
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = 1;
+
+	cinfo->saw_JFIF_marker = hdr->jfif;
+	cinfo->JFIF_major_version = 1;
+	cinfo->JFIF_minor_version = 1;
+	cinfo->density_unit = hdr->density_unit;
+	cinfo->X_density = hdr->x_density;
+	cinfo->Y_density = hdr->y_density;
+	cinfo->saw_Adobe_marker = hdr->adobe;
+	cinfo->Adobe_transform = (hdr->color_space == JCS_YCbCr) ? 1 : (hdr->color_space == JCS_YCCK) ? 2 : 0;
+
+	for (int n = 0; n < 4; n++) {
+		if (!(hdr->quant_tbls & (1u << n)))
+			continue;
+		if (!cinfo->quant_tbl_ptrs[n])
+			cinfo->quant_tbl_ptrs[n] = jpeg_alloc_quant_table((j_common_ptr)cinfo);
+		memcpy(cinfo->quant_tbl_ptrs[n]->quantval, hdr->quantval[n], sizeof(hdr->quantval[n]));
+		cinfo->quant_tbl_ptrs[n]->sent_table = FALSE;
+	}
+
+	cinfo->comp_info = cinfo->mem->alloc_small((j_common_ptr)cinfo, JPOOL_IMAGE,
+	    cinfo->num_components*sizeof(jpeg_component_info));
+	memset(cinfo->comp_info, 0, cinfo->num_components*sizeof(jpeg_component_info));
+
+	for (int ci = 0; ci < cinfo->num_components; ci++) {
+		max_h = MAX(max_h, (int)hdr->comp[ci].h_samp_factor);
+		max_v = MAX(max_v, (int)hdr->comp[ci].v_samp_factor);
+	}
+	cinfo->max_h_samp_factor = max_h;
+	cinfo->max_v_samp_factor = max_v;
+
+	for (int ci = 0; ci < cinfo->num_components; ci++) {
+		jpeg_component_info *compptr = &cinfo->comp_info[ci];
+		const struct jcf_component *comp = &hdr->comp[ci];
+
+		compptr->component_id = comp->id;
+		compptr->component_index = ci;
+		compptr->h_samp_factor = comp->h_samp_factor;
+		compptr->v_samp_factor = comp->v_samp_factor;
+		compptr->quant_tbl_no = comp->quant_tbl_no;
+		compptr->width_in_blocks = comp->width_in_blocks;
+		compptr->height_in_blocks = comp->height_in_blocks;
+		compptr->downsampled_width = jdiv_round_up(hdr->width*comp->h_samp_factor, max_h);
+		compptr->downsampled_height = jdiv_round_up(hdr->height*comp->v_samp_factor, max_v);
+		compptr->component_needed = TRUE;
+#if JPEG_LIB_VERSION >= 70
+		compptr->DCT_h_scaled_size = DCTSIZE;
+		compptr->DCT_v_scaled_size = DCTSIZE;
+#else
+		compptr->DCT_scaled_size = DCTSIZE;
+#endif
+	}
+
+#if JPEG_LIB_VERSION >= 70
+	cinfo->min_DCT_h_scaled_size = DCTSIZE;
+	cinfo->min_DCT_v_scaled_size = DCTSIZE;
+#else
+	cinfo->min_DCT_scaled_size = DCTSIZE;
+#endif
+	cinfo->total_iMCU_rows = jdiv_round_up(hdr->height, max_v*DCTSIZE);
+	cinfo->output_width = hdr->width;
+	cinfo->output_height = hdr->height;
+}
+
+jvirt_barray_ptr jcf_plane_array(j_common_ptr cinfo, JBLOCKROW plane,
+	JDIMENSION blocks_per_row, JDIMENSION rows)
+{
+	struct jcf_array *arr;
+
+	arr = cinfo->mem->alloc_small(cinfo, JPOOL_IMAGE, sizeof(*arr));
+	arr->tag = &jcf_array_tag;
+	arr->num_rows = rows;
+	arr->rows = cinfo->mem->alloc_large(cinfo, JPOOL_IMAGE, rows*sizeof(JBLOCKROW));
+	for (JDIMENSION row = 0; row < rows; row++)
+		arr->rows[row] = plane+(size_t)row*blocks_per_row;
+
+	return (jvirt_barray_ptr)arr;
+}
+
+// the header was checked by jcf_read_header()
+jvirt_barray_ptr *jcf_read_coefficients(j_decompress_ptr cinfo, void *buf)
+{
+	const struct jcf_header *hdr = buf;
+	jvirt_barray_ptr *coef_arrays;
+
+	jcf_hook((j_common_ptr)cinfo);
+
+	coef_arrays = cinfo->mem->alloc_small((j_common_ptr)cinfo, JPOOL_IMAGE,
+	    cinfo->num_components*sizeof(jvirt_barray_ptr));
+
+	for (int ci = 0; ci < cinfo->num_components; ci++) {
+		const struct jcf_component *comp = &hdr->comp[ci];
+
+		coef_arrays[ci] = jcf_plane_array((j_common_ptr)cinfo,
+		    (JBLOCKROW)((unsigned char *)buf+comp->offset),
+		    comp->blocks_per_row, comp->rows);
+	}
+
+	return coef_arrays;
+}
+
+// -----------------------------------------------------------------------------
+
+static const unsigned char jcf_zeros[JCF_ALIGN];
+
+// suspending destinations aren't supported, like in jpeg_finish_compress()
+static void jcf_write(j_compress_ptr cinfo, const void *data, size_t size)
+{
+	struct jpeg_destination_mgr *dest = cinfo->dest;
+
+	while (size > 0) {
+		size_t n;
+
+		if (dest->free_in_buffer == 0 && U (!dest->empty_output_buffer(cinfo)))
+			ERREXIT(cinfo, JERR_CANT_SUSPEND);
+
+		n = (size < dest->free_in_buffer) ? size : dest->free_in_buffer;
+		memcpy(dest->next_output_byte, data, n);
+		dest->next_output_byte += n;
+		dest->free_in_buffer -= n;
+		data = (const char *)data+n;
+		size -= n;
+	}
+}
+
+static void jcf_write_padding(j_compress_ptr cinfo, uint64_t size)
+{
+	if (size % JCF_ALIGN != 0)
+		jcf_write(cinfo, jcf_zeros, JCF_ALIGN - size%JCF_ALIGN);
+}
+
+void jcf_write_coefficients(j_compress_ptr cinfo, jvirt_barray_ptr *coef_arrays)
+{
+	struct jcf_header hdr;
+	unsigned max_h = 1, max_v = 1;
+	uint64_t off;
+
+	jcf_set_messages((j_common_ptr)cinfo);
+	jcf_hook((j_common_ptr)cinfo);
+
+	if U (cinfo->num_components < 1 || cinfo->num_components > 4 ||
+	      cinfo->data_precision != 8)
+		ERREXIT(cinfo, JERR_JCF_UNSUPPORTED);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, JCF_MAGIC, 4);
+	hdr.byte_order = JCF_BYTE_ORDER;
+	hdr.width = cinfo->image_width;
+	hdr.height = cinfo->image_height;
+	hdr.color_space = cinfo->jpeg_color_space;
+	hdr.num_components = cinfo->num_components;
+	hdr.jfif = cinfo->write_JFIF_header;
+	hdr.density_unit = cinfo->density_unit;
+	hdr.x_density = cinfo->X_density;
+	hdr.y_density = cinfo->Y_density;
+	hdr.adobe = cinfo->write_Adobe_marker;
+
+	for (int ci = 0; ci < cinfo->num_components; ci++) {
+		jpeg_component_info *compptr = &cinfo->comp_info[ci];
+
+		if U (compptr->h_samp_factor < 1 || compptr->h_samp_factor > 4 ||
+		      compptr->v_samp_factor < 1 || compptr->v_samp_factor > 4 ||
+		      compptr->quant_tbl_no < 0 || compptr->quant_tbl_no >= 4)
+			ERREXIT(cinfo, JERR_JCF_UNSUPPORTED);
+		max_h = MAX(max_h, compptr->h_samp_factor);
+		max_v = MAX(max_v, compptr->v_samp_factor);
+	}
+
+	off = round_up(sizeof(hdr), JCF_ALIGN);
+	for (int ci = 0; ci < cinfo->num_components; ci++) {
+		jpeg_component_info *compptr = &cinfo->comp_info[ci];
+		struct jcf_component *comp = &hdr.comp[ci];
+		JQUANT_TBL *qtbl = cinfo->quant_tbl_ptrs[compptr->quant_tbl_no];
+
+		if U (!qtbl)
+			ERREXIT1(cinfo, JERR_NO_QUANT_TABLE, compptr->quant_tbl_no);
+		memcpy(hdr.quantval[compptr->quant_tbl_no], qtbl->quantval, sizeof(hdr.quantval[0]));
+		hdr.quant_tbls |= 1u << compptr->quant_tbl_no;
+
+		comp->id = compptr->component_id;
+		comp->h_samp_factor = compptr->h_samp_factor;
+		comp->v_samp_factor = compptr->v_samp_factor;
+		comp->quant_tbl_no = compptr->quant_tbl_no;
+		comp->width_in_blocks = jdiv_round_up(jdiv_round_up(hdr.width*comp->h_samp_factor, max_h), DCTSIZE);
+		comp->height_in_blocks = jdiv_round_up(jdiv_round_up(hdr.height*comp->v_samp_factor, max_v), DCTSIZE);
+		comp->blocks_per_row = round_up(comp->width_in_blocks, comp->h_samp_factor);
+		comp->rows = round_up(comp->height_in_blocks, comp->v_samp_factor);
+		comp->offset = off;
+
+		off += round_up((uint64_t)comp->blocks_per_row*comp->rows*sizeof(JBLOCK), JCF_ALIGN);
+	}
+	hdr.size = off;
+
+	cinfo->dest->init_destination(cinfo);
+
+	jcf_write(cinfo, &hdr, sizeof(hdr));
+	jcf_write_padding(cinfo, sizeof(hdr));
+
+	for (int ci = 0; ci < cinfo->num_components; ci++) {
+		struct jcf_component *comp = &hdr.comp[ci];
+
+		// one row at a time, the pointer is only valid until the next access
+		for (JDIMENSION row = 0; row < comp->rows; row++) {
+			JBLOCKARRAY blocks = cinfo->mem->access_virt_barray(
+			    (j_common_ptr)cinfo, coef_arrays[ci],
+			    /* start_row */ row,
+			    /* num_rows */ 1,
+			    /* writable */ FALSE);
+
+			jcf_write(cinfo, blocks[0], comp->blocks_per_row*sizeof(JBLOCK));
+		}
+		jcf_write_padding(cinfo, (uint64_t)comp->blocks_per_row*comp->rows*sizeof(JBLOCK));
+	}
+
+	cinfo->dest->term_destination(cinfo);
+	jpeg_abort_compress(cinfo);
+}
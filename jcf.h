@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+// .jcf: the quantized dct coefficients of a jpg, uncompressed, for passing
+// images between the tools without huffman coding them at every step. a jcf
+// can be mapped into memory and its blocks used where they are
+//
+// layout (everything in the writer's byte order, which the reader checks):
+// - struct jcf_header
+// - one plane per component at the offset in its jcf_component, aligned to
+//   JCF_ALIGN: rows*blocks_per_row JBLOCKs (64 int16s each, natural order),
+//   row by row. like libjpeg's arrays, planes are padded to whole MCUs
+//
+// only 8-bit baseline-style data: 8x8 blocks, 16-bit coefficients, at most
+// 4 components and 4 quantization tables
+
+#define JCF_MAGIC "JCF1"
+#define JCF_BYTE_ORDER 0x01020304u
+#define JCF_ALIGN 4096
+
+struct jcf_component {
+	uint32_t id;
+	uint32_t h_samp_factor;
+	uint32_t v_samp_factor;
+	uint32_t quant_tbl_no;
+	uint32_t width_in_blocks; // of the image data
+	uint32_t height_in_blocks;
+	uint32_t blocks_per_row; // of the plane
+	uint32_t rows;
+	uint64_t offset; // from the start of the file
+};
+
+struct jcf_header {
+	char magic[4];
+	uint32_t byte_order; // JCF_BYTE_ORDER
+	uint64_t size; // of the whole file
+	uint32_t width;
+	uint32_t height;
+	uint32_t color_space; // J_COLOR_SPACE
+	uint32_t num_components;
+	uint32_t quant_tbls; // bit n set if table n is there
+	uint16_t quantval[4][DCTSIZE2]; // natural order
+	uint8_t jfif; // write a JFIF marker, with these
+	uint8_t density_unit;
+	uint16_t x_density;
+	uint16_t y_density;
+	uint8_t adobe; // write an Adobe marker
+	uint8_t pad[13];
+	struct jcf_component comp[4];
+};
+
+// whether the buffer starts like a jcf
+bool jcf_is_jcf(const void *buf, size_t size);
+// whether the path ends in .jcf (the tools read and write those as jcfs)
+bool jcf_path(const char *path);
+
+// maps a whole file copy-on-write: writes to the blocks don't go to the file.
+// NULL and errno on failure
+void *jcf_map(const char *path, size_t *size);
+void jcf_unmap(void *buf, size_t size);
+
+// like jpeg_read_header() on a created decompressor, but from a jcf in
+// memory. errors go to cinfo's error manager
+void jcf_read_header(j_decompress_ptr cinfo, const void *buf, size_t size);
+// like jpeg_read_coefficients(), after jcf_read_header() with the same buffer.
+// the arrays point into buf, so it has to stay valid until cinfo is aborted
+// or destroyed. writable access to them writes to buf
+jvirt_barray_ptr *jcf_read_coefficients(j_decompress_ptr cinfo, void *buf);
+// a virtual array of the rows x blocks_per_row blocks at plane, like the ones
+// jcf_read_coefficients() returns, for blocks kept somewhere else than
+// libjpeg's memory manager. plane has to outlive cinfo's image pool
+jvirt_barray_ptr jcf_plane_array(j_common_ptr cinfo, JBLOCKROW plane,
+	JDIMENSION blocks_per_row, JDIMENSION rows);
+// a compressor given arrays from jcf_read_coefficients() (or anything else
+// that accesses them) needs this first. the arrays of libjpeg itself still
+// work with it
+void jcf_hook(j_common_ptr cinfo);
+
+// jpeg_write_coefficients() and jpeg_finish_compress() in one, writing a jcf
+// to cinfo->dest instead. cinfo only needs its parameters set, as for
+// jpeg_write_coefficients() (jpeg_copy_critical_parameters() etc.), and is
+// aborted at the end like jpeg_finish_compress() would. arrays with more
+// components than cinfo (for grayscale output) are fine
+void jcf_write_coefficients(j_compress_ptr cinfo, jvirt_barray_ptr *coef_arrays);
@@ -0,0 +1,390 @@
+#include "jcmp.h"
+#include "jcf.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+// https://github.com/libjpeg-turbo/libjpeg-turbo/blob/c23672c/jutils.c#L75
+#define jdiv_round_up(a, b) (((a) + (b) - 1) / (b))
+
+_Static_assert(sizeof(((struct jcmp_result *)0)->msg) >= JMSG_LENGTH_MAX, "");
+
+// libjpeg errors go in result->msg
+struct jcmp_errmgr {
+	struct jpeg_error_mgr pub; // must be the first member
+	jmp_buf ret;
+	char *msg;
+};
+
+__attribute__((cold))
+static void jcmp_error_handler(j_common_ptr cinfo)
+{
+	struct jcmp_errmgr *err = (struct jcmp_errmgr *)cinfo->err;
+
+	cinfo->err->format_message(cinfo, err->msg);
+	longjmp(err->ret, 1);
+}
+
+static void jcmp_output_message(j_common_ptr cinfo)
+{
+	// warnings are ignored
+}
+
+__attribute__((format(printf, 2, 3)))
+static void jcmp_set_msg(struct jcmp_result *res, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(res->msg, sizeof(res->msg), fmt, ap);
+	va_end(ap);
+}
+
+// the area to compare. whole means both images, which must be the same size
+struct jcmp_area {
+	bool whole;
+	unsigned w, h;
+	unsigned x1, y1;
+	unsigned x2, y2;
+};
+
+static const char *jcmp_color_space_name(J_COLOR_SPACE cs)
+{
+	switch (cs) {
+	case JCS_GRAYSCALE: return "grayscale";
+	case JCS_RGB: return "RGB";
+	case JCS_YCbCr: return "YCbCr";
+	case JCS_CMYK: return "CMYK";
+	case JCS_YCCK: return "YCCK";
+	default: return "unknown";
+	}
+}
+
+static enum jcmp_status jcmp_check_layout(j_decompress_ptr a, j_decompress_ptr b,
+	struct jcmp_area *area,
+	struct jcmp_result *res)
+{
+	// the same coefficients are a different image in another color space
+	if (a->jpeg_color_space != b->jpeg_color_space) {
+		jcmp_set_msg(res, "different color space (%s and %s)",
+		    jcmp_color_space_name(a->jpeg_color_space),
+		    jcmp_color_space_name(b->jpeg_color_space));
+		return jcmp_differ;
+	}
+	if (a->num_components != b->num_components) {
+		jcmp_set_msg(res, "different number of components (%d and %d)",
+		    a->num_components, b->num_components);
+		return jcmp_differ;
+	}
+	for (int ci = 0; ci < a->num_components; ci++) {
+		if (a->comp_info[ci].h_samp_factor != b->comp_info[ci].h_samp_factor ||
+		    a->comp_info[ci].v_samp_factor != b->comp_info[ci].v_samp_factor) {
+			jcmp_set_msg(res, "different sampling of component %d (%dx%d and %dx%d)", ci,
+			    a->comp_info[ci].h_samp_factor, a->comp_info[ci].v_samp_factor,
+			    b->comp_info[ci].h_samp_factor, b->comp_info[ci].v_samp_factor);
+			return jcmp_differ;
+		}
+	}
+
+	if (area->whole) {
+		if (a->image_width != b->image_width || a->image_height != b->image_height) {
+			jcmp_set_msg(res, "different size (%ux%u and %ux%u)",
+			    a->image_width, a->image_height, b->image_width, b->image_height);
+			return jcmp_differ;
+		}
+		area->w = a->image_width;
+		area->h = a->image_height;
+		return jcmp_same;
+	}
+
+	if U (area->w == 0 || area->h == 0 ||
+	    area->x1 >= a->image_width || area->w > a->image_width-area->x1 ||
+	    area->y1 >= a->image_height || area->h > a->image_height-area->y1 ||
+	    area->x2 >= b->image_width || area->w > b->image_width-area->x2 ||
+	    area->y2 >= b->image_height || area->h > b->image_height-area->y2) {
+		jcmp_set_msg(res, "area %ux%u at %u,%u and %u,%u is outside the images (%ux%u and %ux%u)",
+		    area->w, area->h, area->x1, area->y1, area->x2, area->y2,
+		    a->image_width, a->image_height, b->image_width, b->image_height);
+		return jcmp_error;
+	}
+
+	for (int ci = 0; ci < a->num_components; ci++) {
+		unsigned px = DCTSIZE*a->max_h_samp_factor/a->comp_info[ci].h_samp_factor;
+		unsigned py = DCTSIZE*a->max_v_samp_factor/a->comp_info[ci].v_samp_factor;
+		bool right_edge = (area->x1+area->w == a->image_width || area->x2+area->w == b->image_width);
+		bool bottom_edge = (area->y1+area->h == a->image_height || area->y2+area->h == b->image_height);
+
+		if U (area->x1%px != 0 || area->x2%px != 0 || (area->w%px != 0 && !right_edge) ||
+		    area->y1%py != 0 || area->y2%py != 0 || (area->h%py != 0 && !bottom_edge)) {
+			jcmp_set_msg(res, "area isn't aligned to the %ux%u blocks of component %d", px, py, ci);
+			return jcmp_error;
+		}
+	}
+
+	return jcmp_same;
+}
+
+// the blocks of the area, component by component and row by row
+static enum jcmp_status jcmp_blocks(j_decompress_ptr a, jvirt_barray_ptr *coefs_a,
+	j_decompress_ptr b, jvirt_barray_ptr *coefs_b,
+	const struct jcmp_area *area,
+	struct jcmp_result *res)
+{
+	for (int ci = 0; ci < a->num_components; ci++) {
+		jpeg_component_info *comp_a = &a->comp_info[ci];
+		jpeg_component_info *comp_b = &b->comp_info[ci];
+		JQUANT_TBL *qa = a->quant_tbl_ptrs[comp_a->quant_tbl_no];
+		JQUANT_TBL *qb = b->quant_tbl_ptrs[comp_b->quant_tbl_no];
+		unsigned px = DCTSIZE*a->max_h_samp_factor/comp_a->h_samp_factor;
+		unsigned py = DCTSIZE*a->max_v_samp_factor/comp_a->v_samp_factor;
+		unsigned bw = jdiv_round_up(area->w, px);
+		unsigned bh = jdiv_round_up(area->h, py);
+		bool same_q;
+
+		if U (!qa || !qb) {
+			jcmp_set_msg(res, "component %d has no quantization table", ci);
+			return jcmp_error;
+		}
+		same_q = (memcmp(qa->quantval, qb->quantval, sizeof(qa->quantval)) == 0);
+
+		for (unsigned row = 0; row < bh; row++) {
+			JBLOCKROW ra, rb;
+			unsigned bx;
+
+			// (two different arrays, so both pointers stay valid)
+			ra = a->mem->access_virt_barray((j_common_ptr)a, coefs_a[ci],
+			    area->y1/py+row, 1, FALSE)[0]+area->x1/px;
+			rb = b->mem->access_virt_barray((j_common_ptr)b, coefs_b[ci],
+			    area->y2/py+row, 1, FALSE)[0]+area->x2/px;
+
+			if (same_q) {
+				if L (memcmp(ra, rb, bw*sizeof(JBLOCK)) == 0)
+					continue;
+				for (bx = 0; bx < bw; bx++)
+					if (memcmp(ra[bx], rb[bx], sizeof(JBLOCK)) != 0)
+						goto differ;
+			} else {
+				for (bx = 0; bx < bw; bx++)
+					for (int k = 0; k < DCTSIZE2; k++)
+						if (ra[bx][k]*qa->quantval[k] != rb[bx][k]*qb->quantval[k])
+							goto differ;
+			}
+			continue;
+differ:
+			res->component = ci;
+			res->x = area->x1+bx*px;
+			res->y = area->y1+row*py;
+			jcmp_set_msg(res, "component %d differs at %u,%u (%u,%u in the second image)",
+			    ci, res->x, res->y, area->x2+bx*px, area->y2+row*py);
+			return jcmp_differ;
+		}
+	}
+
+	return jcmp_same;
+}
+
+// one of the images: a jpg read from f, or a .jcf mapped into map
+struct jcmp_file {
+	FILE *f;
+	void *map;
+	size_t map_size;
+};
+
+static bool jcmp_open(struct jcmp_file *file, const char *path, struct jcmp_result *res)
+{
+	if (jcf_path(path))
+		file->map = jcf_map(path, &file->map_size);
+	else
+		file->f = fopen(path, "r");
+
+	if U (!file->f && !file->map) {
+		jcmp_set_msg(res, "%s: %s", path, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static void jcmp_close(struct jcmp_file *file)
+{
+	if (file->f)
+		fclose(file->f);
+	jcf_unmap(file->map, file->map_size);
+}
+
+static void jcmp_read_header(j_decompress_ptr cinfo, struct jcmp_file *file)
+{
+	if (file->map) {
+		jcf_read_header(cinfo, file->map, file->map_size);
+	} else {
+		jpeg_stdio_src(cinfo, file->f);
+		jpeg_read_header(cinfo, TRUE);
+	}
+}
+
+static jvirt_barray_ptr *jcmp_read_coefficients(j_decompress_ptr cinfo, struct jcmp_file *file)
+{
+	if (file->map)
+		return jcf_read_coefficients(cinfo, file->map);
+
+	return jpeg_read_coefficients(cinfo);
+}
+
+static enum jcmp_status jcmp_common(const char *path1, const char *path2,
+	struct jcmp_area *area,
+	struct jcmp_result *res)
+{
+	struct jpeg_decompress_struct a = {0}, b = {0};
+	struct jcmp_errmgr err;
+	jvirt_barray_ptr *coefs_a, *coefs_b;
+	struct jcmp_file fa = {0}, fb = {0};
+	enum jcmp_status rv;
+
+	res->component = -1;
+	res->x = 0;
+	res->y = 0;
+	res->msg[0] = '\0';
+
+	if U (!jcmp_open(&fa, path1, res))
+		return jcmp_error;
+	if U (!jcmp_open(&fb, path2, res)) {
+		jcmp_close(&fa);
+		return jcmp_error;
+	}
+
+	a.err = jpeg_std_error(&err.pub);
+	b.err = &err.pub;
+	err.pub.error_exit = jcmp_error_handler;
+	err.pub.output_message = jcmp_output_message;
+	err.msg = res->msg;
+
+	if U (setjmp(err.ret) != 0) {
+		rv = jcmp_error;
+		goto out;
+	}
+
+	jpeg_create_decompress(&a);
+	jpeg_create_decompress(&b);
+	jcmp_read_header(&a, &fa);
+	jcmp_read_header(&b, &fb);
+
+	if ((rv = jcmp_check_layout(&a, &b, area, res)) != jcmp_same)
+		goto out;
+
+	coefs_a = jcmp_read_coefficients(&a, &fa);
+	coefs_b = jcmp_read_coefficients(&b, &fb);
+
+	rv = jcmp_blocks(&a, coefs_a, &b, coefs_b, area, res);
+out:
+	// (zeroed structs are fine here)
+	jpeg_destroy_decompress(&a);
+	jpeg_destroy_decompress(&b);
+	jcmp_close(&fa);
+	jcmp_close(&fb);
+
+	return rv;
+}
+
+enum jcmp_status jcmp(const char *path1, const char *path2, struct jcmp_result *result)
+{
+	struct jcmp_area area = { .whole = true };
+
+	return jcmp_common(path1, path2, &area, result);
+}
+
+enum jcmp_status jcmp_area(const char *path1, const char *path2,
+	unsigned w, unsigned h,
+	unsigned x1, unsigned y1,
+	unsigned x2, unsigned y2,
+	struct jcmp_result *result)
+{
+	struct jcmp_area area = {
+		.whole = false,
+		.w = w, .h = h,
+		.x1 = x1, .y1 = y1,
+		.x2 = x2, .y2 = y2,
+	};
+
+	return jcmp_common(path1, path2, &area, result);
+}
+
+// -----------------------------------------------------------------------------
+
+static bool parse_unsigned(const char *s, unsigned *out)
+{
+	char *end;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	if (end == s || *end != '\0' || errno != 0 || n > 0xffffffffUL)
+		return false;
+	*out = n;
+
+	return true;
+}
+
+__attribute__((weak))
+int main(int argc, char **argv)
+{
+	struct jcmp_result res;
+	enum jcmp_status st;
+	bool silent = false;
+	unsigned n[6];
+
+	if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+		silent = true;
+		argc--;
+		argv++;
+	}
+
+	if (argc == 3) {
+		st = jcmp(argv[1], argv[2], &res);
+	} else if (argc == 7 || argc == 9) {
+		for (int i = 0; i < argc-3; i++) {
+			if (!parse_unsigned(argv[3+i], &n[i])) {
+				fprintf(stderr, "jcmp: bad number \"%s\"\n", argv[3+i]);
+				goto usage;
+			}
+		}
+		if (argc == 7) {
+			n[4] = n[2];
+			n[5] = n[3];
+		}
+		st = jcmp_area(argv[1], argv[2], n[0], n[1], n[2], n[3], n[4], n[5], &res);
+	} else {
+usage:
+		fprintf(stderr,
+		    "usage: jcmp [-s] <file1> <file2> [<w> <h> <x1> <y1> [<x2> <y2>]]\n"
+		    "compares the dct coefficients of two jpgs (or .jcf files), or of a w x h\n"
+		    "area of each\n"
+		    "(at x1,y1 in both, or at x2,y2 in the second one)\n"
+		    "    -s    print nothing, only set the exit status\n"
+		    "exit status is 0 if they're the same, 1 if different, 2 on errors\n"
+		    );
+		return 2;
+	}
+
+	switch (st) {
+	case jcmp_same:
+		return 0;
+	case jcmp_differ:
+		if (!silent)
+			printf("%s %s differ: %s\n", argv[1], argv[2], res.msg);
+		return 1;
+	default:
+		fprintf(stderr, "jcmp: %s\n", res.msg);
+		return 2;
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+// compares jpgs by their dct coefficients instead of decoding them. blocks
+// are equal if their coefficients times the quantization tables are, so the
+// same image saved with different tables of the same values still compares
+// equal. stops at the first block that differs
+// paths ending in .jcf are read as jcfs (see jcf.h), so a jpg can be compared
+// with its coefficients saved as a jcf
+
+enum jcmp_status {
+	jcmp_same = 0,
+	jcmp_differ = 1,
+	jcmp_error = 2,
+};
+
+struct jcmp_result {
+	// with jcmp_differ, the first block that differed: its component and
+	// top left corner in pixels of the first image. component is -1 if the
+	// images couldn't be compared block by block (different size, number
+	// of components or sampling)
+	int component;
+	unsigned x;
+	unsigned y;
+	// what differed, or why it failed
+	char msg[200]; // (JMSG_LENGTH_MAX)
+};
+
+// the whole images. safe to call from any thread
+enum jcmp_status jcmp(const char *path1, const char *path2, struct jcmp_result *result);
+
+// the w x h pixel area at x1, y1 of the first image against the one at x2, y2
+// of the second. the corners have to be on block boundaries in both images
+// (multiples of 8, or 16 for 2x subsampled chroma), except that the area may
+// end at the right or bottom edge of either image. partial blocks there are
+// compared whole
+enum jcmp_status jcmp_area(const char *path1, const char *path2,
+	unsigned w, unsigned h,
+	unsigned x1, unsigned y1,
+	unsigned x2, unsigned y2,
+	struct jcmp_result *result);
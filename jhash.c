@@ -0,0 +1,247 @@
+#include "jhash.h"
+#include "jcf.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <jpeglib.h>
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+static const uint64_t jhash_key[8] = {
+	0xbe4ba423396cfeb8, 0x1cad21f72c81017c,
+	0xdb979083e96dd4de, 0x1f67b3b7a4a44072,
+	0x78e5c0cc4ee679cb, 0x2172ffcc7dd05a82,
+	0x8e2443f7744608b8, 0x4c263a81e69035e0,
+};
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+// scramble the accumulators every 1 KiB so that high bits get mixed back in
+#define JHASH_STRIPES_PER_SCRAMBLE 16
+
+static inline uint64_t rd64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64-r));
+}
+
+static inline void jhash_stripe(uint64_t *restrict acc, const unsigned char *restrict p)
+{
+	for (int i = 0; i < 8; i++) {
+		uint64_t d = rd64(p+8*i);
+		uint64_t k = d ^ jhash_key[i];
+
+		acc[i^1] += d;
+		acc[i] += (k & 0xffffffff)*(k >> 32);
+	}
+}
+
+static inline void jhash_scramble(uint64_t *acc)
+{
+	for (int i = 0; i < 8; i++) {
+		uint64_t a = acc[i];
+
+		a ^= a >> 47;
+		a ^= jhash_key[i];
+		a *= PRIME32_1;
+		acc[i] = a;
+	}
+}
+
+void jhash_init(struct jhash *h)
+{
+	memset(h, 0, sizeof(*h));
+
+	for (int i = 0; i < 8; i++)
+		h->acc[i] = jhash_key[7-i];
+}
+
+void jhash_update(struct jhash *h, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	h->total += size;
+
+	if (h->tail_len) {
+		size_t n = sizeof(h->tail)-h->tail_len;
+
+		if (n > size)
+			n = size;
+		memcpy(h->tail+h->tail_len, p, n);
+		h->tail_len += n;
+		p += n;
+		size -= n;
+		if (h->tail_len < sizeof(h->tail))
+			return;
+		jhash_stripe(h->acc, h->tail);
+		h->tail_len = 0;
+		if (++h->stripes == JHASH_STRIPES_PER_SCRAMBLE) {
+			jhash_scramble(h->acc);
+			h->stripes = 0;
+		}
+	}
+
+	while (size >= 64) {
+		jhash_stripe(h->acc, p);
+		if (++h->stripes == JHASH_STRIPES_PER_SCRAMBLE) {
+			jhash_scramble(h->acc);
+			h->stripes = 0;
+		}
+		p += 64;
+		size -= 64;
+	}
+
+	memcpy(h->tail, p, size);
+	h->tail_len = size;
+}
+
+static inline uint64_t jhash_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+
+	return h;
+}
+
+uint64_t jhash_final(struct jhash *h)
+{
+	uint64_t rv = h->total*PRIME64_1;
+
+	if (h->tail_len) {
+		memset(h->tail+h->tail_len, 0, sizeof(h->tail)-h->tail_len);
+		jhash_stripe(h->acc, h->tail);
+	}
+	jhash_scramble(h->acc);
+
+	for (int i = 0; i < 8; i += 2) {
+		__uint128_t m = (__uint128_t)(h->acc[i] ^ jhash_key[i]) * (h->acc[i+1] ^ jhash_key[i+1]);
+
+		rv += (uint64_t)m ^ (uint64_t)(m >> 64);
+		rv = rotl64(rv, 27)*PRIME64_2;
+	}
+
+	return jhash_avalanche(rv);
+}
+
+// -----------------------------------------------------------------------------
+
+uint64_t jhash_coefs(j_decompress_ptr cinfo, jvirt_barray_ptr *coef_arrays, int num_components)
+{
+	struct jhash h;
+
+	jhash_init(&h);
+
+	for (int ci = 0; ci < num_components; ci++) {
+		jpeg_component_info *comp = &cinfo->comp_info[ci];
+		JQUANT_TBL *qtbl = cinfo->quant_tbl_ptrs[comp->quant_tbl_no];
+		uint32_t hdr[3] = {ci, comp->width_in_blocks, comp->height_in_blocks};
+
+		jhash_update(&h, hdr, sizeof(hdr));
+		if (qtbl)
+			jhash_update(&h, qtbl->quantval, sizeof(qtbl->quantval));
+
+		for (JDIMENSION row = 0; row < comp->height_in_blocks; row++) {
+			JBLOCKARRAY blocks;
+
+			blocks = cinfo->mem->access_virt_barray(
+			    (j_common_ptr)cinfo, coef_arrays[ci],
+			    /* start_row */ row,
+			    /* num_rows */ 1,
+			    /* writable */ FALSE);
+
+			jhash_update(&h, blocks[0], comp->width_in_blocks*sizeof(JBLOCK));
+		}
+	}
+
+	return jhash_final(&h);
+}
+
+// libjpeg errors go in errmsg
+struct jhash_errmgr {
+	struct jpeg_error_mgr pub; // must be the first member
+	jmp_buf ret;
+	char *msg;
+};
+
+__attribute__((cold))
+static void jhash_error_handler(j_common_ptr cinfo)
+{
+	struct jhash_errmgr *err = (struct jhash_errmgr *)cinfo->err;
+
+	cinfo->err->format_message(cinfo, err->msg);
+	longjmp(err->ret, 1);
+}
+
+static void jhash_output_message(j_common_ptr cinfo)
+{
+	// warnings are ignored
+}
+
+bool jhash_file(const char *path, uint64_t *hash_out, char *errmsg)
+{
+	struct jpeg_decompress_struct cinfo = {0};
+	struct jhash_errmgr jerr;
+	jvirt_barray_ptr *coef_arrays;
+	FILE *f = NULL;
+	void *map = NULL;
+	size_t map_size = 0;
+
+	errmsg[0] = '\0';
+
+	if (jcf_path(path))
+		map = jcf_map(path, &map_size);
+	else
+		f = fopen(path, "r");
+	if U (!f && !map) {
+		snprintf(errmsg, JMSG_LENGTH_MAX, "failed to open input file: %s", strerror(errno));
+		return false;
+	}
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jhash_error_handler;
+	jerr.pub.output_message = jhash_output_message;
+	jerr.msg = errmsg;
+
+	if U (setjmp(jerr.ret) != 0) {
+		// (a zeroed struct is fine here)
+		jpeg_destroy_decompress(&cinfo);
+		if (f)
+			fclose(f);
+		jcf_unmap(map, map_size);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	if (map) {
+		jcf_read_header(&cinfo, map, map_size);
+		coef_arrays = jcf_read_coefficients(&cinfo, map);
+	} else {
+		jpeg_stdio_src(&cinfo, f);
+		jpeg_read_header(&cinfo, TRUE);
+		coef_arrays = jpeg_read_coefficients(&cinfo);
+	}
+
+	*hash_out = jhash_coefs(&cinfo, coef_arrays, cinfo.num_components);
+
+	jpeg_destroy_decompress(&cinfo);
+	if (f)
+		fclose(f);
+	jcf_unmap(map, map_size);
+
+	return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+// fast non-cryptographic 64-bit hash, for checking that the lossless tools
+// really didn't change anything
+// 8 independent 64-bit lanes (xxh3-style) so the compiler can vectorize it
+
+struct jhash {
+	uint64_t acc[8];
+	unsigned char tail[64];
+	size_t tail_len;
+	uint64_t total;
+	unsigned stripes; // since the last scramble
+};
+
+void jhash_init(struct jhash *h);
+void jhash_update(struct jhash *h, const void *data, size_t size);
+uint64_t jhash_final(struct jhash *h);
+
+// hash of the first num_components components: their sizes, quantization
+// tables and coefficients (padding blocks not included)
+uint64_t jhash_coefs(j_decompress_ptr cinfo, jvirt_barray_ptr *coef_arrays, int num_components);
+
+// same for a file, reading only the coefficients (a .jcf is mapped)
+// on failure errmsg (JMSG_LENGTH_MAX bytes) says why
+bool jhash_file(const char *path, uint64_t *hash_out, char *errmsg);
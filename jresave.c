@@ -1,131 +1,1501 @@
 #include "jresave.h"
+#include "batch.h"
+#include "bio.h"
+#include "dctresample.h"
+#include "jcf.h"
+#include "jhash.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <setjmp.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <jpeglib.h>
+#include <jerror.h>
 
 #define U(x) (__builtin_expect(!!(x), 0))
 #define L(x) (__builtin_expect(!!(x), 1))
 
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// https://github.com/libjpeg-turbo/libjpeg-turbo/blob/c23672c/jutils.c#L75
+#define jdiv_round_up(a, b) (((a) + (b) - 1) / (b))
+
+// errors (and warnings) end up in msg instead of stderr
+struct resave_errmgr {
+	struct jpeg_error_mgr pub; // must be the first member
+	jmp_buf catch;
+	char msg[JMSG_LENGTH_MAX];
+};
+
 __attribute__((cold))
 static void resave_error_handler(j_common_ptr cinfo)
 {
-	char errmsg[JMSG_LENGTH_MAX];
+	struct resave_errmgr *err = (struct resave_errmgr *)cinfo->err;
+
+	cinfo->err->format_message(cinfo, err->msg);
+	longjmp(err->catch, 1);
+}
+
+static void resave_output_message(j_common_ptr cinfo)
+{
+	struct resave_errmgr *err = (struct resave_errmgr *)cinfo->err;
+
+	cinfo->err->format_message(cinfo, err->msg);
+}
+
+static struct jpeg_error_mgr *resave_errmgr_init(struct resave_errmgr *err)
+{
+	jpeg_std_error(&err->pub);
+	err->pub.error_exit = resave_error_handler;
+	err->pub.output_message = resave_output_message;
+	err->msg[0] = '\0';
+
+	return &err->pub;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void resave_set_error(struct resave_errmgr *err, const char *fmt, ...)
+{
+	va_list ap;
 
-	cinfo->err->format_message(cinfo, errmsg);
-	fprintf(stderr, "resave: libjpeg error: %s\n", errmsg);
-	longjmp(*(jmp_buf *)cinfo->client_data, 1);
+	va_start(ap, fmt);
+	vsnprintf(err->msg, sizeof(err->msg), fmt, ap);
+	va_end(ap);
 }
 
 #define TMPSUF ".tmp"
 
-bool resave(const char *inpath, const char *outpath, const struct resave_opts *opts)
+// true if every coefficient of the color components is zero, so dropping them
+// doesn't change what the image looks like
+static bool resave_chroma_is_empty(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coef_arrays)
+{
+	if (srcinfo->num_components == 1)
+		return true;
+	if (srcinfo->jpeg_color_space != JCS_YCbCr)
+		return false;
+
+	for (int ci = 1; ci < srcinfo->num_components; ci++) {
+		jpeg_component_info *comp = &srcinfo->comp_info[ci];
+
+		for (JDIMENSION row = 0; row < comp->height_in_blocks; row++) {
+			JBLOCKARRAY blocks;
+			JCOEF *coefs;
+			JCOEF acc = 0;
+
+			blocks = srcinfo->mem->access_virt_barray(
+			    (j_common_ptr)srcinfo, src_coef_arrays[ci],
+			    /* start_row */ row,
+			    /* num_rows */ 1,
+			    /* writable */ FALSE);
+
+			coefs = &blocks[0][0][0];
+			for (JDIMENSION i = 0; i < comp->width_in_blocks*DCTSIZE2; i++)
+				acc |= coefs[i];
+			if (acc != 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// growable memory destination. unlike jpeg_mem_dest() the buffer can be
+// reused for the next image and doesn't leak if compression fails
+
+struct resave_membuf {
+	struct jpeg_destination_mgr pub; // must be the first member
+	unsigned char *buf;
+	size_t size;
+	size_t used;
+};
+
+#define RESAVE_MEMBUF_INITIAL_SIZE (64*1024)
+
+static void resave_membuf_init_destination(j_compress_ptr cinfo)
+{
+	struct resave_membuf *mb = (struct resave_membuf *)cinfo->dest;
+
+	mb->pub.next_output_byte = mb->buf;
+	mb->pub.free_in_buffer = mb->size;
+	mb->used = 0;
+}
+
+static boolean resave_membuf_empty_output_buffer(j_compress_ptr cinfo)
+{
+	struct resave_membuf *mb = (struct resave_membuf *)cinfo->dest;
+	size_t newsize = mb->size*2;
+	unsigned char *newbuf;
+
+	// called with the buffer full (free_in_buffer is garbage here)
+	if U (!(newbuf = realloc(mb->buf, newsize)))
+		ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+
+	mb->pub.next_output_byte = newbuf+mb->size;
+	mb->pub.free_in_buffer = newsize-mb->size;
+	mb->buf = newbuf;
+	mb->size = newsize;
+
+	return TRUE;
+}
+
+static void resave_membuf_term_destination(j_compress_ptr cinfo)
+{
+	struct resave_membuf *mb = (struct resave_membuf *)cinfo->dest;
+
+	mb->used = mb->size-mb->pub.free_in_buffer;
+}
+
+static bool resave_membuf_init(struct resave_membuf *mb)
+{
+	memset(mb, 0, sizeof(*mb));
+
+	if U (!(mb->buf = malloc(RESAVE_MEMBUF_INITIAL_SIZE)))
+		return false;
+	mb->size = RESAVE_MEMBUF_INITIAL_SIZE;
+
+	mb->pub.init_destination = resave_membuf_init_destination;
+	mb->pub.empty_output_buffer = resave_membuf_empty_output_buffer;
+	mb->pub.term_destination = resave_membuf_term_destination;
+
+	return true;
+}
+
+// -1: leave the file alone, otherwise whether to write it as grayscale
+// convert: the output is a different format (jpg/jcf) than the input
+static int resave_pick_grayscale(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coef_arrays,
+	const struct resave_opts *opts,
+	bool convert,
+	struct resave_result *result)
+{
+	bool isgray;
+
+	if (!opts->autogray)
+		return opts->grayscale;
+
+	isgray = resave_chroma_is_empty(srcinfo, src_coef_arrays);
+	if (result)
+		result->grayscale = isgray;
+
+	if (isgray && srcinfo->num_components > 1)
+		return true;
+	if (!opts->optimize && !opts->progressive && !opts->scan_search && !opts->halve && !convert)
+		return -1;
+
+	return opts->grayscale;
+}
+
+// -----------------------------------------------------------------------------
+
+// output size estimate for sequential -optimize output
+// gathers the same symbol statistics as the huffman encoder's first pass and
+// builds the optimal code lengths, but doesn't encode anything
+
+static const unsigned char zigzag[DCTSIZE2] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+struct huff_stats {
+	unsigned long dc[2][257];
+	unsigned long ac[2][257];
+	unsigned long long extra_bits;
+};
+
+static inline int nbits(int v)
+{
+	unsigned a = (v < 0) ? -v : v;
+
+	return (a) ? 32-__builtin_clz(a) : 0;
+}
+
+static void huff_count_block(struct huff_stats *st, int tbl, const JCOEF *block, int *last_dc)
+{
+	int r = 0;
+	int n;
+
+	n = nbits(block[0]-*last_dc);
+	*last_dc = block[0];
+	st->dc[tbl][n]++;
+	st->extra_bits += n;
+
+	for (int k = 1; k < DCTSIZE2; k++) {
+		int v = block[zigzag[k]];
+
+		if (v == 0) {
+			r++;
+			continue;
+		}
+		while (r > 15) {
+			st->ac[tbl][0xF0]++;
+			r -= 16;
+		}
+		n = nbits(v);
+		st->ac[tbl][(r<<4)|n]++;
+		st->extra_bits += n;
+		r = 0;
+	}
+	if (r > 0)
+		st->ac[tbl][0x00]++;
+}
+
+// padding blocks repeat the previous dc and have no ac
+static void huff_count_dummy(struct huff_stats *st, int tbl)
+{
+	st->dc[tbl][0]++;
+	st->ac[tbl][0x00]++;
+}
+
+// jpeg_gen_optimal_table() from jchuff.c, returning the size of the coded
+// symbols in bits and the number of symbols in the table
+static unsigned long long huff_optimal_bits(const unsigned long *freq_in, int *nsyms_out)
+{
+	unsigned char bits[33] = {0};
+	int codesize[257] = {0};
+	int others[257];
+	long freq[257];
+	int order[256];
+	int nsyms = 0;
+	unsigned long long total = 0;
+	int i, j, k;
+
+	for (i = 0; i < 257; i++) {
+		freq[i] = freq_in[i];
+		others[i] = -1;
+	}
+	freq[256] = 1; // reserved so that no real code is all ones
+
+	for (;;) {
+		int c1 = -1, c2 = -1;
+		long v = 1000000000L;
+
+		for (i = 0; i <= 256; i++) {
+			if (freq[i] && freq[i] <= v) {
+				v = freq[i];
+				c1 = i;
+			}
+		}
+		v = 1000000000L;
+		for (i = 0; i <= 256; i++) {
+			if (freq[i] && freq[i] <= v && i != c1) {
+				v = freq[i];
+				c2 = i;
+			}
+		}
+		if (c2 < 0)
+			break;
+
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+
+		codesize[c1]++;
+		while (others[c1] >= 0) {
+			c1 = others[c1];
+			codesize[c1]++;
+		}
+		others[c1] = c2;
+
+		codesize[c2]++;
+		while (others[c2] >= 0) {
+			c2 = others[c2];
+			codesize[c2]++;
+		}
+	}
+
+	for (i = 0; i <= 256; i++)
+		if (codesize[i])
+			bits[MIN(codesize[i], 32)]++;
+
+	// limit code lengths to 16 bits
+	for (i = 32; i > 16; i--) {
+		while (bits[i] > 0) {
+			j = i-2;
+			while (bits[j] == 0)
+				j--;
+			bits[i] -= 2;
+			bits[i-1]++;
+			bits[j+1] += 2;
+			bits[j]--;
+		}
+	}
+	while (bits[i] == 0)
+		i--;
+	bits[i]--;
+
+	// symbols get lengths in order of their unlimited code size
+	for (i = 1; i <= 32; i++)
+		for (j = 0; j <= 255; j++)
+			if (codesize[j] == i)
+				order[nsyms++] = j;
+
+	for (i = 1, k = 0; i <= 16; i++)
+		for (j = 0; j < bits[i]; j++, k++)
+			total += (unsigned long long)freq_in[order[k]]*i;
+
+	*nsyms_out = nsyms;
+
+	return total;
+}
+
+static size_t resave_estimate_size(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coef_arrays,
+	bool grayscale)
+{
+	struct huff_stats *st;
+	int num_components = (grayscale) ? 1 : srcinfo->num_components;
+	int tbl[MAX_COMPONENTS];
+	int last_dc[MAX_COMPONENTS] = {0};
+	bool used_tbl[2] = {false, false};
+	bool used_qtbl[NUM_QUANT_TBLS] = {false};
+	unsigned long long bits;
+	size_t size;
+
+	if U (!(st = calloc(1, sizeof(*st))))
+		return 0;
+
+	// table assignment done by jpeg_set_colorspace()
+	for (int ci = 0; ci < num_components; ci++) {
+		bool chroma = (ci == 1 || ci == 2) &&
+		    (srcinfo->jpeg_color_space == JCS_YCbCr || srcinfo->jpeg_color_space == JCS_YCCK);
+
+		tbl[ci] = (chroma) ? 1 : 0;
+		used_tbl[tbl[ci]] = true;
+		used_qtbl[srcinfo->comp_info[ci].quant_tbl_no] = true;
+	}
+
+	if (num_components == 1) {
+		// non-interleaved: only the real blocks, in raster order
+		jpeg_component_info *comp = &srcinfo->comp_info[0];
+
+		for (JDIMENSION row = 0; row < comp->height_in_blocks; row++) {
+			JBLOCKARRAY blocks;
+
+			blocks = srcinfo->mem->access_virt_barray(
+			    (j_common_ptr)srcinfo, src_coef_arrays[0],
+			    /* start_row */ row,
+			    /* num_rows */ 1,
+			    /* writable */ FALSE);
+
+			for (JDIMENSION x = 0; x < comp->width_in_blocks; x++)
+				huff_count_block(st, tbl[0], blocks[0][x], &last_dc[0]);
+		}
+	} else {
+		// interleaved: MCU order, padded to whole MCUs
+		unsigned mcus_x = jdiv_round_up(srcinfo->image_width, srcinfo->max_h_samp_factor*DCTSIZE);
+		unsigned mcus_y = jdiv_round_up(srcinfo->image_height, srcinfo->max_v_samp_factor*DCTSIZE);
+
+		for (unsigned my = 0; my < mcus_y; my++) {
+			JBLOCKARRAY rows[MAX_COMPONENTS];
+
+			for (int ci = 0; ci < num_components; ci++) {
+				jpeg_component_info *comp = &srcinfo->comp_info[ci];
+				JDIMENSION first = my*comp->v_samp_factor;
+				JDIMENSION cnt = MIN((JDIMENSION)comp->v_samp_factor, comp->height_in_blocks-first);
+
+				rows[ci] = srcinfo->mem->access_virt_barray(
+				    (j_common_ptr)srcinfo, src_coef_arrays[ci],
+				    /* start_row */ first,
+				    /* num_rows */ cnt,
+				    /* writable */ FALSE);
+			}
+
+			for (unsigned mx = 0; mx < mcus_x; mx++) {
+				for (int ci = 0; ci < num_components; ci++) {
+					jpeg_component_info *comp = &srcinfo->comp_info[ci];
+
+					for (int yy = 0; yy < comp->v_samp_factor; yy++) {
+						JDIMENSION by = my*comp->v_samp_factor+yy;
+
+						for (int xx = 0; xx < comp->h_samp_factor; xx++) {
+							JDIMENSION bx = mx*comp->h_samp_factor+xx;
+
+							if (bx < comp->width_in_blocks && by < comp->height_in_blocks)
+								huff_count_block(st, tbl[ci], rows[ci][yy][bx], &last_dc[ci]);
+							else
+								huff_count_dummy(st, tbl[ci]);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	bits = st->extra_bits;
+
+	// SOI, APP0/APP14, SOF, SOS, EOI
+	size = 2 + 18 + (10+3*num_components) + (8+2*num_components) + 2;
+	for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+		if (used_qtbl[i]) {
+			bool wide = false;
+
+			for (int k = 0; k < DCTSIZE2; k++)
+				wide |= (srcinfo->quant_tbl_ptrs[i]->quantval[k] > 255);
+			size += 5 + ((wide) ? 128 : 64);
+		}
+	}
+	for (int t = 0; t < 2; t++) {
+		int nsyms;
+
+		if (!used_tbl[t])
+			continue;
+		bits += huff_optimal_bits(st->dc[t], &nsyms);
+		size += 21 + nsyms;
+		bits += huff_optimal_bits(st->ac[t], &nsyms);
+		size += 21 + nsyms;
+	}
+
+	// entropy-coded data, plus a stuffed zero after roughly every 256th byte
+	size += (bits+7)/8;
+	size += (bits+7)/8/256;
+
+	free(st);
+
+	return size;
+}
+
+// true if the file shouldn't be rewritten (dry run or not worth it)
+static bool resave_skip_by_estimate(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coef_arrays,
+	const struct resave_opts *opts,
+	bool grayscale,
+	size_t insize,
+	struct resave_result *result)
+{
+	size_t estimate, min_saving;
+
+	if (!opts->dryrun && !opts->min_saving && !opts->min_saving_pct)
+		return false;
+	// only sequential output with optimized tables is modeled
+	if (!opts->optimize || opts->progressive || opts->scan_search || opts->halve || opts->jcf)
+		return opts->dryrun;
+
+	estimate = resave_estimate_size(srcinfo, src_coef_arrays, grayscale);
+	if (result)
+		result->estimate = estimate;
+
+	if (opts->dryrun)
+		return true;
+
+	min_saving = MAX(opts->min_saving, insize/100*opts->min_saving_pct);
+
+	return (estimate+min_saving > insize);
+}
+
+// dstinfo must have its destination set up
+static void resave_setup(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+	const struct resave_opts *opts,
+	bool grayscale)
+{
+	jpeg_copy_critical_parameters(srcinfo, dstinfo);
+
+	if (opts->halve) {
+		dstinfo->image_width = jdiv_round_up(srcinfo->image_width, 2);
+		dstinfo->image_height = jdiv_round_up(srcinfo->image_height, 2);
+	}
+	dstinfo->optimize_coding = !!opts->optimize;
+	if (grayscale) {
+		dstinfo->jpeg_color_space = JCS_GRAYSCALE;
+		dstinfo->num_components = 1;
+		dstinfo->max_h_samp_factor = 1;
+		dstinfo->max_v_samp_factor = 1;
+		dstinfo->comp_info[0].h_samp_factor = 1;
+		dstinfo->comp_info[0].v_samp_factor = 1;
+	}
+	if ((opts->progressive || opts->scan_search) && !opts->jcf)
+		jpeg_simple_progression(dstinfo);
+}
+
+static void resave_write(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+	jvirt_barray_ptr *src_coef_arrays,
+	const struct resave_opts *opts,
+	bool grayscale)
+{
+	resave_setup(srcinfo, dstinfo, opts, grayscale);
+
+	if (opts->jcf) {
+		jcf_write_coefficients(dstinfo, src_coef_arrays);
+		return;
+	}
+	jpeg_write_coefficients(dstinfo, src_coef_arrays);
+	jpeg_finish_compress(dstinfo);
+}
+
+// -----------------------------------------------------------------------------
+
+// -halve: coefficient arrays for the output, sized like libjpeg would for an
+// image of half the size. has to be called between jpeg_read_header() and
+// jpeg_read_coefficients(), which allocates them
+static jvirt_barray_ptr *resave_halve_request(j_decompress_ptr srcinfo)
+{
+	JDIMENSION w = jdiv_round_up(srcinfo->image_width, 2);
+	JDIMENSION h = jdiv_round_up(srcinfo->image_height, 2);
+	JDIMENSION w_imcus = jdiv_round_up(w, srcinfo->max_h_samp_factor*DCTSIZE);
+	JDIMENSION h_imcus = jdiv_round_up(h, srcinfo->max_v_samp_factor*DCTSIZE);
+	jvirt_barray_ptr *arrays;
+
+	arrays = srcinfo->mem->alloc_small(
+	    (j_common_ptr)srcinfo,
+	    JPOOL_IMAGE,
+	    srcinfo->num_components*sizeof(jvirt_barray_ptr));
+
+	for (int ci = 0; ci < srcinfo->num_components; ci++) {
+		jpeg_component_info *comp = &srcinfo->comp_info[ci];
+
+		arrays[ci] = srcinfo->mem->request_virt_barray(
+		    (j_common_ptr)srcinfo,
+		    JPOOL_IMAGE,
+		    /* pre_zero */ FALSE,
+		    /* blocksperrow */ w_imcus*comp->h_samp_factor,
+		    /* numrows */ h_imcus*comp->v_samp_factor,
+		    /* maxaccess */ comp->v_samp_factor); // (what the encoder reads at once)
+	}
+
+	return arrays;
+}
+
+// every output block from the 2x2 source blocks over the same area. blocks
+// past the edge of the source repeat its last row/column
+static void resave_halve(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coef_arrays,
+	jvirt_barray_ptr *dst_coef_arrays, int num_components)
 {
+	JDIMENSION h = jdiv_round_up(srcinfo->image_height, 2);
+	JDIMENSION w = jdiv_round_up(srcinfo->image_width, 2);
+	JDIMENSION w_imcus = jdiv_round_up(w, srcinfo->max_h_samp_factor*DCTSIZE);
+	JDIMENSION h_imcus = jdiv_round_up(h, srcinfo->max_v_samp_factor*DCTSIZE);
+
+	for (int ci = 0; ci < num_components; ci++) {
+		jpeg_component_info *comp = &srcinfo->comp_info[ci];
+		const UINT16 *q = srcinfo->quant_tbl_ptrs[comp->quant_tbl_no]->quantval;
+		JDIMENSION dst_w = w_imcus*comp->h_samp_factor;
+		JDIMENSION dst_h = h_imcus*comp->v_samp_factor;
+		JDIMENSION last_x = comp->width_in_blocks-1;
+		JDIMENSION last_y = comp->height_in_blocks-1;
+		JBLOCKROW top;
+
+		// the source rows are accessed one at a time, so the top one is
+		// copied out before getting the bottom one
+		top = srcinfo->mem->alloc_large(
+		    (j_common_ptr)srcinfo,
+		    JPOOL_IMAGE,
+		    comp->width_in_blocks*sizeof(JBLOCK));
+
+		for (JDIMENSION y = 0; y < dst_h; y++) {
+			JBLOCKROW bottom, dst;
+
+			bottom = srcinfo->mem->access_virt_barray(
+			    (j_common_ptr)srcinfo, src_coef_arrays[ci],
+			    /* start_row */ MIN(y*2, last_y),
+			    /* num_rows */ 1,
+			    /* writable */ FALSE)[0];
+			memcpy(top, bottom, comp->width_in_blocks*sizeof(JBLOCK));
+			bottom = srcinfo->mem->access_virt_barray(
+			    (j_common_ptr)srcinfo, src_coef_arrays[ci],
+			    /* start_row */ MIN(y*2+1, last_y),
+			    /* num_rows */ 1,
+			    /* writable */ FALSE)[0];
+			dst = srcinfo->mem->access_virt_barray(
+			    (j_common_ptr)srcinfo, dst_coef_arrays[ci],
+			    /* start_row */ y,
+			    /* num_rows */ 1,
+			    /* writable */ TRUE)[0];
+
+			for (JDIMENSION x = 0; x < dst_w; x++) {
+				JDIMENSION x0 = MIN(x*2, last_x);
+				JDIMENSION x1 = MIN(x*2+1, last_x);
+				const JCOEF *in[4] = { top[x0], top[x1], bottom[x0], bottom[x1] };
+
+				dctresample_halve(in, 2, 2, q, q, dst[x]);
+			}
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+// progressive scan script search: encode the same coefficients with a few
+// different scripts at once (one thread each) and keep the smallest result.
+// the first candidate is always what jpeg_simple_progression() would do
+
+#define SCAN(n, c0, c1, c2, ss, se, ah, al) { n, { c0, c1, c2, 0 }, ss, se, ah, al }
+#define DC_ALL(ncomps, ah, al) SCAN(ncomps, 0, 1, 2, 0, 0, ah, al)
+#define AC(c, ss, se, ah, al) SCAN(1, c, 0, 0, ss, se, ah, al)
+
+static const jpeg_scan_info scans_gray_1[] = {
+	DC_ALL(1, 0, 0), AC(0, 1, 5, 0, 0), AC(0, 6, 63, 0, 0),
+};
+static const jpeg_scan_info scans_gray_2[] = {
+	DC_ALL(1, 0, 0), AC(0, 1, 2, 0, 0), AC(0, 3, 63, 0, 0),
+};
+static const jpeg_scan_info scans_gray_3[] = {
+	DC_ALL(1, 0, 0), AC(0, 1, 8, 0, 0), AC(0, 9, 63, 0, 0),
+};
+static const jpeg_scan_info scans_gray_4[] = {
+	DC_ALL(1, 0, 0), AC(0, 1, 63, 0, 1), AC(0, 1, 63, 1, 0),
+};
+
+static const jpeg_scan_info scans_color_1[] = {
+	DC_ALL(3, 0, 0), AC(0, 1, 5, 0, 0), AC(1, 1, 63, 0, 0), AC(2, 1, 63, 0, 0),
+	AC(0, 6, 63, 0, 0),
+};
+static const jpeg_scan_info scans_color_2[] = {
+	DC_ALL(3, 0, 0), AC(0, 1, 2, 0, 0), AC(0, 3, 63, 0, 0), AC(1, 1, 63, 0, 0),
+	AC(2, 1, 63, 0, 0),
+};
+static const jpeg_scan_info scans_color_3[] = {
+	DC_ALL(3, 0, 0), AC(0, 1, 8, 0, 0), AC(0, 9, 63, 0, 0), AC(1, 1, 63, 0, 0),
+	AC(2, 1, 63, 0, 0),
+};
+static const jpeg_scan_info scans_color_4[] = {
+	DC_ALL(3, 0, 0), AC(0, 1, 63, 0, 1), AC(1, 1, 63, 0, 0), AC(2, 1, 63, 0, 0),
+	AC(0, 1, 63, 1, 0),
+};
+
+#undef SCAN
+#undef DC_ALL
+#undef AC
+
+struct scan_script {
+	const jpeg_scan_info *scans;
+	int num_scans;
+};
+
+#define S(arr) { arr, sizeof(arr)/sizeof(arr[0]) }
+static const struct scan_script scripts_gray[] = {
+	{ NULL, 0 }, S(scans_gray_1), S(scans_gray_2), S(scans_gray_3), S(scans_gray_4),
+};
+static const struct scan_script scripts_color[] = {
+	{ NULL, 0 }, S(scans_color_1), S(scans_color_2), S(scans_color_3), S(scans_color_4),
+};
+#undef S
+
+#define SCAN_SEARCH_MAX 5
+
+struct scan_candidate {
+	struct jpeg_compress_struct dstinfo;
+	struct resave_errmgr err;
+	struct resave_membuf out;
+
+	j_decompress_ptr srcinfo;
+	jvirt_barray_ptr *src_coef_arrays;
+	const struct resave_opts *opts;
+	bool grayscale;
+	const struct scan_script *script;
+
+	pthread_t thread;
+	bool started;
+	bool ok;
+};
+
+static void *scan_candidate_run(void *arg)
+{
+	struct scan_candidate *c = arg;
+
+	c->dstinfo.err = resave_errmgr_init(&c->err);
+	if U (setjmp(c->err.catch) != 0) {
+		jpeg_destroy_compress(&c->dstinfo);
+		return NULL;
+	}
+
+	jpeg_create_compress(&c->dstinfo);
+	jcf_hook((j_common_ptr)&c->dstinfo);
+	c->dstinfo.dest = &c->out.pub;
+
+	resave_setup(c->srcinfo, &c->dstinfo, c->opts, c->grayscale);
+	if (c->script->scans) {
+		c->dstinfo.scan_info = c->script->scans;
+		c->dstinfo.num_scans = c->script->num_scans;
+	}
+
+	if (c->opts->jcf) {
+		jcf_write_coefficients(&c->dstinfo, c->src_coef_arrays);
+	} else {
+		jpeg_write_coefficients(&c->dstinfo, c->src_coef_arrays);
+		jpeg_finish_compress(&c->dstinfo);
+	}
+	jpeg_destroy_compress(&c->dstinfo);
+
+	c->ok = true;
+
+	return NULL;
+}
+
+// runs every candidate whose output buffer could be allocated. the first one
+// runs on this thread, the others on threads of their own (or here too, if
+// one can't be started)
+static void scan_candidates_run(struct scan_candidate *cands, int ncands)
+{
+	for (int i = 1; i < ncands; i++) {
+		struct scan_candidate *c = &cands[i];
+
+		if L (c->out.buf)
+			c->started = (pthread_create(&c->thread, NULL, scan_candidate_run, c) == 0);
+	}
+
+	for (int i = 0; i < ncands; i++) {
+		struct scan_candidate *c = &cands[i];
+
+		if (c->started)
+			pthread_join(c->thread, NULL);
+		else if (c->out.buf)
+			scan_candidate_run(c);
+	}
+}
+
+// on success, best takes over the buffer of the smallest candidate
+// (the old best->buf is freed). on failure the error goes in err
+static bool resave_scan_search(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coef_arrays,
+	const struct resave_opts *opts,
+	bool grayscale,
+	struct resave_membuf *best,
+	struct resave_errmgr *err)
+{
+	struct scan_candidate *cands;
+	const struct scan_script *scripts;
+	int ncands;
+	int bestidx = -1;
+	int num_components = (grayscale) ? 1 : srcinfo->num_components;
+
+	if (num_components == 1) {
+		scripts = scripts_gray;
+		ncands = sizeof(scripts_gray)/sizeof(scripts_gray[0]);
+	} else if (num_components == 3) {
+		scripts = scripts_color;
+		ncands = sizeof(scripts_color)/sizeof(scripts_color[0]);
+	} else {
+		// only the default script
+		scripts = scripts_color;
+		ncands = 1;
+	}
+
+	if U (!(cands = calloc(ncands, sizeof(*cands)))) {
+		resave_set_error(err, "out of memory");
+		return false;
+	}
+
+	for (int i = 0; i < ncands; i++) {
+		struct scan_candidate *c = &cands[i];
+
+		c->srcinfo = srcinfo;
+		c->src_coef_arrays = src_coef_arrays;
+		c->opts = opts;
+		c->grayscale = grayscale;
+		c->script = &scripts[i];
+
+		resave_membuf_init(&c->out);
+	}
+
+	scan_candidates_run(cands, ncands);
+
+	for (int i = 0; i < ncands; i++) {
+		struct scan_candidate *c = &cands[i];
+
+		if (c->ok && (bestidx == -1 || c->out.used < cands[bestidx].out.used))
+			bestidx = i;
+	}
+
+	if (bestidx != -1) {
+		free(best->buf);
+		*best = cands[bestidx].out;
+		cands[bestidx].out.buf = NULL;
+	} else {
+		if (cands[0].err.msg[0])
+			memcpy(err->msg, cands[0].err.msg, sizeof(err->msg));
+		else
+			resave_set_error(err, "out of memory");
+	}
+
+	for (int i = 0; i < ncands; i++)
+		free(cands[i].out.buf);
+	free(cands);
+
+	return (bestidx != -1);
+}
+
+// -----------------------------------------------------------------------------
+
+// in-memory version. the libjpeg objects and the output buffer stay in the
+// context and get reused by the next call
+
+struct resave_ctx {
 	struct jpeg_decompress_struct srcinfo;
 	struct jpeg_compress_struct dstinfo;
-	struct jpeg_error_mgr jerr;
+	struct resave_errmgr err;
+
+	unsigned char *inbuf;
+	size_t inbuf_size;
+
+	struct resave_membuf out;
+};
+
+struct resave_ctx *resave_ctx_new(void)
+{
+	struct resave_ctx *ctx;
+	volatile bool created_decompress = false;
+
+	if U (!(ctx = calloc(1, sizeof(*ctx))))
+		return NULL;
+
+	if U (!resave_membuf_init(&ctx->out)) {
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->srcinfo.err = resave_errmgr_init(&ctx->err);
+	ctx->dstinfo.err = &ctx->err.pub;
+
+	if U (setjmp(ctx->err.catch) != 0) {
+		if (created_decompress)
+			jpeg_destroy_decompress(&ctx->srcinfo);
+		free(ctx->out.buf);
+		free(ctx);
+		return NULL;
+	}
+	jpeg_create_decompress(&ctx->srcinfo);
+	created_decompress = true;
+	jpeg_create_compress(&ctx->dstinfo);
+	jcf_hook((j_common_ptr)&ctx->dstinfo);
+
+	ctx->dstinfo.dest = &ctx->out.pub;
+
+	return ctx;
+}
+
+void resave_ctx_free(struct resave_ctx *ctx)
+{
+	if U (!ctx)
+		return;
+
+	jpeg_destroy_compress(&ctx->dstinfo);
+	jpeg_destroy_decompress(&ctx->srcinfo);
+
+	free(ctx->inbuf);
+	free(ctx->out.buf);
+	free(ctx);
+}
+
+// jpeg_read_coefficients() for a jpg or jcf in memory. with halve, also
+// returns the arrays for resave_halve() in *half_coef_arrays
+// a jcf's blocks are used where they are. nothing writes to the input arrays,
+// so inbuf stays as it was
+static jvirt_barray_ptr *resave_read_coefficients(j_decompress_ptr srcinfo,
+	const unsigned char *inbuf, size_t insize,
+	bool halve,
+	jvirt_barray_ptr **half_coef_arrays)
+{
 	jvirt_barray_ptr *src_coef_arrays;
-	jmp_buf catch;
-	FILE *infile, *outfile;
-	size_t outpathlen;
-	char *tmpoutpath;
-	volatile enum {
-		state_init = 0,
-		created_decompress_only,
-		created_decompress_and_compress,
-	} state = state_init;
 
-	outpathlen = strlen(outpath);
-	tmpoutpath = alloca(outpathlen+strlen(TMPSUF)+1);
-	memcpy(tmpoutpath, outpath, outpathlen);
-	memcpy(tmpoutpath+outpathlen, TMPSUF, sizeof(TMPSUF));
+	if (jcf_is_jcf(inbuf, insize)) {
+		jcf_read_header(srcinfo, inbuf, insize);
+		src_coef_arrays = jcf_read_coefficients(srcinfo, (void *)inbuf);
+		// nothing else realizes them
+		if (halve) {
+			*half_coef_arrays = resave_halve_request(srcinfo);
+			srcinfo->mem->realize_virt_arrays((j_common_ptr)srcinfo);
+		}
+		return src_coef_arrays;
+	}
+
+	jpeg_mem_src(srcinfo, inbuf, insize);
+	jpeg_read_header(srcinfo, TRUE);
+	if (halve)
+		*half_coef_arrays = resave_halve_request(srcinfo);
+
+	return jpeg_read_coefficients(srcinfo);
+}
+
+// reads the coefficients back from the output (no IDCT) and checks that they
+// hash the same as what was written. the caller's setjmp catches errors
+static bool resave_verify(struct resave_ctx *ctx, uint64_t want)
+{
+	jvirt_barray_ptr *coef_arrays;
+	uint64_t got;
 
-	infile = fopen(inpath, "r");
-	outfile = fopen(tmpoutpath, "w");
+	coef_arrays = resave_read_coefficients(&ctx->srcinfo, ctx->out.buf, ctx->out.used, false, NULL);
+	got = jhash_coefs(&ctx->srcinfo, coef_arrays, ctx->srcinfo.num_components);
+	jpeg_abort_decompress(&ctx->srcinfo);
 
-	if U (!infile) {
-		perror("resave: failed to open input file");
+	if U (got != want) {
+		resave_set_error(&ctx->err, "verification failed, output doesn't match the input");
 		return false;
 	}
-	if U (!outfile) {
-		perror("resave: failed to open output file");
-		fclose(infile);
+
+	return true;
+}
+
+bool resave_buf(struct resave_ctx *ctx,
+	const unsigned char *inbuf, size_t insize,
+	const unsigned char **outbuf, size_t *outsize,
+	const struct resave_opts *opts,
+	struct resave_result *result)
+{
+	jvirt_barray_ptr *src_coef_arrays;
+	jvirt_barray_ptr *half_coef_arrays = NULL;
+	int grayscale;
+	uint64_t want = 0;
+
+	*outbuf = NULL;
+	*outsize = 0;
+	if (result) {
+		memset(result, 0, sizeof(*result));
+		result->insize = insize;
+		result->outsize = insize;
+	}
+
+	ctx->err.msg[0] = '\0';
+	if U (setjmp(ctx->err.catch) != 0) {
+		jpeg_abort_compress(&ctx->dstinfo);
+		jpeg_abort_decompress(&ctx->srcinfo);
 		return false;
 	}
 
-	dstinfo.err = jpeg_std_error(&jerr);
-	srcinfo.err = jpeg_std_error(&jerr);
-	jerr.error_exit = resave_error_handler;
+	src_coef_arrays = resave_read_coefficients(&ctx->srcinfo, inbuf, insize, opts->halve, &half_coef_arrays);
 
-	dstinfo.client_data = &catch;
-	srcinfo.client_data = &catch;
-	if U (setjmp(catch) != 0) {
-		switch (state) {
-		case created_decompress_and_compress:
-			state = created_decompress_only;
-			jpeg_destroy_compress(&dstinfo);
-		case created_decompress_only:
-			state = state_init;
-			jpeg_destroy_decompress(&srcinfo);
-		case state_init:
-			break;
+	grayscale = resave_pick_grayscale(&ctx->srcinfo, src_coef_arrays, opts,
+	    opts->jcf != jcf_is_jcf(inbuf, insize), result);
+	if (grayscale == -1 ||
+	    resave_skip_by_estimate(&ctx->srcinfo, src_coef_arrays, opts, grayscale, insize, result)) {
+		jpeg_abort_decompress(&ctx->srcinfo);
+		return true;
+	}
+
+	// from here on, the halved image is what gets written
+	if (opts->halve) {
+		resave_halve(&ctx->srcinfo, src_coef_arrays, half_coef_arrays,
+		    (grayscale) ? 1 : ctx->srcinfo.num_components);
+		src_coef_arrays = half_coef_arrays;
+	}
+
+	if (opts->scan_search && !opts->jcf) {
+		if U (!resave_scan_search(&ctx->srcinfo, src_coef_arrays, opts, grayscale, &ctx->out, &ctx->err)) {
+			jpeg_abort_decompress(&ctx->srcinfo);
+			return false;
 		}
-		fclose(infile);
-		fclose(outfile);
+	} else {
+		resave_write(&ctx->srcinfo, &ctx->dstinfo, src_coef_arrays, opts, grayscale);
+	}
+
+	if (opts->verify && !opts->halve)
+		want = jhash_coefs(&ctx->srcinfo, src_coef_arrays, (grayscale) ? 1 : ctx->srcinfo.num_components);
+
+	jpeg_abort_decompress(&ctx->srcinfo);
+
+	if (opts->verify && !opts->halve && U (!resave_verify(ctx, want)))
+		return false;
+
+	*outbuf = ctx->out.buf;
+	*outsize = ctx->out.used;
+	if (result) {
+		result->outsize = ctx->out.used;
+		result->written = true;
+	}
+
+	return true;
+}
+
+static bool resave_read_file(struct resave_errmgr *err, const char *path,
+	unsigned char **buf, size_t *bufsize, size_t *size_out)
+{
+	struct stat st;
+	size_t got;
+	FILE *f;
+
+	if U (!(f = fopen(path, "r"))) {
+		resave_set_error(err, "%s: %s", path, strerror(errno));
+		return false;
+	}
+	if U (fstat(fileno(f), &st) == -1) {
+		resave_set_error(err, "%s: fstat: %s", path, strerror(errno));
+		fclose(f);
 		return false;
 	}
 
-	jpeg_create_decompress(&srcinfo);
-	state = created_decompress_only;
-	jpeg_stdio_src(&srcinfo, infile);
-	jpeg_read_header(&srcinfo, TRUE);
-	src_coef_arrays = jpeg_read_coefficients(&srcinfo);
+	if (*bufsize < (size_t)st.st_size) {
+		unsigned char *newbuf;
 
-	jpeg_create_compress(&dstinfo);
-	state = created_decompress_and_compress;
-	jpeg_stdio_dest(&dstinfo, outfile);
-	jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+		if U (!(newbuf = realloc(*buf, st.st_size))) {
+			resave_set_error(err, "out of memory");
+			fclose(f);
+			return false;
+		}
+		*buf = newbuf;
+		*bufsize = st.st_size;
+	}
 
-	dstinfo.optimize_coding = !!opts->optimize;
-	if (opts->grayscale) {
-		dstinfo.jpeg_color_space = JCS_GRAYSCALE;
-		dstinfo.num_components = 1;
-		dstinfo.max_h_samp_factor = 1;
-		dstinfo.max_v_samp_factor = 1;
-		dstinfo.comp_info[0].h_samp_factor = 1;
-		dstinfo.comp_info[0].v_samp_factor = 1;
+	got = fread(*buf, 1, st.st_size, f);
+	fclose(f);
+
+	if U (got != (size_t)st.st_size) {
+		resave_set_error(err, "%s: short read", path);
+		return false;
 	}
-	if (opts->progressive)
-		jpeg_simple_progression(&dstinfo);
 
-	jpeg_write_coefficients(&dstinfo, src_coef_arrays);
-	jpeg_finish_compress(&dstinfo);
-	jpeg_destroy_compress(&dstinfo);
-	state = created_decompress_only;
+	*size_out = got;
 
-	jpeg_destroy_decompress(&srcinfo);
-	state = state_init;
+	return true;
+}
 
-	fclose(infile);
-	fclose(outfile);
+// outpath.tmp in buf, which has room for strlen(outpath)+sizeof(TMPSUF)
+static char *resave_tmppath(char *buf, const char *outpath)
+{
+	size_t outpathlen = strlen(outpath);
+
+	memcpy(buf, outpath, outpathlen);
+	memcpy(buf+outpathlen, TMPSUF, sizeof(TMPSUF));
+
+	return buf;
+}
+
+// writes outpath.tmp, to be renamed over outpath with resave_rename_tmp()
+static bool resave_write_tmp(struct resave_errmgr *err, const char *outpath,
+	const unsigned char *buf, size_t size)
+{
+	char *tmpoutpath;
+	FILE *f;
+	bool ok;
+
+	tmpoutpath = resave_tmppath(alloca(strlen(outpath)+sizeof(TMPSUF)), outpath);
+
+	if U (!(f = fopen(tmpoutpath, "w"))) {
+		resave_set_error(err, "%s: %s", tmpoutpath, strerror(errno));
+		return false;
+	}
+
+	ok = (fwrite(buf, 1, size, f) == size);
+	ok &= (fclose(f) == 0);
+	if U (!ok) {
+		resave_set_error(err, "%s: write: %s", tmpoutpath, strerror(errno));
+		unlink(tmpoutpath);
+		return false;
+	}
+
+	return true;
+}
+
+static bool resave_rename_tmp(struct resave_errmgr *err, const char *outpath)
+{
+	char *tmpoutpath;
+
+	tmpoutpath = resave_tmppath(alloca(strlen(outpath)+sizeof(TMPSUF)), outpath);
 
 	if (rename(tmpoutpath, outpath) == -1) {
-		perror("resave: rename");
-		if (unlink(tmpoutpath) == -1)
-			perror("resave: unlink");
+		resave_set_error(err, "%s: rename: %s", outpath, strerror(errno));
+		unlink(tmpoutpath);
 		return false;
 	}
 
 	return true;
 }
 
+static void resave_unlink_tmp(const char *outpath)
+{
+	unlink(resave_tmppath(alloca(strlen(outpath)+sizeof(TMPSUF)), outpath));
+}
+
+// write to outpath.tmp and rename it over outpath
+static bool resave_write_file(struct resave_errmgr *err, const char *outpath,
+	const unsigned char *buf, size_t size)
+{
+	return resave_write_tmp(err, outpath, buf, size) &&
+	    resave_rename_tmp(err, outpath);
+}
+
+// a .jcf is mapped instead of read, the rest go in ctx->inbuf
+static const unsigned char *resave_read_input(struct resave_ctx *ctx, const char *path, size_t *size)
+{
+	const unsigned char *buf;
+
+	if (jcf_path(path)) {
+		if U (!(buf = jcf_map(path, size)))
+			resave_set_error(&ctx->err, "%s: %s", path, strerror(errno));
+		return buf;
+	}
+
+	if U (!resave_read_file(&ctx->err, path, &ctx->inbuf, &ctx->inbuf_size, size))
+		return NULL;
+
+	return ctx->inbuf;
+}
+
+static void resave_release_input(struct resave_ctx *ctx, const unsigned char *buf, size_t size)
+{
+	if (buf != ctx->inbuf)
+		jcf_unmap((void *)buf, size);
+}
+
+// a copy of opts for writing to path: .jcf paths are written as jcfs
+static struct resave_opts resave_opts_for(const struct resave_opts *opts, const char *path)
+{
+	struct resave_opts o = *opts;
+
+	o.jcf |= jcf_path(path);
+
+	return o;
+}
+
+// path-to-path resave using the context (the whole file is read into memory,
+// or mapped if it's a .jcf)
+bool resave_ctx_file(struct resave_ctx *ctx, const char *inpath, const char *outpath,
+	const struct resave_opts *opts,
+	struct resave_result *result)
+{
+	struct resave_opts o = resave_opts_for(opts, outpath);
+	const unsigned char *inbuf, *outbuf;
+	size_t insize, outsize;
+	bool ok;
+
+	if (result)
+		memset(result, 0, sizeof(*result));
+
+	ctx->err.msg[0] = '\0';
+	if U (!(inbuf = resave_read_input(ctx, inpath, &insize)))
+		return false;
+
+	ok = resave_buf(ctx, inbuf, insize, &outbuf, &outsize, &o, result);
+	resave_release_input(ctx, inbuf, insize);
+	if U (!ok)
+		return false;
+
+	if (!outbuf)
+		return true;
+
+	if U (!resave_write_file(&ctx->err, outpath, outbuf, outsize)) {
+		if (result)
+			result->written = false;
+		return false;
+	}
+
+	return true;
+}
+
+// the variants are encoded like the candidates of the scan search, each from
+// the same coefficient arrays with its own compressor
+bool resave_ctx_variants(struct resave_ctx *ctx,
+	const unsigned char *inbuf, size_t insize,
+	struct resave_variant *variants, size_t cnt)
+{
+	jvirt_barray_ptr *src_coef_arrays;
+	struct scan_candidate *cands;
+	struct resave_opts *opts;
+	bool ok = false;
+
+	for (size_t i = 0; i < cnt; i++) {
+		variants[i].outbuf = NULL;
+		variants[i].outsize = 0;
+	}
+
+	ctx->err.msg[0] = '\0';
+	if U (cnt == 0 || cnt > INT_MAX) {
+		resave_set_error(&ctx->err, "bad number of variants");
+		return false;
+	}
+
+	cands = calloc(cnt, sizeof(*cands));
+	opts = calloc(cnt, sizeof(*opts));
+	if U (!cands || !opts) {
+		resave_set_error(&ctx->err, "out of memory");
+		goto out;
+	}
+
+	if U (setjmp(ctx->err.catch) != 0) {
+		jpeg_abort_decompress(&ctx->srcinfo);
+		goto out;
+	}
+
+	src_coef_arrays = resave_read_coefficients(&ctx->srcinfo, inbuf, insize, false, NULL);
+
+	for (size_t i = 0; i < cnt; i++) {
+		struct scan_candidate *c = &cands[i];
+
+		opts[i].grayscale = variants[i].grayscale;
+		opts[i].optimize = variants[i].optimize;
+		opts[i].progressive = variants[i].progressive;
+		opts[i].jcf = (variants[i].outpath && jcf_path(variants[i].outpath));
+
+		c->srcinfo = &ctx->srcinfo;
+		c->src_coef_arrays = src_coef_arrays;
+		c->opts = &opts[i];
+		c->grayscale = opts[i].grayscale;
+		c->script = &scripts_color[0]; // libjpeg's default
+
+		resave_membuf_init(&c->out);
+	}
+
+	scan_candidates_run(cands, cnt);
+
+	jpeg_abort_decompress(&ctx->srcinfo);
+
+	for (size_t i = 0; i < cnt; i++) {
+		if U (!cands[i].ok) {
+			if (cands[i].err.msg[0])
+				resave_set_error(&ctx->err, "variant %zu: %s", i, cands[i].err.msg);
+			else
+				resave_set_error(&ctx->err, "out of memory");
+			goto out;
+		}
+	}
+
+	// every file is written before any of them is renamed into place, so
+	// that a failed write leaves all of them alone
+	for (size_t i = 0; i < cnt; i++) {
+		if (variants[i].outpath &&
+		    U (!resave_write_tmp(&ctx->err, variants[i].outpath, cands[i].out.buf, cands[i].out.used))) {
+			while (i-- > 0)
+				if (variants[i].outpath)
+					resave_unlink_tmp(variants[i].outpath);
+			goto out;
+		}
+	}
+	for (size_t i = 0; i < cnt; i++) {
+		if (variants[i].outpath &&
+		    U (!resave_rename_tmp(&ctx->err, variants[i].outpath))) {
+			while (++i < cnt)
+				if (variants[i].outpath)
+					resave_unlink_tmp(variants[i].outpath);
+			goto out;
+		}
+	}
+
+	for (size_t i = 0; i < cnt; i++) {
+		if (!variants[i].outpath) {
+			variants[i].outbuf = cands[i].out.buf;
+			variants[i].outsize = cands[i].out.used;
+			cands[i].out.buf = NULL;
+		}
+	}
+
+	ok = true;
+out:
+	if (cands)
+		for (size_t i = 0; i < cnt; i++)
+			free(cands[i].out.buf);
+	free(cands);
+	free(opts);
+
+	return ok;
+}
+
+const char *resave_ctx_error(struct resave_ctx *ctx)
+{
+	return ctx->err.msg;
+}
+
+// -----------------------------------------------------------------------------
+
+// the simple versions use a context kept per thread, freed when the thread exits
+
+static pthread_key_t resave_tls_key;
+static pthread_once_t resave_tls_once = PTHREAD_ONCE_INIT;
+static bool resave_tls_ok;
+
+static void resave_tls_destroy(void *ctx)
+{
+	resave_ctx_free(ctx);
+}
+
+static void resave_tls_init(void)
+{
+	resave_tls_ok = (pthread_key_create(&resave_tls_key, resave_tls_destroy) == 0);
+}
+
+static struct resave_ctx *resave_tls_ctx(void)
+{
+	struct resave_ctx *ctx;
+
+	pthread_once(&resave_tls_once, resave_tls_init);
+	if U (!resave_tls_ok)
+		return NULL;
+
+	if L ((ctx = pthread_getspecific(resave_tls_key)))
+		return ctx;
+
+	if U (!(ctx = resave_ctx_new()))
+		return NULL;
+	if U (pthread_setspecific(resave_tls_key, ctx) != 0) {
+		resave_ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+bool resave(const char *inpath, const char *outpath, const struct resave_opts *opts)
+{
+	return resave_ex(inpath, outpath, opts, NULL);
+}
+
+bool resave_ex(const char *inpath, const char *outpath,
+	const struct resave_opts *opts,
+	struct resave_result *result)
+{
+	struct resave_ctx *ctx;
+
+	if U (!(ctx = resave_tls_ctx())) {
+		if (result)
+			memset(result, 0, sizeof(*result));
+		return false;
+	}
+
+	return resave_ctx_file(ctx, inpath, outpath, opts, result);
+}
+
+bool resave_variants(const char *inpath, struct resave_variant *variants, size_t cnt)
+{
+	struct resave_ctx *ctx;
+	const unsigned char *inbuf;
+	size_t insize;
+	bool ok;
+
+	for (size_t i = 0; i < cnt; i++) {
+		variants[i].outbuf = NULL;
+		variants[i].outsize = 0;
+	}
+
+	if U (!(ctx = resave_tls_ctx()))
+		return false;
+
+	ctx->err.msg[0] = '\0';
+	if U (!(inbuf = resave_read_input(ctx, inpath, &insize)))
+		return false;
+
+	ok = resave_ctx_variants(ctx, inbuf, insize, variants, cnt);
+	resave_release_input(ctx, inbuf, insize);
+
+	return ok;
+}
+
+const char *resave_error(void)
+{
+	struct resave_ctx *ctx;
+
+	if U (!resave_tls_ok || !(ctx = pthread_getspecific(resave_tls_key)))
+		return "out of memory";
+
+	return ctx->err.msg;
+}
+
+// -----------------------------------------------------------------------------
+
+struct batch_state {
+	const struct resave_opts *opts;
+	struct bio *bio;
+	unsigned long long insize_total;
+	unsigned long long outsize_total;
+	unsigned files;
+	unsigned errors;
+};
+
+static void *batch_ctx_new(void *arg)
+{
+	return resave_ctx_new();
+}
+
+static void batch_ctx_free(void *ctx)
+{
+	resave_ctx_free(ctx);
+}
+
+static void batch_resave(void *ctx, struct batch_item *item, void *arg)
+{
+	struct batch_state *bs = arg;
+	struct resave_opts opts = resave_opts_for(bs->opts, item->path);
+	struct resave_result res;
+	unsigned char *inbuf;
+	const unsigned char *outbuf;
+	size_t insize, outsize;
+	bool ok;
+
+	// written in the background, write errors are counted by bio_finish()
+	// bio prints its own errors
+	ok = bio_read(bs->bio, item, &inbuf, &insize);
+	if L (ok) {
+		ok = resave_buf(ctx, inbuf, insize, &outbuf, &outsize, &opts, &res);
+		free(inbuf);
+		if U (!ok)
+			fprintf(stderr, "jresave: %s: %s\n", item->path, resave_ctx_error(ctx));
+	}
+	if L (ok && outbuf)
+		ok = bio_write(bs->bio, item->path, outbuf, outsize);
+	if U (!ok) {
+		__atomic_fetch_add(&bs->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (bs->opts->dryrun)
+		res.outsize = res.estimate;
+
+	__atomic_fetch_add(&bs->insize_total, res.insize, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bs->outsize_total, res.outsize, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bs->files, 1, __ATOMIC_RELAXED);
+
+	flockfile(stdout);
+	printf("%s\t%zu\t%zu\t%lld\n", item->path, res.insize, res.outsize,
+	    (long long)res.insize-(long long)res.outsize);
+	funlockfile(stdout);
+}
+
+static int batch_main(int argc, char **argv, const struct resave_opts *opts, int nthreads, bool list0)
+{
+	struct batch batch = {0};
+	struct batch_state bs = {
+		.opts = opts,
+	};
+	const struct batch_worker worker = {
+		.ctx_new = batch_ctx_new,
+		.ctx_free = batch_ctx_free,
+		.fn = batch_resave,
+		.arg = &bs,
+	};
+	bool ok = true;
+
+	for (int i = 0; i < argc; i++)
+		ok &= batch_add_path(&batch, argv[i]);
+	if (list0)
+		ok &= batch_add_list0(&batch, stdin);
+
+	batch_sort_by_size(&batch);
+
+	// -dryrun doesn't write anything but the read-ahead still helps
+	if U (!(bs.bio = bio_new(&batch, nthreads))) {
+		fprintf(stderr, "jresave: bio_new failed\n");
+		ok = false;
+	} else {
+		if (!batch_run(&batch, nthreads, &worker)) {
+			fprintf(stderr, "jresave: batch_run failed\n");
+			ok = false;
+		}
+		if (!bio_finish(bs.bio)) {
+			fprintf(stderr, "jresave: some files couldn't be written\n");
+			ok = false;
+		}
+		bio_free(bs.bio);
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "jresave: %u files, %llu -> %llu bytes (%s %lld)%s\n",
+	    bs.files, bs.insize_total, bs.outsize_total,
+	    (opts->dryrun) ? "would save about" : "saved",
+	    (long long)(bs.insize_total-bs.outsize_total),
+	    (bs.errors) ? ", some files failed" : "");
+
+	batch_free(&batch);
+
+	return (ok && bs.errors == 0) ? 0 : 1;
+}
+
 __attribute__((weak))
 int main(int argc, char **argv)
 {
@@ -133,13 +1503,49 @@ int main(int argc, char **argv)
 		.optimize = 0,
 		.progressive = 0,
 		.grayscale = 0,
+		.autogray = 0,
+		.scan_search = 0,
 	};
+	bool bflag = false;
+	bool list0 = false;
+	int nthreads = 0;
 
 	while (argc > 1) {
 		if (argv[1][0] != '-') break;
+		else if (strcmp(argv[1], "-b") == 0) bflag = true;
+		else if (strcmp(argv[1], "-0") == 0) list0 = true;
+		else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+			if ((nthreads = atoi(argv[2])) <= 0) {
+				fprintf(stderr, "jresave: bad thread count \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "-autogray") == 0) opts.autogray = 1;
 		else if (strcmp(argv[1], "-grayscale") == 0) opts.grayscale = 1;
 		else if (strcmp(argv[1], "-optimize") == 0) opts.optimize = 1;
 		else if (strcmp(argv[1], "-progressive") == 0) opts.progressive = 1;
+		else if (strcmp(argv[1], "-progressive-search") == 0) opts.scan_search = 1;
+		else if (strcmp(argv[1], "-dryrun") == 0) opts.dryrun = 1;
+		else if (strcmp(argv[1], "-verify") == 0) opts.verify = 1;
+		else if (strcmp(argv[1], "-halve") == 0) opts.halve = 1;
+		else if (strcmp(argv[1], "-threshold") == 0 && argc > 2) {
+			char *end;
+			unsigned long n = strtoul(argv[2], &end, 10);
+
+			if (end == argv[2] || (*end != '\0' && strcmp(end, "%") != 0) ||
+			    (*end == '%' && n > 100)) {
+				fprintf(stderr, "jresave: bad threshold \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			if (*end == '%')
+				opts.min_saving_pct = n;
+			else
+				opts.min_saving = n;
+			argc--;
+			argv++;
+		}
 		else {
 			fprintf(stderr, "jresave: unknown option \"%s\"\n", argv[1]);
 			goto usage;
@@ -148,20 +1554,70 @@ int main(int argc, char **argv)
 		argv++;
 	}
 
-	if (argc != 3) {
+	if ((opts.dryrun || opts.min_saving || opts.min_saving_pct) &&
+	    (!opts.optimize || opts.progressive || opts.scan_search)) {
+		fprintf(stderr, "jresave: -dryrun and -threshold only work with -optimize\n");
+		goto usage;
+	}
+
+	if (opts.halve && (bflag || opts.verify || opts.dryrun || opts.min_saving || opts.min_saving_pct)) {
+		fprintf(stderr, "jresave: -halve doesn't work with -b, -verify, -dryrun or -threshold\n");
+		goto usage;
+	}
+
+	if (bflag && (argc > 1 || list0))
+		return batch_main(argc-1, argv+1, &opts, nthreads, list0);
+
+	if (opts.dryrun && argc == 2 && !bflag) {
+		struct resave_result res;
+
+		if (!resave_ex(argv[1], argv[1], &opts, &res)) { // not written
+			fprintf(stderr, "jresave: %s\n", resave_error());
+			return 1;
+		}
+		printf("%s\t%zu\t%zu\t%lld\n", argv[1], res.insize, res.estimate,
+		    (long long)res.insize-(long long)res.estimate);
+		return 0;
+	}
+
+	if (argc != 3 || bflag) {
 usage:
 		fprintf(stderr,
 		    "usage: jresave [options] <infile> <outfile>\n"
+		    "       jresave -optimize -dryrun [options] <infile>\n"
+		    "       jresave -b [-j threads] [-0] [options] [path...]\n"
 		    "options:\n"
+		    "    -b            batch mode: resave files in place, biggest first, and\n"
+		    "                  print \"path<tab>old size<tab>new size<tab>saved\"\n"
+		    "    -j N          number of threads to use in batch mode (default: one per cpu)\n"
+		    "    -0            batch mode: read a NUL-separated list of paths from stdin\n"
+		    "    -autogray     drop color channels only if they're empty. other images\n"
+		    "                  are left alone unless -optimize/-progressive is given\n"
 		    "    -grayscale    drop color channels from the image\n"
 		    "    -optimize     save with optimized huffman tables\n"
 		    "    -progressive  save as progressive jpeg\n"
+		    "    -progressive-search\n"
+		    "                  save as progressive jpeg, trying several scan scripts\n"
+		    "                  in parallel and keeping the smallest\n"
+		    "    -threshold N  (with -optimize) estimate the output size first and leave\n"
+		    "                  the file alone if it wouldn't shrink by N bytes, or N%%\n"
+		    "                  of its size if given as a percentage\n"
+		    "    -dryrun       (with -optimize) only print the estimated sizes\n"
+		    "    -verify       read the coefficients back from the output and leave the\n"
+		    "                  original alone if they don't match\n"
+		    "    -halve        save at half the width and height (not lossless, averages\n"
+		    "                  2x2 pixel boxes without decoding the image)\n"
+		    "directories are searched recursively for .jpg and .jpeg files\n"
+		    ".jcf files are read and written as raw coefficients (no -optimize or\n"
+		    "-progressive, see jcf.h)\n"
 		    );
 		return 1;
 	}
 
-	if (!resave(argv[1], argv[2], &opts))
+	if (!resave(argv[1], argv[2], &opts)) {
+		fprintf(stderr, "jresave: %s\n", resave_error());
 		return 1;
+	}
 
 	return 0;
 }
@@ -1,11 +1,83 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct resave_opts {
 	bool grayscale;
 	bool optimize;
 	bool progressive;
+	bool autogray; // grayscale only if the color components are all zero
+	bool scan_search; // progressive, trying several scan scripts for the smallest output
+	// estimate the -optimize output size first and skip the rewrite if it
+	// wouldn't save at least this much (whichever is larger). sequential
+	// -optimize output only; ignored otherwise
+	size_t min_saving; // bytes
+	unsigned min_saving_pct; // percent of the input size
+	bool dryrun; // only estimate, never write
+	bool verify; // check the output's coefficients against the input before writing it
+	// half the width and height, averaging 2x2 boxes on the coefficients
+	// (not lossless, so verify is ignored and there's no estimate)
+	bool halve;
+	// write a .jcf (raw coefficients, see jcf.h) instead of a jpg. optimize,
+	// progressive and the estimate don't apply to it. jcf input is detected
+	// by itself
+	bool jcf;
 };
 
+struct resave_result {
+	bool grayscale; // (autogray) the color components were empty
+	bool written; // false if autogray or the estimate left the file alone
+	size_t insize;
+	size_t outsize; // same as insize if nothing was written
+	size_t estimate; // estimated output size, 0 if not estimated
+};
+
+// these use a context kept per thread, so they're safe to call from any thread
+// a .jcf outpath is written as a jcf, as if opts->jcf was set
 bool resave(const char *inpath, const char *outpath, const struct resave_opts *opts);
+bool resave_ex(const char *inpath, const char *outpath,
+	const struct resave_opts *opts,
+	struct resave_result *result);
+// why the last resave()/resave_ex() on this thread failed
+const char *resave_error(void);
+
+// one output of resave_variants()
+struct resave_variant {
+	const char *outpath; // NULL to keep the output in memory instead
+	bool grayscale;
+	bool optimize;
+	bool progressive;
+	// with outpath NULL, the output after a successful call. the caller frees
+	// it with free()
+	unsigned char *outbuf;
+	size_t outsize;
+};
+
+// decodes inpath once and encodes every variant from the same coefficients,
+// in parallel. if one fails, none of the files are written and no buffers are
+// returned: they're all written as outpath.tmp first and only renamed over
+// their outpaths when every write succeeded (a failed rename still leaves the
+// ones before it done). variants with a .jcf outpath are written as jcfs
+bool resave_variants(const char *inpath, struct resave_variant *variants, size_t cnt);
+
+// in-memory version that keeps the libjpeg objects and the output buffer
+// around between calls. one context per thread
+// *outbuf belongs to the context and is valid until the next call
+// if autogray or the estimate leaves the image alone, *outbuf is NULL
+struct resave_ctx *resave_ctx_new(void);
+bool resave_buf(struct resave_ctx *ctx,
+	const unsigned char *inbuf, size_t insize,
+	const unsigned char **outbuf, size_t *outsize,
+	const struct resave_opts *opts,
+	struct resave_result *result);
+bool resave_ctx_file(struct resave_ctx *ctx, const char *inpath, const char *outpath,
+	const struct resave_opts *opts,
+	struct resave_result *result);
+bool resave_ctx_variants(struct resave_ctx *ctx,
+	const unsigned char *inbuf, size_t insize,
+	struct resave_variant *variants, size_t cnt);
+void resave_ctx_free(struct resave_ctx *ctx);
+// why the last call with this context failed (libjpeg error, i/o error etc.)
+// warnings from a successful call may also be left here
+const char *resave_ctx_error(struct resave_ctx *ctx);
@@ -1,21 +1,23 @@
+#include "jcf.h"
+
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <jpeglib.h>
 
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
 #define round_up(a, b) (((a) + (b) - 1) - (((a) + (b) - 1) & ((b) - 1)))
 #define jdiv_round_up(a, b) (((a) + (b) - 1) / (b))
 
-static void jcopy_block_row(JBLOCKROW input_row, JBLOCKROW output_row, JDIMENSION num_blocks)
-{
-	memcpy(output_row, input_row, num_blocks*(DCTSIZE2*sizeof(JCOEF)));
-}
-
-__attribute__((unused))
 static int compare_dct(const void *p1, const void *p2)
 {
 	return memcmp(p1, p2, DCTSIZE2*sizeof(JCOEF));
@@ -31,25 +33,501 @@ static void error_handler(j_common_ptr cinfo)
 	exit(1);
 }
 
+// -----------------------------------------------------------------------------
+
+// blocks are sorted by a 64-bit key, ties are broken with compare_dct()
+
+static inline uint64_t key_memcmp(const JCOEF *b)
+{
+	uint64_t v;
+
+	// the first 8 bytes as a big-endian number sort the same as memcmp()
+	memcpy(&v, b, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+
+	return v;
+}
+
+static inline uint64_t key_dc(const JCOEF *b)
+{
+	return (uint16_t)(b[0]^0x8000);
+}
+
+static inline uint64_t key_energy(const JCOEF *b)
+{
+	uint64_t sum = 0;
+
+	for (int k = 0; k < DCTSIZE2; k++)
+		sum += (int32_t)b[k]*b[k];
+
+	return sum;
+}
+
+static inline uint64_t key_zeros(const JCOEF *b)
+{
+	uint64_t cnt = 0;
+
+	for (int k = 0; k < DCTSIZE2; k++)
+		cnt += (b[k] == 0);
+
+	return cnt;
+}
+
+static const struct sort_key {
+	const char *name;
+	uint64_t (*fn)(const JCOEF *b);
+} sort_keys[] = {
+	{"memcmp", key_memcmp},
+	{"dc", key_dc},
+	{"energy", key_energy},
+	{"zeros", key_zeros},
+};
+
+struct keyed {
+	uint64_t key;
+	uint32_t idx;
+};
+
+// lsd radix sort, 8 bits at a time. passes where every key has the same byte
+// are skipped, so narrow keys only cost a pass or two
+static bool radix_sort(struct keyed *a, size_t n)
+{
+	struct keyed *tmp, *src = a, *dst;
+	size_t counts[8][256] = {{0}};
+
+	if U (!(tmp = malloc(n*sizeof(*tmp))))
+		return false;
+	dst = tmp;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t key = a[i].key;
+
+		for (int p = 0; p < 8; p++)
+			counts[p][(key >> (p*8)) & 0xff]++;
+	}
+
+	for (int p = 0; p < 8; p++) {
+		size_t *c = counts[p];
+		size_t pos = 0;
+		struct keyed *swap;
+
+		if (c[(src[0].key >> (p*8)) & 0xff] == n)
+			continue;
+
+		for (int b = 0; b < 256; b++) {
+			size_t cnt = c[b];
+
+			c[b] = pos;
+			pos += cnt;
+		}
+		for (size_t i = 0; i < n; i++)
+			dst[c[(src[i].key >> (p*8)) & 0xff]++] = src[i];
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != a)
+		memcpy(a, src, n*sizeof(*a));
+	free(tmp);
+
+	return true;
+}
+
+// index -> block, for the tiebreak
+static JBLOCKROW *sort_rows;
+static JDIMENSION sort_width;
+
+#define block_at(rows, w, i) ((rows)[(i)/(w)][(i)%(w)])
+
+static int compare_keyed_tie(const void *p1, const void *p2)
+{
+	const struct keyed *a = p1, *b = p2;
+
+	return compare_dct(
+	    block_at(sort_rows, sort_width, a->idx),
+	    block_at(sort_rows, sort_width, b->idx));
+}
+
+// sorts the w*h blocks pointed to by rows in place
+static bool sort_blocks(JBLOCKROW *rows, JDIMENSION w, JDIMENSION h, const struct sort_key *sk)
+{
+	size_t n = (size_t)w*h;
+	struct keyed *keys;
+	JBLOCK tmp;
+
+	if (n < 2)
+		return true;
+	if U (!(keys = malloc(n*sizeof(*keys))))
+		return false;
+
+	for (size_t i = 0; i < n; i++) {
+		keys[i].key = sk->fn(block_at(rows, w, i));
+		keys[i].idx = i;
+	}
+
+	if U (!radix_sort(keys, n)) {
+		free(keys);
+		return false;
+	}
+
+	// runs of equal keys
+	sort_rows = rows;
+	sort_width = w;
+	for (size_t i = 0, j; i < n; i = j) {
+		for (j = i+1; j < n && keys[j].key == keys[i].key; j++)
+			;
+		if (j-i > 1)
+			qsort(&keys[i], j-i, sizeof(*keys), compare_keyed_tie);
+	}
+
+	// position k gets the block from keys[k].idx. follow each cycle of the
+	// permutation with one block of temporary storage, marking finished
+	// positions by pointing them at themselves
+	for (size_t k = 0; k < n; k++) {
+		size_t j = k;
+
+		if (keys[k].idx == k)
+			continue;
+
+		memcpy(tmp, block_at(rows, w, k), sizeof(JBLOCK));
+		while (keys[j].idx != k) {
+			size_t from = keys[j].idx;
+
+			memcpy(block_at(rows, w, j), block_at(rows, w, from), sizeof(JBLOCK));
+			keys[j].idx = j;
+			j = from;
+		}
+		memcpy(block_at(rows, w, j), tmp, sizeof(JBLOCK));
+		keys[j].idx = j;
+	}
+
+	free(keys);
+
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+// filters. per-block ones are run back to back on each block in a single pass
+// over the component, the others (sorting etc.) need all of the blocks and
+// split the chain into passes
+
+// coefficients outside this range can't be huffman coded (8-bit jpeg)
+#define COEF_MAX 1023
+
+static const unsigned char zigzag[DCTSIZE2] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+struct filter {
+	const struct filter_type *type;
+	long arg;
+	const struct sort_key *key; // sort
+	JCOEF mask[DCTSIZE2]; // zerohf
+};
+
+struct filter_type {
+	const char *name;
+	const char *help;
+	bool (*parse)(struct filter *f, const char *arg);
+	// one of these
+	void (*block)(JCOEF *restrict b, const struct filter *f);
+	bool (*global)(JBLOCKROW *rows, JDIMENSION w, JDIMENSION h, const struct filter *f);
+};
+
+static inline JCOEF clamp_coef(int v)
+{
+	return (v > COEF_MAX) ? COEF_MAX : (v < -COEF_MAX) ? -COEF_MAX : v;
+}
+
+static bool parse_long(struct filter *f, const char *arg, long def, long min, long max)
+{
+	char *end;
+
+	if (!arg) {
+		f->arg = def;
+		return true;
+	}
+	f->arg = strtol(arg, &end, 10);
+
+	return *arg != '\0' && *end == '\0' && f->arg >= min && f->arg <= max;
+}
+
+static bool parse_scale(struct filter *f, const char *arg)
+{
+	return parse_long(f, arg, 3, -COEF_MAX, COEF_MAX);
+}
+
+static void filter_scale(JCOEF *restrict b, const struct filter *f)
+{
+	int m = f->arg;
+
+	for (int k = 0; k < DCTSIZE2; k++)
+		b[k] = clamp_coef(b[k]*m);
+}
+
+static void filter_negate(JCOEF *restrict b, const struct filter *f)
+{
+	for (int k = 0; k < DCTSIZE2; k++)
+		b[k] = -b[k];
+}
+
+// keeps the first N coefficients in zigzag order
+static bool parse_zerohf(struct filter *f, const char *arg)
+{
+	if (!parse_long(f, arg, 10, 1, DCTSIZE2))
+		return false;
+	for (int k = 0; k < DCTSIZE2; k++)
+		f->mask[zigzag[k]] = (k < f->arg) ? -1 : 0;
+
+	return true;
+}
+
+static void filter_zerohf(JCOEF *restrict b, const struct filter *f)
+{
+	for (int k = 0; k < DCTSIZE2; k++)
+		b[k] &= f->mask[k];
+}
+
+static bool parse_quantize(struct filter *f, const char *arg)
+{
+	return parse_long(f, arg, 4, 1, COEF_MAX);
+}
+
+// rounds to the nearest multiple of N
+static void filter_quantize(JCOEF *restrict b, const struct filter *f)
+{
+	int q = f->arg;
+	int half = q/2;
+
+	for (int k = 0; k < DCTSIZE2; k++) {
+		int v = b[k];
+		int a = (v < 0) ? -v : v;
+
+		a = (a+half)/q*q;
+		b[k] = clamp_coef((v < 0) ? -a : a);
+	}
+}
+
+static const struct sort_key *default_key = &sort_keys[0];
+
+static bool parse_sort(struct filter *f, const char *arg)
+{
+	f->key = default_key;
+	if (!arg)
+		return true;
+
+	f->key = NULL;
+	for (size_t i = 0; i < sizeof(sort_keys)/sizeof(sort_keys[0]); i++)
+		if (strcmp(arg, sort_keys[i].name) == 0)
+			f->key = &sort_keys[i];
+
+	return f->key != NULL;
+}
+
+static bool filter_sort(JBLOCKROW *rows, JDIMENSION w, JDIMENSION h, const struct filter *f)
+{
+	return sort_blocks(rows, w, h, f->key);
+}
+
+// each block row sorted separately
+static bool filter_rowsort(JBLOCKROW *rows, JDIMENSION w, JDIMENSION h, const struct filter *f)
+{
+	for (JDIMENSION y = 0; y < h; y++)
+		if U (!sort_blocks(&rows[y], w, 1, f->key))
+			return false;
+
+	return true;
+}
+
+static bool parse_shuffle(struct filter *f, const char *arg)
+{
+	return parse_long(f, arg, 1, 0, LONG_MAX);
+}
+
+// fisher-yates with xorshift64*, the same seed gives the same result
+static bool filter_shuffle(JBLOCKROW *rows, JDIMENSION w, JDIMENSION h, const struct filter *f)
+{
+	uint64_t state = (uint64_t)f->arg*2+1;
+	size_t n = (size_t)w*h;
+	JBLOCK tmp;
+
+	for (size_t i = n; i > 1; i--) {
+		size_t j;
+
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		j = (state*0x2545F4914F6CDD1DULL >> 32)%i;
+
+		memcpy(tmp, block_at(rows, w, i-1), sizeof(JBLOCK));
+		memcpy(block_at(rows, w, i-1), block_at(rows, w, j), sizeof(JBLOCK));
+		memcpy(block_at(rows, w, j), tmp, sizeof(JBLOCK));
+	}
+
+	return true;
+}
+
+static const struct filter_type filter_types[] = {
+	{"scale", "scale[:N]      multiply by N (default 3)", parse_scale, filter_scale, NULL},
+	{"negate", "negate         flip the sign", NULL, filter_negate, NULL},
+	{"zerohf", "zerohf[:N]     keep only the first N coefficients in zigzag order (default 10)", parse_zerohf, filter_zerohf, NULL},
+	{"quantize", "quantize[:N]   round to multiples of N (default 4)", parse_quantize, filter_quantize, NULL},
+	{"sort", "sort[:key]     sort all blocks of the component", parse_sort, NULL, filter_sort},
+	{"rowsort", "rowsort[:key]  sort each row of blocks", parse_sort, NULL, filter_rowsort},
+	{"shuffle", "shuffle[:seed] shuffle all blocks of the component", parse_shuffle, NULL, filter_shuffle},
+};
+
+static bool filter_parse(struct filter *f, const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	size_t namelen = (colon) ? (size_t)(colon-spec) : strlen(spec);
+
+	memset(f, 0, sizeof(*f));
+
+	for (size_t i = 0; i < sizeof(filter_types)/sizeof(filter_types[0]); i++) {
+		const struct filter_type *t = &filter_types[i];
+
+		if (strlen(t->name) != namelen || memcmp(t->name, spec, namelen) != 0)
+			continue;
+		f->type = t;
+		if (!t->parse)
+			return !colon;
+		return t->parse(f, (colon) ? colon+1 : NULL);
+	}
+
+	return false;
+}
+
+static bool run_filters(JBLOCKROW *rows, JDIMENSION w, JDIMENSION h,
+	const struct filter *filters, int filters_cnt)
+{
+	for (int i = 0; i < filters_cnt; ) {
+		int j;
+
+		if (filters[i].type->global) {
+			if U (!filters[i].type->global(rows, w, h, &filters[i]))
+				return false;
+			i++;
+			continue;
+		}
+
+		// run of per-block filters
+		for (j = i; j < filters_cnt && filters[j].type->block; j++)
+			;
+		for (JDIMENSION y = 0; y < h; y++) {
+			for (JDIMENSION x = 0; x < w; x++) {
+				JCOEF *b = rows[y][x];
+
+				for (int k = i; k < j; k++)
+					filters[k].type->block(b, &filters[k]);
+			}
+		}
+		i = j;
+	}
+
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
 int main(int argc, char **argv)
 {
 	struct jpeg_decompress_struct srcinfo;
 	struct jpeg_compress_struct dstinfo;
 	struct jpeg_error_mgr jerr;
 	jvirt_barray_ptr *src_coef_arrays;
-	jvirt_barray_ptr *dst_coef_arrays;
-	FILE *infile, *outfile;
+	struct filter *filters = NULL;
+	int filters_cnt = 0;
+	FILE *infile = NULL, *outfile;
+	void *inmap = NULL;
+	size_t inmap_size = 0;
 	int ci;
 
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-k") == 0 && argc > 2) {
+			struct filter tmp;
+
+			if (!parse_sort(&tmp, argv[2])) {
+				fprintf(stderr, "jsort: unknown sort key \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			default_key = tmp.key;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-f") == 0 && argc > 2) {
+			struct filter *newfilters;
+
+			newfilters = reallocarray(filters, filters_cnt+1, sizeof(*filters));
+			if (!newfilters) {
+				fprintf(stderr, "jsort: out of memory\n");
+				return 1;
+			}
+			filters = newfilters;
+			if (!filter_parse(&filters[filters_cnt], argv[2])) {
+				fprintf(stderr, "jsort: bad filter \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			filters_cnt++;
+			argc--;
+			argv++;
+		} else {
+			fprintf(stderr, "jsort: unknown option \"%s\"\n", argv[1]);
+			goto usage;
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc != 3) {
-		fprintf(stderr, "usage: jsort <infile> <outfile>\n");
+usage:
+		fprintf(stderr,
+		    "usage: jsort [-k key] [-f filter[:arg]]... <infile> <outfile>\n"
+		    "options:\n"
+		    "    -k key     default key for sort and rowsort\n"
+		    "    -f filter  add a filter to the chain (default: sort)\n"
+		    "filters:\n");
+		for (size_t i = 0; i < sizeof(filter_types)/sizeof(filter_types[0]); i++)
+			fprintf(stderr, "    %s\n", filter_types[i].help);
+		fprintf(stderr,
+		    "sort keys:\n"
+		    "    memcmp  raw bytes of the coefficients (default)\n"
+		    "    dc      dc coefficient\n"
+		    "    energy  sum of squared coefficients\n"
+		    "    zeros   number of zero coefficients\n"
+		    "ties are broken by the raw bytes\n"
+		    ".jcf files are read and written as raw coefficients (see jcf.h)\n"
+		    );
 		return 1;
 	}
 
-	infile = fopen(argv[1], "r");
+	if (filters_cnt == 0) {
+		static struct filter sort_filter;
+
+		filter_parse(&sort_filter, "sort");
+		filters = &sort_filter;
+		filters_cnt = 1;
+	}
+
+	// a .jcf is filtered right in its (private) mapping
+	if (jcf_path(argv[1]))
+		inmap = jcf_map(argv[1], &inmap_size);
+	else
+		infile = fopen(argv[1], "r");
 	outfile = fopen(argv[2], "w");
 
-	if (!infile) {
+	if (!infile && !inmap) {
 		perror("failed to open input file");
 		return 1;
 	}
@@ -61,89 +539,61 @@ int main(int argc, char **argv)
 	dstinfo.err = jpeg_std_error(&jerr);
 	jerr.error_exit = error_handler;
 	jpeg_create_compress(&dstinfo);
+	jcf_hook((j_common_ptr)&dstinfo);
 	jpeg_stdio_dest(&dstinfo, outfile);
 	srcinfo.err = jpeg_std_error(&jerr);
 	jerr.error_exit = error_handler;
 	jpeg_create_decompress(&srcinfo);
-	jpeg_stdio_src(&srcinfo, infile);
-	jpeg_read_header(&srcinfo, /* require_image */ TRUE);
-	src_coef_arrays = jpeg_read_coefficients(&srcinfo);
-
-	dst_coef_arrays = dstinfo.mem->alloc_small(
-	    (j_common_ptr)&dstinfo,
-	    JPOOL_IMAGE,
-	    srcinfo.num_components*sizeof(jvirt_barray_ptr));
+	if (inmap) {
+		jcf_read_header(&srcinfo, inmap, inmap_size);
+		src_coef_arrays = jcf_read_coefficients(&srcinfo, inmap);
+	} else {
+		jpeg_stdio_src(&srcinfo, infile);
+		jpeg_read_header(&srcinfo, /* require_image */ TRUE);
+		src_coef_arrays = jpeg_read_coefficients(&srcinfo);
+	}
 
+	// filtered in place, the source arrays are written out as-is
 	for (ci = 0; ci < srcinfo.num_components; ci++) {
 		jpeg_component_info *comp = &srcinfo.comp_info[ci];
-		dst_coef_arrays[ci] = dstinfo.mem->request_virt_barray(
-		    (j_common_ptr)&dstinfo,
-		    /* pool_id */ JPOOL_IMAGE,
-		    /* pre_zero */ TRUE,
-		    /* blocksperrow */ comp->width_in_blocks*comp->h_samp_factor,
-		    /* numrows */ comp->height_in_blocks*comp->v_samp_factor,
-		    /* maxaccess */ comp->height_in_blocks*comp->v_samp_factor);
-	}
+		JBLOCKROW *rows;
 
-	jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
-
-	jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
+		if (!(rows = malloc(comp->height_in_blocks*sizeof(*rows)))) {
+			fprintf(stderr, "jsort: out of memory\n");
+			return 1;
+		}
 
-	for (ci = 0; ci < srcinfo.num_components; ci++) {
-		jpeg_component_info *comp;
-		JBLOCKARRAY dstrow, srcrow;
-
-		comp = &srcinfo.comp_info[ci];
-		dstrow = dstinfo.mem->access_virt_barray(
-		    (j_common_ptr)&dstinfo, dst_coef_arrays[ci],
-		    /* start_row */ 0,
-		    /* num_rows */ comp->height_in_blocks,
-		    /* writable */ TRUE);
-
-		for (int i = 0; i < comp->height_in_blocks; i++) {
-			srcrow = srcinfo.mem->access_virt_barray(
+		// libjpeg-turbo keeps whole-image arrays in memory (it has no
+		// backing store), so the row pointers stay valid. so do a jcf's
+		for (JDIMENSION i = 0; i < comp->height_in_blocks; i++) {
+			rows[i] = srcinfo.mem->access_virt_barray(
 			    (j_common_ptr)&srcinfo, src_coef_arrays[ci],
 			    /* start_row */ i,
 			    /* num_rows */ 1,
-			    /* writable */ FALSE);
-
-			jcopy_block_row(
-			    &srcrow[0][0],
-			    &dstrow[i][0],
-			    comp->width_in_blocks);
-
-//			for (int j = 0; j < comp->width_in_blocks; j++) {
-//				for (int k = 0; k < DCTSIZE2; k++)
-//					dstrow[i][j][k] *= 3;
-//			}
-
-//			qsort(
-//			    &dstrow[i][0],
-//			    comp->width_in_blocks,
-//			    DCTSIZE2*sizeof(JCOEF),
-//			    compare_dct);
+			    /* writable */ TRUE)[0];
 		}
 
-//		for (i = 0; i < comp->height_in_blocks; i++) {
-//			for (int j = 0; j < comp->width_in_blocks; j++) {
-//				for (int k = 0; k < DCTSIZE2; k++) {
-//					dstrow[i][j][k] *= -1;
-//				}
-//			}
-//		}
+		if (!run_filters(rows, comp->width_in_blocks, comp->height_in_blocks, filters, filters_cnt)) {
+			fprintf(stderr, "jsort: out of memory\n");
+			return 1;
+		}
 
-		qsort(
-		    &dstrow[0][0],
-		    (comp->width_in_blocks*
-		     comp->height_in_blocks)*comp->v_samp_factor,
-		    DCTSIZE2*sizeof(JCOEF),
-		    compare_dct);
+		free(rows);
 	}
 
-	jpeg_finish_compress(&dstinfo);
+	jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+
+	if (jcf_path(argv[2])) {
+		jcf_write_coefficients(&dstinfo, src_coef_arrays);
+	} else {
+		jpeg_write_coefficients(&dstinfo, src_coef_arrays);
+		jpeg_finish_compress(&dstinfo);
+	}
 	jpeg_destroy_compress(&dstinfo);
 	jpeg_destroy_decompress(&srcinfo);
-	fclose(infile);
+	if (infile)
+		fclose(infile);
+	jcf_unmap(inmap, inmap_size);
 	fclose(outfile);
 
 	return 0;
@@ -0,0 +1,826 @@
+#include "jthumb.h"
+#include "batch.h"
+#include "bio.h"
+#include "jcf.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// https://github.com/libjpeg-turbo/libjpeg-turbo/blob/c23672c/jutils.c#L75
+#define jdiv_round_up(a, b) (((a) + (b) - 1) / (b))
+
+// errors (and warnings) end up in msg instead of stderr
+struct thumb_errmgr {
+	struct jpeg_error_mgr pub; // must be the first member
+	jmp_buf catch;
+	char msg[JMSG_LENGTH_MAX];
+};
+
+__attribute__((cold))
+static void thumb_error_handler(j_common_ptr cinfo)
+{
+	struct thumb_errmgr *err = (struct thumb_errmgr *)cinfo->err;
+
+	cinfo->err->format_message(cinfo, err->msg);
+	longjmp(err->catch, 1);
+}
+
+static void thumb_output_message(j_common_ptr cinfo)
+{
+	struct thumb_errmgr *err = (struct thumb_errmgr *)cinfo->err;
+
+	cinfo->err->format_message(cinfo, err->msg);
+}
+
+static struct jpeg_error_mgr *thumb_errmgr_init(struct thumb_errmgr *err)
+{
+	jpeg_std_error(&err->pub);
+	err->pub.error_exit = thumb_error_handler;
+	err->pub.output_message = thumb_output_message;
+	err->msg[0] = '\0';
+
+	return &err->pub;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void thumb_set_error(struct thumb_errmgr *err, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(err->msg, sizeof(err->msg), fmt, ap);
+	va_end(ap);
+}
+
+// growable memory destination, reused for the next image
+
+struct thumb_membuf {
+	struct jpeg_destination_mgr pub; // must be the first member
+	unsigned char *buf;
+	size_t size;
+	size_t used;
+};
+
+#define THUMB_MEMBUF_INITIAL_SIZE (16*1024)
+
+static void thumb_membuf_init_destination(j_compress_ptr cinfo)
+{
+	struct thumb_membuf *mb = (struct thumb_membuf *)cinfo->dest;
+
+	mb->pub.next_output_byte = mb->buf;
+	mb->pub.free_in_buffer = mb->size;
+	mb->used = 0;
+}
+
+static boolean thumb_membuf_empty_output_buffer(j_compress_ptr cinfo)
+{
+	struct thumb_membuf *mb = (struct thumb_membuf *)cinfo->dest;
+	size_t newsize = mb->size*2;
+	unsigned char *newbuf;
+
+	// called with the buffer full (free_in_buffer is garbage here)
+	if U (!(newbuf = realloc(mb->buf, newsize)))
+		ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+
+	mb->pub.next_output_byte = newbuf+mb->size;
+	mb->pub.free_in_buffer = newsize-mb->size;
+	mb->buf = newbuf;
+	mb->size = newsize;
+
+	return TRUE;
+}
+
+static void thumb_membuf_term_destination(j_compress_ptr cinfo)
+{
+	struct thumb_membuf *mb = (struct thumb_membuf *)cinfo->dest;
+
+	mb->used = mb->size-mb->pub.free_in_buffer;
+}
+
+static bool thumb_membuf_init(struct thumb_membuf *mb)
+{
+	memset(mb, 0, sizeof(*mb));
+
+	if U (!(mb->buf = malloc(THUMB_MEMBUF_INITIAL_SIZE)))
+		return false;
+	mb->size = THUMB_MEMBUF_INITIAL_SIZE;
+
+	mb->pub.init_destination = thumb_membuf_init_destination;
+	mb->pub.empty_output_buffer = thumb_membuf_empty_output_buffer;
+	mb->pub.term_destination = thumb_membuf_term_destination;
+
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+struct thumb_ctx {
+	struct jpeg_decompress_struct srcinfo;
+	struct jpeg_compress_struct dstinfo;
+	struct thumb_errmgr err;
+
+	// interleaved output pixels, and a row of box sums for one component
+	unsigned char *pixels;
+	size_t pixels_size;
+	int32_t *acc;
+	size_t acc_cnt;
+
+	struct thumb_membuf out;
+};
+
+struct thumb_ctx *thumb_ctx_new(void)
+{
+	struct thumb_ctx *ctx;
+	volatile bool created_decompress = false;
+
+	if U (!(ctx = calloc(1, sizeof(*ctx))))
+		return NULL;
+
+	if U (!thumb_membuf_init(&ctx->out)) {
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->srcinfo.err = thumb_errmgr_init(&ctx->err);
+	ctx->dstinfo.err = &ctx->err.pub;
+
+	if U (setjmp(ctx->err.catch) != 0) {
+		if (created_decompress)
+			jpeg_destroy_decompress(&ctx->srcinfo);
+		free(ctx->out.buf);
+		free(ctx);
+		return NULL;
+	}
+	jpeg_create_decompress(&ctx->srcinfo);
+	created_decompress = true;
+	jpeg_create_compress(&ctx->dstinfo);
+
+	ctx->dstinfo.dest = &ctx->out.pub;
+
+	return ctx;
+}
+
+void thumb_ctx_free(struct thumb_ctx *ctx)
+{
+	if U (!ctx)
+		return;
+
+	jpeg_destroy_compress(&ctx->dstinfo);
+	jpeg_destroy_decompress(&ctx->srcinfo);
+
+	free(ctx->pixels);
+	free(ctx->acc);
+	free(ctx->out.buf);
+	free(ctx);
+}
+
+const char *thumb_ctx_error(struct thumb_ctx *ctx)
+{
+	return ctx->err.msg;
+}
+
+// -----------------------------------------------------------------------------
+
+// NULL if the image can be used
+static const char *thumb_check_supported(j_decompress_ptr srcinfo)
+{
+	switch (srcinfo->jpeg_color_space) {
+	case JCS_GRAYSCALE:
+		if U (srcinfo->num_components != 1)
+			return "unsupported number of components";
+		break;
+	case JCS_YCbCr:
+	case JCS_RGB:
+		if U (srcinfo->num_components != 3)
+			return "unsupported number of components";
+		break;
+	default:
+		return "unsupported color space";
+	}
+
+	// every block of a component has to cover a whole number of blocks of
+	// the full-resolution grid
+	for (int ci = 0; ci < srcinfo->num_components; ci++) {
+		jpeg_component_info *comp = &srcinfo->comp_info[ci];
+
+		if U (srcinfo->max_h_samp_factor % comp->h_samp_factor != 0 ||
+		      srcinfo->max_v_samp_factor % comp->v_samp_factor != 0)
+			return "unsupported sampling factors";
+		if U (!srcinfo->quant_tbl_ptrs[comp->quant_tbl_no])
+			return "missing quantization table";
+	}
+
+	return NULL;
+}
+
+// mean of cnt dc terms as a sample value. the dc term is 8 times the average
+// of the block's (level shifted) samples
+static inline unsigned char thumb_dc_to_sample(int64_t sum, int64_t cnt, int q)
+{
+	int64_t num = sum*q;
+	int64_t den = cnt*DCTSIZE;
+	int64_t v;
+
+	v = (num >= 0) ? (num + den/2)/den : -((-num + den/2)/den);
+	v += CENTERJSAMPLE;
+
+	return (v < 0) ? 0 : (v > MAXJSAMPLE) ? MAXJSAMPLE : v;
+}
+
+// one pixel per f*f blocks of the full-resolution grid. blocks of subsampled
+// components count once for each grid block they cover
+static void thumb_reduce(struct thumb_ctx *ctx, jvirt_barray_ptr *coef_arrays,
+	unsigned f, unsigned w, unsigned h)
+{
+	j_decompress_ptr srcinfo = &ctx->srcinfo;
+	int nc = srcinfo->num_components;
+	unsigned gridw = jdiv_round_up(srcinfo->image_width, DCTSIZE);
+	unsigned gridh = jdiv_round_up(srcinfo->image_height, DCTSIZE);
+
+	for (int ci = 0; ci < nc; ci++) {
+		jpeg_component_info *comp = &srcinfo->comp_info[ci];
+		unsigned rx = srcinfo->max_h_samp_factor/comp->h_samp_factor;
+		unsigned ry = srcinfo->max_v_samp_factor/comp->v_samp_factor;
+		int q = srcinfo->quant_tbl_ptrs[comp->quant_tbl_no]->quantval[0];
+
+		for (unsigned oy = 0; oy < h; oy++) {
+			unsigned y0 = oy*f;
+			unsigned y1 = MIN(y0+f, gridh);
+			unsigned char *out = ctx->pixels + (size_t)oy*w*nc + ci;
+
+			memset(ctx->acc, 0, w*sizeof(*ctx->acc));
+
+			for (unsigned gy = y0; gy < y1; gy++) {
+				JBLOCKARRAY blocks;
+				JBLOCKROW row;
+
+				blocks = srcinfo->mem->access_virt_barray(
+				    (j_common_ptr)srcinfo, coef_arrays[ci],
+				    /* start_row */ gy/ry,
+				    /* num_rows */ 1,
+				    /* writable */ FALSE);
+				row = blocks[0];
+
+				if (f == 1 && rx == 1) {
+					for (unsigned gx = 0; gx < gridw; gx++)
+						ctx->acc[gx] += row[gx][0];
+				} else {
+					for (unsigned gx = 0; gx < gridw; gx++)
+						ctx->acc[gx/f] += row[gx/rx][0];
+				}
+			}
+
+			for (unsigned ox = 0; ox < w; ox++) {
+				unsigned cnt = (MIN(ox*f+f, gridw)-ox*f)*(y1-y0);
+
+				out[(size_t)ox*nc] = thumb_dc_to_sample(ctx->acc[ox], cnt, q);
+			}
+		}
+	}
+}
+
+// jfif conversion (same constants as libjpeg's jdcolor.c)
+#define THUMB_FIX(x) ((int32_t)((x)*(1<<16) + 0.5))
+
+static void thumb_ycc_to_rgb(unsigned char *pixels, size_t cnt)
+{
+	for (size_t i = 0; i < cnt; i++) {
+		unsigned char *p = &pixels[i*3];
+		int32_t y = p[0] << 16;
+		int32_t cb = p[1]-CENTERJSAMPLE;
+		int32_t cr = p[2]-CENTERJSAMPLE;
+		int32_t r, g, b;
+
+		r = (y + THUMB_FIX(1.40200)*cr + (1<<15)) >> 16;
+		g = (y - THUMB_FIX(0.34414)*cb - THUMB_FIX(0.71414)*cr + (1<<15)) >> 16;
+		b = (y + THUMB_FIX(1.77200)*cb + (1<<15)) >> 16;
+
+		p[0] = (r < 0) ? 0 : (r > MAXJSAMPLE) ? MAXJSAMPLE : r;
+		p[1] = (g < 0) ? 0 : (g > MAXJSAMPLE) ? MAXJSAMPLE : g;
+		p[2] = (b < 0) ? 0 : (b > MAXJSAMPLE) ? MAXJSAMPLE : b;
+	}
+}
+
+static bool thumb_out_reserve(struct thumb_ctx *ctx, size_t size)
+{
+	unsigned char *newbuf;
+
+	if (ctx->out.size >= size)
+		return true;
+	if U (!(newbuf = realloc(ctx->out.buf, size)))
+		return false;
+	ctx->out.buf = newbuf;
+	ctx->out.size = size;
+
+	return true;
+}
+
+// the caller's setjmp catches errors
+static void thumb_write_jpeg(struct thumb_ctx *ctx, const struct thumb_opts *opts,
+	unsigned w, unsigned h)
+{
+	j_compress_ptr dstinfo = &ctx->dstinfo;
+	int nc = ctx->srcinfo.num_components;
+
+	dstinfo->image_width = w;
+	dstinfo->image_height = h;
+	dstinfo->input_components = nc;
+	dstinfo->in_color_space = ctx->srcinfo.jpeg_color_space;
+	jpeg_set_defaults(dstinfo);
+	jpeg_set_quality(dstinfo, (opts->quality) ? opts->quality : 75, TRUE);
+	dstinfo->optimize_coding = TRUE;
+
+	jpeg_start_compress(dstinfo, TRUE);
+	while (dstinfo->next_scanline < dstinfo->image_height) {
+		JSAMPROW row = ctx->pixels + (size_t)dstinfo->next_scanline*w*nc;
+
+		jpeg_write_scanlines(dstinfo, &row, 1);
+	}
+	jpeg_finish_compress(dstinfo);
+}
+
+bool thumb_buf(struct thumb_ctx *ctx,
+	const unsigned char *inbuf, size_t insize,
+	const unsigned char **outbuf, size_t *outsize,
+	const struct thumb_opts *opts,
+	struct thumb_result *result)
+{
+	j_decompress_ptr srcinfo = &ctx->srcinfo;
+	jvirt_barray_ptr *coef_arrays;
+	bool isjcf = jcf_is_jcf(inbuf, insize);
+	const char *reason;
+	unsigned f, w, h;
+	int nc;
+	size_t need;
+
+	*outbuf = NULL;
+	*outsize = 0;
+	if (result)
+		memset(result, 0, sizeof(*result));
+
+	switch (opts->scale) {
+	case 0:
+	case 8: f = 1; break;
+	case 16: f = 2; break;
+	case 32: f = 4; break;
+	default:
+		thumb_set_error(&ctx->err, "bad scale %u (should be 8, 16 or 32)", opts->scale);
+		return false;
+	}
+
+	ctx->err.msg[0] = '\0';
+	if U (setjmp(ctx->err.catch) != 0) {
+		jpeg_abort_compress(&ctx->dstinfo);
+		jpeg_abort_decompress(&ctx->srcinfo);
+		return false;
+	}
+
+	if (isjcf) {
+		jcf_read_header(srcinfo, inbuf, insize);
+	} else {
+		jpeg_mem_src(srcinfo, inbuf, insize);
+		jpeg_read_header(srcinfo, TRUE);
+	}
+
+	if U ((reason = thumb_check_supported(srcinfo))) {
+		thumb_set_error(&ctx->err, "%s", reason);
+		jpeg_abort_decompress(srcinfo);
+		return false;
+	}
+
+	// (a jcf's blocks are only read)
+	if (isjcf)
+		coef_arrays = jcf_read_coefficients(srcinfo, (void *)inbuf);
+	else
+		coef_arrays = jpeg_read_coefficients(srcinfo);
+
+	nc = srcinfo->num_components;
+	w = jdiv_round_up(srcinfo->image_width, DCTSIZE*f);
+	h = jdiv_round_up(srcinfo->image_height, DCTSIZE*f);
+
+	need = (size_t)w*h*nc;
+	if (ctx->pixels_size < need) {
+		unsigned char *newbuf;
+
+		if U (!(newbuf = realloc(ctx->pixels, need)))
+			goto oom;
+		ctx->pixels = newbuf;
+		ctx->pixels_size = need;
+	}
+	if (ctx->acc_cnt < w) {
+		int32_t *newacc;
+
+		if U (!(newacc = realloc(ctx->acc, w*sizeof(*newacc))))
+			goto oom;
+		ctx->acc = newacc;
+		ctx->acc_cnt = w;
+	}
+
+	thumb_reduce(ctx, coef_arrays, f, w, h);
+
+	if (opts->format == thumb_jpeg) {
+		// ycbcr goes in as is, without a round trip through rgb
+		thumb_write_jpeg(ctx, opts, w, h);
+	} else {
+		char hdr[64];
+		int hdrlen = 0;
+
+		if (srcinfo->jpeg_color_space == JCS_YCbCr)
+			thumb_ycc_to_rgb(ctx->pixels, (size_t)w*h);
+
+		if (opts->format == thumb_pnm)
+			hdrlen = snprintf(hdr, sizeof(hdr), "P%d\n%u %u\n%d\n",
+			    (nc == 1) ? 5 : 6, w, h, MAXJSAMPLE);
+
+		if U (!thumb_out_reserve(ctx, hdrlen+need))
+			goto oom;
+		memcpy(ctx->out.buf, hdr, hdrlen);
+		memcpy(ctx->out.buf+hdrlen, ctx->pixels, need);
+		ctx->out.used = hdrlen+need;
+	}
+
+	jpeg_abort_decompress(srcinfo);
+
+	*outbuf = ctx->out.buf;
+	*outsize = ctx->out.used;
+	if (result) {
+		result->width = w;
+		result->height = h;
+		result->components = nc;
+	}
+
+	return true;
+oom:
+	thumb_set_error(&ctx->err, "out of memory");
+	jpeg_abort_decompress(srcinfo);
+	return false;
+}
+
+static bool thumb_read_file(struct thumb_errmgr *err, const char *path,
+	unsigned char **buf, size_t *size)
+{
+	long len;
+	FILE *f;
+
+	*buf = NULL;
+	if U (!(f = fopen(path, "r"))) {
+		thumb_set_error(err, "%s: %s", path, strerror(errno));
+		return false;
+	}
+	if U (fseek(f, 0, SEEK_END) == -1 || (len = ftell(f)) < 0 ||
+	      fseek(f, 0, SEEK_SET) == -1) {
+		thumb_set_error(err, "%s: %s", path, strerror(errno));
+		fclose(f);
+		return false;
+	}
+	if U (!(*buf = malloc(len ? len : 1))) {
+		thumb_set_error(err, "out of memory");
+		fclose(f);
+		return false;
+	}
+	if U (fread(*buf, 1, len, f) != (size_t)len) {
+		thumb_set_error(err, "%s: short read", path);
+		free(*buf);
+		*buf = NULL;
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	*size = len;
+
+	return true;
+}
+
+bool thumb_ctx_file(struct thumb_ctx *ctx, const char *inpath, const char *outpath,
+	const struct thumb_opts *opts,
+	struct thumb_result *result)
+{
+	unsigned char *inbuf;
+	const unsigned char *outbuf;
+	size_t insize, outsize;
+	bool mapped = jcf_path(inpath);
+	FILE *f;
+	bool ok;
+
+	if (result)
+		memset(result, 0, sizeof(*result));
+
+	ctx->err.msg[0] = '\0';
+	if (mapped) {
+		if U (!(inbuf = jcf_map(inpath, &insize))) {
+			thumb_set_error(&ctx->err, "%s: %s", inpath, strerror(errno));
+			return false;
+		}
+	} else if U (!thumb_read_file(&ctx->err, inpath, &inbuf, &insize)) {
+		return false;
+	}
+
+	ok = thumb_buf(ctx, inbuf, insize, &outbuf, &outsize, opts, result);
+	if (mapped)
+		jcf_unmap(inbuf, insize);
+	else
+		free(inbuf);
+	if U (!ok)
+		return false;
+
+	if U (!(f = fopen(outpath, "w"))) {
+		thumb_set_error(&ctx->err, "%s: %s", outpath, strerror(errno));
+		return false;
+	}
+	ok = (fwrite(outbuf, 1, outsize, f) == outsize);
+	ok &= (fclose(f) == 0);
+	if U (!ok) {
+		thumb_set_error(&ctx->err, "%s: write: %s", outpath, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+// the simple versions use a context kept per thread, freed when the thread exits
+
+static pthread_key_t thumb_tls_key;
+static pthread_once_t thumb_tls_once = PTHREAD_ONCE_INIT;
+static bool thumb_tls_ok;
+
+static void thumb_tls_destroy(void *ctx)
+{
+	thumb_ctx_free(ctx);
+}
+
+static void thumb_tls_init(void)
+{
+	thumb_tls_ok = (pthread_key_create(&thumb_tls_key, thumb_tls_destroy) == 0);
+}
+
+static struct thumb_ctx *thumb_tls_ctx(void)
+{
+	struct thumb_ctx *ctx;
+
+	pthread_once(&thumb_tls_once, thumb_tls_init);
+	if U (!thumb_tls_ok)
+		return NULL;
+
+	if L ((ctx = pthread_getspecific(thumb_tls_key)))
+		return ctx;
+
+	if U (!(ctx = thumb_ctx_new()))
+		return NULL;
+	if U (pthread_setspecific(thumb_tls_key, ctx) != 0) {
+		thumb_ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+bool thumb(const char *inpath, const char *outpath, const struct thumb_opts *opts)
+{
+	struct thumb_ctx *ctx;
+
+	if U (!(ctx = thumb_tls_ctx()))
+		return false;
+
+	return thumb_ctx_file(ctx, inpath, outpath, opts, NULL);
+}
+
+const char *thumb_error(void)
+{
+	struct thumb_ctx *ctx;
+
+	if U (!thumb_tls_ok || !(ctx = pthread_getspecific(thumb_tls_key)))
+		return "out of memory";
+
+	return ctx->err.msg;
+}
+
+// -----------------------------------------------------------------------------
+
+struct batch_state {
+	const struct thumb_opts *opts;
+	const char *suffix;
+	struct bio *bio;
+	unsigned files;
+	unsigned errors;
+};
+
+static void *batch_ctx_new(void *arg)
+{
+	return thumb_ctx_new();
+}
+
+static void batch_ctx_free(void *ctx)
+{
+	thumb_ctx_free(ctx);
+}
+
+static void batch_thumb(void *ctx, struct batch_item *item, void *arg)
+{
+	struct batch_state *bs = arg;
+	size_t pathlen = strlen(item->path);
+	size_t suffixlen = strlen(bs->suffix);
+	unsigned char *inbuf;
+	const unsigned char *outbuf;
+	size_t insize, outsize;
+	char *outpath;
+	bool ok;
+
+	// thumbnails from an earlier run
+	if (pathlen >= suffixlen && strcmp(item->path+pathlen-suffixlen, bs->suffix) == 0) {
+		bio_skip(bs->bio, item);
+		return;
+	}
+
+	outpath = alloca(pathlen+suffixlen+1);
+	memcpy(outpath, item->path, pathlen);
+	memcpy(outpath+pathlen, bs->suffix, suffixlen+1);
+
+	// bio prints its own errors
+	ok = bio_read(bs->bio, item, &inbuf, &insize);
+	if L (ok) {
+		ok = thumb_buf(ctx, inbuf, insize, &outbuf, &outsize, bs->opts, NULL);
+		free(inbuf);
+		if U (!ok)
+			fprintf(stderr, "jthumb: %s: %s\n", item->path, thumb_ctx_error(ctx));
+	}
+	if L (ok)
+		ok = bio_write(bs->bio, outpath, outbuf, outsize);
+	if U (!ok) {
+		__atomic_fetch_add(&bs->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_fetch_add(&bs->files, 1, __ATOMIC_RELAXED);
+}
+
+static int batch_main(int argc, char **argv, const struct thumb_opts *opts,
+	const char *suffix, int nthreads, bool list0)
+{
+	struct batch batch = {0};
+	struct batch_state bs = {
+		.opts = opts,
+		.suffix = suffix,
+	};
+	const struct batch_worker worker = {
+		.ctx_new = batch_ctx_new,
+		.ctx_free = batch_ctx_free,
+		.fn = batch_thumb,
+		.arg = &bs,
+	};
+	bool ok = true;
+
+	for (int i = 0; i < argc; i++)
+		ok &= batch_add_path(&batch, argv[i]);
+	if (list0)
+		ok &= batch_add_list0(&batch, stdin);
+
+	batch_sort_by_size(&batch);
+
+	if U (!(bs.bio = bio_new(&batch, nthreads))) {
+		fprintf(stderr, "jthumb: bio_new failed\n");
+		ok = false;
+	} else {
+		if (!batch_run(&batch, nthreads, &worker)) {
+			fprintf(stderr, "jthumb: batch_run failed\n");
+			ok = false;
+		}
+		if (!bio_finish(bs.bio)) {
+			fprintf(stderr, "jthumb: some files couldn't be written\n");
+			ok = false;
+		}
+		bio_free(bs.bio);
+	}
+
+	fprintf(stderr, "jthumb: %u thumbnails%s\n", bs.files,
+	    (bs.errors) ? ", some files failed" : "");
+
+	batch_free(&batch);
+
+	return (ok && bs.errors == 0) ? 0 : 1;
+}
+
+__attribute__((weak))
+int main(int argc, char **argv)
+{
+	struct thumb_opts opts = {
+		.scale = 8,
+		.format = thumb_jpeg,
+	};
+	const char *suffix = NULL;
+	bool bflag = false;
+	bool list0 = false;
+	int nthreads = 0;
+	struct thumb_ctx *ctx;
+	struct thumb_result res;
+
+	while (argc > 1) {
+		if (argv[1][0] != '-') break;
+		else if (strcmp(argv[1], "-b") == 0) bflag = true;
+		else if (strcmp(argv[1], "-0") == 0) list0 = true;
+		else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+			if ((nthreads = atoi(argv[2])) <= 0) {
+				fprintf(stderr, "jthumb: bad thread count \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+			opts.scale = atoi(argv[2]);
+			if (opts.scale != 8 && opts.scale != 16 && opts.scale != 32) {
+				fprintf(stderr, "jthumb: bad scale \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "-q") == 0 && argc > 2) {
+			if ((opts.quality = atoi(argv[2])) <= 0 || opts.quality > 100) {
+				fprintf(stderr, "jthumb: bad quality \"%s\"\n", argv[2]);
+				goto usage;
+			}
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "-suffix") == 0 && argc > 2) {
+			suffix = argv[2];
+			argc--;
+			argv++;
+		}
+		else if (strcmp(argv[1], "-pnm") == 0) opts.format = thumb_pnm;
+		else if (strcmp(argv[1], "-raw") == 0) opts.format = thumb_raw;
+		else {
+			fprintf(stderr, "jthumb: unknown option \"%s\"\n", argv[1]);
+			goto usage;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (bflag && (argc > 1 || list0)) {
+		if (!suffix)
+			suffix = (opts.format == thumb_jpeg) ? ".thumb.jpg" :
+			    (opts.format == thumb_pnm) ? ".thumb.pnm" : ".thumb.raw";
+		if (!*suffix) {
+			fprintf(stderr, "jthumb: the suffix can't be empty\n");
+			goto usage;
+		}
+		return batch_main(argc-1, argv+1, &opts, suffix, nthreads, list0);
+	}
+
+	if (argc != 3 || bflag || suffix) {
+usage:
+		fprintf(stderr,
+		    "usage: jthumb [options] <infile> <outfile>\n"
+		    "       jthumb -b [-j threads] [-0] [-suffix S] [options] [path...]\n"
+		    "options:\n"
+		    "    -s N          scale down by 8 (the default), 16 or 32\n"
+		    "    -q N          quality of the output jpg (default: 75)\n"
+		    "    -pnm          write a pgm/ppm instead of a jpg\n"
+		    "    -raw          write only the pixels (gray or rgb, 8 bits each) and\n"
+		    "                  print \"width height components\"\n"
+		    "    -b            batch mode: write a thumbnail next to each file\n"
+		    "    -j N          number of threads to use in batch mode (default: one per cpu)\n"
+		    "    -0            batch mode: read a NUL-separated list of paths from stdin\n"
+		    "    -suffix S     batch mode: append S to the paths of the thumbnails\n"
+		    "                  (default: .thumb.jpg, .thumb.pnm or .thumb.raw). files\n"
+		    "                  that already end with it are skipped\n"
+		    "directories are searched recursively for .jpg and .jpeg files\n"
+		    ".jcf files (raw coefficients, see jcf.h) work as input too\n"
+		    );
+		return 1;
+	}
+
+	if (!(ctx = thumb_ctx_new())) {
+		fprintf(stderr, "jthumb: out of memory\n");
+		return 1;
+	}
+	if (!thumb_ctx_file(ctx, argv[1], argv[2], &opts, &res)) {
+		fprintf(stderr, "jthumb: %s\n", thumb_ctx_error(ctx));
+		thumb_ctx_free(ctx);
+		return 1;
+	}
+	thumb_ctx_free(ctx);
+
+	if (opts.format == thumb_raw)
+		printf("%u %u %d\n", res.width, res.height, res.components);
+
+	return 0;
+}
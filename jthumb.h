@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// small previews made from the DC coefficients of a jpg, without the IDCT or
+// upsampling of a full decode. at scale 8, every 8x8 block of the image
+// becomes one pixel. bigger scales average boxes of those
+
+enum thumb_format {
+	thumb_jpeg = 0, // baseline jpg (optimized huffman tables)
+	thumb_pnm = 1, // binary pgm/ppm
+	thumb_raw = 2, // the pixels only, rows top to bottom with no padding
+};
+
+struct thumb_opts {
+	unsigned scale; // 8, 16 or 32 (0 = 8)
+	enum thumb_format format;
+	int quality; // for thumb_jpeg (0 = 75)
+};
+
+struct thumb_result {
+	unsigned width;
+	unsigned height;
+	int components; // 1 (grayscale) or 3 (rgb, or ycbcr in a jpg)
+};
+
+// these use a context kept per thread, so they're safe to call from any thread
+bool thumb(const char *inpath, const char *outpath, const struct thumb_opts *opts);
+// why the last thumb() on this thread failed
+const char *thumb_error(void);
+
+// the libjpeg objects and buffers are kept in the context between calls
+// one context per thread
+// *outbuf belongs to the context and is valid until the next call
+// the input can also be a jcf (see jcf.h). .jcf files are mapped, not read
+struct thumb_ctx *thumb_ctx_new(void);
+bool thumb_buf(struct thumb_ctx *ctx,
+	const unsigned char *inbuf, size_t insize,
+	const unsigned char **outbuf, size_t *outsize,
+	const struct thumb_opts *opts,
+	struct thumb_result *result);
+bool thumb_ctx_file(struct thumb_ctx *ctx, const char *inpath, const char *outpath,
+	const struct thumb_opts *opts,
+	struct thumb_result *result);
+void thumb_ctx_free(struct thumb_ctx *ctx);
+// why the last call with this context failed
+const char *thumb_ctx_error(struct thumb_ctx *ctx);
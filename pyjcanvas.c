@@ -0,0 +1,435 @@
+// python bindings for jcanvas
+// build with "make pyjcanvas", then:
+//
+//   import pyjcanvas
+//   c = pyjcanvas.Canvas()           # or Canvas(w, h), Canvas(path="out.jpg")
+//   idx = c.add_image(data)          # bytes-like (not copied) or a path
+//   c.drawimage(idx, 0, 0, 16, 16, 32, 32)
+//   c.drawimages(idx, ops)           # int32 array of [dx, dy, sx, sy, w, h] rows
+//   out = c.save()                   # memoryview of the new jpg
+//
+// the gil is released while images are read, drawn and saved, so different
+// canvases can be worked on from different threads at once
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jcanvas.h"
+
+#define U(x) (__builtin_expect(!!(x), 0))
+#define L(x) (__builtin_expect(!!(x), 1))
+
+static PyObject *JcanvasError;
+
+// -----------------------------------------------------------------------------
+
+// owns the output of jc_take_output()
+typedef struct {
+	PyObject_HEAD
+	unsigned char *buf;
+	size_t size;
+} OutputObject;
+
+static int Output_getbuffer(OutputObject *self, Py_buffer *view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject *)self, self->buf, self->size, 1, flags);
+}
+
+static void Output_dealloc(OutputObject *self)
+{
+	free(self->buf);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyBufferProcs Output_as_buffer = {
+	.bf_getbuffer = (getbufferproc)Output_getbuffer,
+};
+
+static PyTypeObject OutputType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "pyjcanvas._Output",
+	.tp_basicsize = sizeof(OutputObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor)Output_dealloc,
+	.tp_as_buffer = &Output_as_buffer,
+};
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+	PyObject_HEAD
+	struct jc *jc; // NULL after saving
+	bool mem; // output goes to memory
+	bool busy; // being used by a thread that released the gil
+	// buffers of images added from memory, held until the canvas is done
+	Py_buffer *bufs;
+	size_t bufs_cnt;
+} CanvasObject;
+
+// call with the gil held. a canvas is one thread at a time
+static bool Canvas_enter(CanvasObject *self)
+{
+	if U (!self->jc) {
+		PyErr_SetString(JcanvasError, "canvas has already been saved");
+		return false;
+	}
+	if U (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "canvas is being used by another thread");
+		return false;
+	}
+	self->busy = true;
+	return true;
+}
+
+static void Canvas_leave(CanvasObject *self)
+{
+	self->busy = false;
+}
+
+static void Canvas_release(CanvasObject *self)
+{
+	jc_free(self->jc);
+	self->jc = NULL;
+
+	for (size_t i = 0; i < self->bufs_cnt; i++)
+		PyBuffer_Release(&self->bufs[i]);
+	PyMem_Free(self->bufs);
+	self->bufs = NULL;
+	self->bufs_cnt = 0;
+}
+
+static void Canvas_dealloc(CanvasObject *self)
+{
+	Canvas_release(self);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Canvas_init(CanvasObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"width", "height", "path", "memory_budget", NULL};
+	int w = -1, h = -1;
+	PyObject *path = NULL;
+	Py_ssize_t budget = 0;
+	struct jc *jc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiO&n", kwlist,
+	    &w, &h, PyUnicode_FSConverter, &path, &budget))
+		return -1;
+
+	if U (budget < 0) {
+		PyErr_SetString(PyExc_ValueError, "memory_budget can't be negative");
+		Py_XDECREF(path);
+		return -1;
+	}
+	// (__init__ called again from another thread)
+	if U (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "canvas is being used by another thread");
+		Py_XDECREF(path);
+		return -1;
+	}
+
+	if (path)
+		jc = jc_new(PyBytes_AS_STRING(path), w, h);
+	else
+		jc = jc_new_mem(w, h);
+
+	if U (!jc) {
+		if (path)
+			PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+		else
+			PyErr_NoMemory();
+		Py_XDECREF(path);
+		return -1;
+	}
+
+	if (budget)
+		jc_set_memory_budget(jc, budget);
+
+	Canvas_release(self); // (__init__ called twice)
+	self->jc = jc;
+	self->mem = (path == NULL);
+
+	Py_XDECREF(path);
+
+	return 0;
+}
+
+static PyObject *Canvas_add_image(CanvasObject *self, PyObject *arg)
+{
+	Py_buffer view;
+	PyObject *path = NULL;
+	Py_buffer *newbufs;
+	int idx;
+
+	if (PyObject_CheckBuffer(arg)) {
+		if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) == -1)
+			return NULL;
+		newbufs = PyMem_Realloc(self->bufs, (self->bufs_cnt+1)*sizeof(*self->bufs));
+		if U (!newbufs) {
+			PyBuffer_Release(&view);
+			return PyErr_NoMemory();
+		}
+		self->bufs = newbufs;
+	} else if (!PyUnicode_FSConverter(arg, &path)) {
+		return NULL;
+	}
+
+	if U (!Canvas_enter(self)) {
+		if (path)
+			Py_DECREF(path);
+		else
+			PyBuffer_Release(&view);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (path)
+		idx = jc_add_image(self->jc, PyBytes_AS_STRING(path));
+	else
+		idx = jc_add_image_mem(self->jc, view.buf, view.len);
+	Py_END_ALLOW_THREADS
+
+	Canvas_leave(self);
+
+	if (path) {
+		Py_DECREF(path);
+	} else {
+		// the canvas may read it again when saving
+		if (idx != -1)
+			self->bufs[self->bufs_cnt++] = view;
+		else
+			PyBuffer_Release(&view);
+	}
+
+	if U (idx == -1) {
+		PyErr_SetString(JcanvasError, jc_get_error(self->jc));
+		return NULL;
+	}
+
+	return PyLong_FromLong(idx);
+}
+
+static PyObject *Canvas_get_info(CanvasObject *self, PyObject *args)
+{
+	struct jc_info_struct info;
+	int idx = JC_SELF;
+
+	if (!PyArg_ParseTuple(args, "|i", &idx))
+		return NULL;
+	if U (!Canvas_enter(self))
+		return NULL;
+
+	if U (!jc_get_info(self->jc, idx, &info)) {
+		Canvas_leave(self);
+		PyErr_SetString(JcanvasError, jc_get_error(self->jc));
+		return NULL;
+	}
+	Canvas_leave(self);
+
+	return Py_BuildValue("{s:I, s:I, s:I, s:I, s:H, s:H}",
+	    "width", info.width,
+	    "height", info.height,
+	    "data_width", info.data_width,
+	    "data_height", info.data_height,
+	    "block_width", info.block_width,
+	    "block_height", info.block_height);
+}
+
+static PyObject *Canvas_drawimage(CanvasObject *self, PyObject *args)
+{
+	int idx;
+	unsigned dx, dy, sx = 0, sy = 0;
+	int w = -1, h = -1;
+	bool ok;
+
+	if (!PyArg_ParseTuple(args, "iII|IIii", &idx, &dx, &dy, &sx, &sy, &w, &h))
+		return NULL;
+	if U (!Canvas_enter(self))
+		return NULL;
+
+	// (only touches the block map, not worth releasing the gil for)
+	ok = jc_drawimage(self->jc, idx, dx, dy, sx, sy, w, h);
+	Canvas_leave(self);
+
+	if U (!ok) {
+		PyErr_SetString(JcanvasError, jc_get_error(self->jc));
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+// is the buffer native-endian 32-bit ints (numpy.int32, array('i'), ...)
+static bool is_int32_format(const Py_buffer *view)
+{
+	const char *f = (view->format) ? view->format : "B";
+
+	if (view->itemsize != 4)
+		return false;
+	if (*f == '@' || *f == '=')
+		f++;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	else if (*f == '<')
+		f++;
+#else
+	else if (*f == '>' || *f == '!')
+		f++;
+#endif
+
+	return ((f[0] == 'i' || f[0] == 'l') && f[1] == '\0');
+}
+
+static PyObject *Canvas_drawimages(CanvasObject *self, PyObject *args)
+{
+	int idx;
+	PyObject *obj;
+	Py_buffer view;
+	const int32_t *ops;
+	size_t cnt, i;
+	bool ok = true;
+
+	if (!PyArg_ParseTuple(args, "iO", &idx, &obj))
+		return NULL;
+	if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS|PyBUF_FORMAT) == -1)
+		return NULL;
+
+	if U (!is_int32_format(&view) || view.len%(6*4) != 0 ||
+	      (view.ndim == 2 && view.shape[1] != 6) || view.ndim > 2) {
+		PyErr_SetString(PyExc_ValueError, "ops should be an (n, 6) array of int32");
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+	if U (!Canvas_enter(self)) {
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+
+	ops = view.buf;
+	cnt = view.len/(6*4);
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < cnt; i++) {
+		const int32_t *op = &ops[i*6];
+
+		if U (!(ok = jc_drawimage(self->jc, idx, op[0], op[1], op[2], op[3], op[4], op[5])))
+			break;
+	}
+	Py_END_ALLOW_THREADS
+
+	Canvas_leave(self);
+	PyBuffer_Release(&view);
+
+	if U (!ok) {
+		PyErr_Format(JcanvasError, "ops[%zu]: %s", i, jc_get_error(self->jc));
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+// saves and frees the canvas. returns the output for in-memory canvases
+static PyObject *Canvas_save(CanvasObject *self, PyObject *noargs)
+{
+	OutputObject *out;
+	PyObject *rv;
+	bool ok;
+
+	if U (!Canvas_enter(self))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = jc_save(self->jc);
+	Py_END_ALLOW_THREADS
+
+	Canvas_leave(self);
+
+	if U (!ok) {
+		PyErr_SetString(JcanvasError, jc_get_error(self->jc));
+		Canvas_release(self);
+		return NULL;
+	}
+
+	if (!self->mem) {
+		Canvas_release(self);
+		Py_RETURN_NONE;
+	}
+
+	if U (!(out = PyObject_New(OutputObject, &OutputType))) {
+		Canvas_release(self);
+		return NULL;
+	}
+	out->buf = jc_take_output(self->jc, &out->size);
+	Canvas_release(self);
+
+	rv = PyMemoryView_FromObject((PyObject *)out);
+	Py_DECREF(out);
+
+	return rv;
+}
+
+static PyMethodDef Canvas_methods[] = {
+	{"add_image", (PyCFunction)Canvas_add_image, METH_O,
+	 "add_image(data_or_path) -> index\n"
+	 "bytes-like objects aren't copied and are kept until the canvas is saved"},
+	{"get_info", (PyCFunction)Canvas_get_info, METH_VARARGS,
+	 "get_info(index=SELF) -> dict"},
+	{"drawimage", (PyCFunction)Canvas_drawimage, METH_VARARGS,
+	 "drawimage(index, dest_x, dest_y, src_x=0, src_y=0, width=-1, height=-1)"},
+	{"drawimages", (PyCFunction)Canvas_drawimages, METH_VARARGS,
+	 "drawimages(index, ops)\n"
+	 "ops is an (n, 6) int32 array of [dest_x, dest_y, src_x, src_y, width, height]"},
+	{"save", (PyCFunction)Canvas_save, METH_NOARGS,
+	 "save() -> memoryview, or None if the canvas was made with a path\n"
+	 "the canvas can't be used after this"},
+	{NULL}
+};
+
+static PyTypeObject CanvasType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "pyjcanvas.Canvas",
+	.tp_doc = "Canvas(width=-1, height=-1, path=None, memory_budget=0)\n"
+	    "lossless drawImage() for jpgs. -1 takes the size from the first image",
+	.tp_basicsize = sizeof(CanvasObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)Canvas_init,
+	.tp_dealloc = (destructor)Canvas_dealloc,
+	.tp_methods = Canvas_methods,
+};
+
+// -----------------------------------------------------------------------------
+
+static struct PyModuleDef pyjcanvas_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "pyjcanvas",
+	.m_doc = "lossless drawImage() for jpgs",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_pyjcanvas(void)
+{
+	PyObject *m;
+
+	if (PyType_Ready(&OutputType) < 0 || PyType_Ready(&CanvasType) < 0)
+		return NULL;
+	if (!(m = PyModule_Create(&pyjcanvas_module)))
+		return NULL;
+
+	JcanvasError = PyErr_NewException("pyjcanvas.error", NULL, NULL);
+	Py_XINCREF(JcanvasError);
+	Py_INCREF(&CanvasType);
+	if (PyModule_AddObject(m, "error", JcanvasError) < 0 ||
+	    PyModule_AddObject(m, "Canvas", (PyObject *)&CanvasType) < 0 ||
+	    PyModule_AddIntConstant(m, "SELF", JC_SELF) < 0 ||
+	    PyModule_AddIntConstant(m, "BLANK", JC_BLANK) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	return m;
+}
@@ -9,22 +9,204 @@
 #include <jansson.h>
 
 #include "jcanvas.h"
+#include "jhash.h"
 
-static unsigned rflag, zeroflag, strict;
+static unsigned rflag, zeroflag, strict, verify;
 static int width = -1, height = -1;
+static const char *mapout, *mapin;
 
 #define sscanf2_full(s, fmt, p1, p2) \
 	({ int n_; (sscanf((s), (fmt "%n"), (p1), (p2), &n_) == 2 && (s)[n_] == '\0'); })
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// block maps, in units of the block size (see jc_get_map)
+struct map {
+	unsigned w;
+	unsigned h;
+	struct jc_map_entry *e;
+};
+
+static bool map_alloc(struct map *m, unsigned w, unsigned h)
+{
+	m->w = w;
+	m->h = h;
+	if (!(m->e = malloc((size_t)w*h*sizeof(*m->e) + 1)))
+		return false;
+	for (size_t i = 0; i < (size_t)w*h; i++)
+		m->e[i] = (struct jc_map_entry){ .img = -1 };
+
+	return true;
+}
+
+// the same thing as jc_drawimage(), on a map of the canvas the op list was
+// made for. src_w/src_h is the size of the image it was drawing from
+static bool map_drawimage(struct map *m, unsigned src_w, unsigned src_h,
+	const struct jc_info_struct *info, const int nums[6], int idx)
+{
+	unsigned bw = info->block_width, bh = info->block_height;
+	int dx = nums[0], dy = nums[1], sx = nums[2], sy = nums[3], w = nums[4], h = nums[5];
+
+	if (dx < 0 || dy < 0 || sx < 0 || sy < 0 ||
+	    dx%bw || dy%bh || sx%bw || sy%bh)
+		return false;
+	dx /= bw; dy /= bh; sx /= bw; sy /= bh;
+	if (dx > m->w || dy > m->h || sx > src_w || sy > src_h)
+		return false;
+
+	if (w == -1)
+		w = MIN(src_w-sx, m->w-dx)*bw;
+	if (h == -1)
+		h = MIN(src_h-sy, m->h-dy)*bh;
+	if (w <= 0 || h <= 0 || w%bw || h%bh)
+		return false;
+	w /= bw; h /= bh;
+	if (w > src_w-sx || w > m->w-dx || h > src_h-sy || h > m->h-dy)
+		return false;
+
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+			m->e[(size_t)(dy+y)*m->w + dx+x] = (struct jc_map_entry){ idx, sx+x, sy+y };
+
+	return true;
+}
+
+// where each unit of the original went in m. units that m doesn't use are
+// left as -1
+static bool map_invert(const struct map *m, struct map *inv, unsigned w, unsigned h)
+{
+	if (!map_alloc(inv, w, h))
+		return false;
+
+	for (unsigned y = 0; y < m->h; y++) {
+		for (unsigned x = 0; x < m->w; x++) {
+			const struct jc_map_entry *e = &m->e[(size_t)y*m->w + x];
+			struct jc_map_entry *ie;
+
+			if (e->img < 0)
+				continue;
+			if (e->src_x < 0 || e->src_y < 0 || e->src_x >= w || e->src_y >= h) {
+				fprintf(stderr, "scramble: map refers to parts outside the output image\n");
+				free(inv->e);
+				return false;
+			}
+			ie = &inv->e[(size_t)e->src_y*w + e->src_x];
+			if (ie->img == -1)
+				*ie = (struct jc_map_entry){ e->img, x, y };
+		}
+	}
+
+	return true;
+}
+
+// {"block_width": .., "block_height": .., "width": .., "height": ..,
+//  "map": [src_x, src_y, ...]} with -1, -1 for units not drawn from the image
+static bool map_save(const struct map *m, const struct jc_info_struct *info, const char *path)
+{
+	json_t *root, *arr;
+	bool ok;
+
+	root = json_object();
+	arr = json_array();
+	json_object_set_new(root, "block_width", json_integer(info->block_width));
+	json_object_set_new(root, "block_height", json_integer(info->block_height));
+	json_object_set_new(root, "width", json_integer(m->w));
+	json_object_set_new(root, "height", json_integer(m->h));
+	for (size_t i = 0; i < (size_t)m->w*m->h; i++) {
+		bool drawn = (m->e[i].img >= 0);
+
+		json_array_append_new(arr, json_integer((drawn) ? m->e[i].src_x : -1));
+		json_array_append_new(arr, json_integer((drawn) ? m->e[i].src_y : -1));
+	}
+	json_object_set_new(root, "map", arr);
+
+	ok = (json_dump_file(root, path, JSON_COMPACT) == 0);
+	if (!ok)
+		fprintf(stderr, "scramble: %s: couldn't write the map\n", path);
+	json_decref(root);
+
+	return ok;
+}
+
+static bool map_load(struct map *m, const struct jc_info_struct *info, const char *path, int idx)
+{
+	json_error_t jsonerr;
+	json_t *root, *arr;
+	json_int_t w, h;
+
+	if (!(root = json_load_file(path, 0, &jsonerr))) {
+		fprintf(stderr, "scramble: %s: json parse error: %s\n", path, jsonerr.text);
+		return false;
+	}
+
+	arr = json_object_get(root, "map");
+	w = json_integer_value(json_object_get(root, "width"));
+	h = json_integer_value(json_object_get(root, "height"));
+
+	if (!json_is_array(arr) || w <= 0 || h <= 0 ||
+	    json_array_size(arr) != (size_t)w*h*2) {
+		fprintf(stderr, "scramble: %s: bad map\n", path);
+		goto err;
+	}
+	if (json_integer_value(json_object_get(root, "block_width")) != info->block_width ||
+	    json_integer_value(json_object_get(root, "block_height")) != info->block_height) {
+		fprintf(stderr, "scramble: %s: map was made for a different block size\n", path);
+		goto err;
+	}
+
+	if (!map_alloc(m, w, h)) {
+		fprintf(stderr, "scramble: out of memory\n");
+		goto err;
+	}
+	for (size_t i = 0; i < (size_t)w*h; i++) {
+		json_t *jx = json_array_get(arr, i*2);
+		json_t *jy = json_array_get(arr, i*2+1);
+
+		if (!json_is_integer(jx) || !json_is_integer(jy)) {
+			fprintf(stderr, "scramble: %s: bad map\n", path);
+			free(m->e);
+			goto err;
+		}
+		if (json_integer_value(jx) >= 0)
+			m->e[i] = (struct jc_map_entry){ idx, json_integer_value(jx), json_integer_value(jy) };
+	}
+
+	json_decref(root);
+	return true;
+err:
+	json_decref(root);
+	return false;
+}
+
+// one [destX, destY, srcX, srcY, width, height] item of the decode data
+static bool parse_op(json_t *row, int nums[6])
+{
+	size_t j;
+	json_t *n;
+	int cnt = 0;
+
+	if (!json_is_array(row))
+		return false;
+	json_array_foreach(row, j, n) {
+		if (j < 6 && json_is_integer(n))
+			nums[cnt++] = json_integer_value(n);
+		else
+			return false;
+	}
+
+	return (cnt == 6);
+}
+
 int main(int argc, char **argv)
 {
-	json_t *data;
+	json_t *data = NULL;
 	json_error_t jsonerr;
 	struct jc *canvas;
 	int idx;
-	int i, j;
-	json_t *row, *n;
+	size_t i;
+	json_t *row;
 	int drawok;
+	size_t holes;
 
 	while (argc > 1) {
 		int end = 0, wantarg = 0, ch;
@@ -37,8 +219,11 @@ int main(int argc, char **argv)
 				goto usage;
 			}
 		}
+		else if (ch == 'm' && (wantarg++, argc > 2)) mapout = argv[2];
+		else if (ch == 'M' && (wantarg++, argc > 2)) mapin = argv[2];
 		else if (ch == 'r') rflag = 1;
 		else if (ch == 's') strict = 1;
+		else if (ch == 'V') verify = 1;
 		else if (ch == '-') end = 1;
 		else {
 			if (wantarg)
@@ -60,37 +245,74 @@ usage:
 		    "usage: scramble [options] <infile> <outfile>\n"
 		    "options:\n"
 		    "    -c WIDTHxHEIGHT  set dimensions of the output image\n"
-		    "    -r               apply the operations in reverse\n"
+		    "    -r               undo the operations: draw every block back where it\n"
+		    "                     came from (blocks the input doesn't have are gray)\n"
+		    "    -m MAPFILE       write where each block of the output came from\n"
+		    "    -M MAPFILE       draw using a map written by -m instead of reading\n"
+		    "                     operations from stdin\n"
 		    "    -s               strict - exit with status 1 if any drawimage calls fail\n"
+		    "                     (output blocks left gray by -r are only warned about)\n"
 		    "    -0               no operations, just copy the image (for benchmarking)\n"
+		    "    -V               (with -0) check that the copy has the same coefficients\n"
+		    "                     as the input, delete it if not\n"
 		    );
 		return 1;
 	}
 
+	if (verify && (!zeroflag || width != -1 || height != -1)) {
+		fprintf(stderr, "scramble: -V only works with -0 and no -c\n");
+		goto usage;
+	}
+	if (zeroflag && (mapin || mapout || rflag)) {
+		fprintf(stderr, "scramble: -0 doesn't work with -m, -M or -r\n");
+		goto usage;
+	}
+
 	if (zeroflag) {
+		uint64_t inhash, outhash;
+		char errmsg[JMSG_LENGTH_MAX];
+
 		canvas = jc_new(argv[2], width, height);
-		idx = jc_add_image(canvas, argv[1]);
-		jc_drawimage(canvas, idx, 0, 0, 0, 0, -1, -1);
-		if (!jc_save_and_free(canvas)) {
-			fprintf(stderr, "scramble: jc_save_and_free failed\n");
+		if (!canvas) {
+			fprintf(stderr, "scramble: jc_new failed\n");
 			return 1;
 		}
+		if ((idx = jc_add_image(canvas, argv[1])) == -1 ||
+		    !jc_drawimage(canvas, idx, 0, 0, 0, 0, -1, -1) ||
+		    !jc_save(canvas)) {
+			fprintf(stderr, "scramble: %s\n", jc_get_error(canvas));
+			jc_free(canvas);
+			return 1;
+		}
+		jc_free(canvas);
+		if (verify) {
+			if (!jhash_file(argv[1], &inhash, errmsg) || !jhash_file(argv[2], &outhash, errmsg) ||
+			    inhash != outhash) {
+				if (errmsg[0])
+					fprintf(stderr, "scramble: %s\n", errmsg);
+				fprintf(stderr, "scramble: verification failed, removing \"%s\"\n", argv[2]);
+				remove(argv[2]);
+				return 1;
+			}
+		}
 		return 0;
 	}
 
+	if (!mapin) {
 #if !defined(_WIN32)
-	if (isatty(STDIN_FILENO))
-		fprintf(stderr, "(reading decode data from stdin)\n");
+		if (isatty(STDIN_FILENO))
+			fprintf(stderr, "(reading decode data from stdin)\n");
 #endif
 
-	data = json_loadf(stdin, 0, &jsonerr);
-	if (!data) {
-		fprintf(stderr, "scramble: json parse error: %s\n", jsonerr.text);
-		return 1;
-	}
-	if (!json_is_array(data)) {
-		fprintf(stderr, "scramble: input is not a json array\n");
-		return 1;
+		data = json_loadf(stdin, 0, &jsonerr);
+		if (!data) {
+			fprintf(stderr, "scramble: json parse error: %s\n", jsonerr.text);
+			return 1;
+		}
+		if (!json_is_array(data)) {
+			fprintf(stderr, "scramble: input is not a json array\n");
+			return 1;
+		}
 	}
 
 	canvas = jc_new(argv[2], width, height);
@@ -101,48 +323,121 @@ usage:
 
 	idx = jc_add_image(canvas, argv[1]);
 	if (idx == -1) {
-		fprintf(stderr, "scramble: jc_add_image failed\n");
+		fprintf(stderr, "scramble: %s\n", jc_get_error(canvas));
 		return 1;
 	}
 
 	drawok = 1;
-	json_array_foreach(data, i, row) {
-		int nums[6] = {0};
-		int i = 0;
-		json_array_foreach(row, j, n) {
-			if (j < 6 && json_is_integer(n))
-				nums[i++] = json_integer_value(n);
-			else
+	holes = 0;
+	if (!mapin && !rflag) {
+		json_array_foreach(data, i, row) {
+			int nums[6] = {0};
+
+			if (!parse_op(row, nums))
 				goto typeerr;
+
+			drawok &= jc_drawimage(canvas, idx,
+			    nums[0], nums[1], nums[2], nums[3], nums[4], nums[5]);
+		}
+		if (json_array_size(data) == 0)
+			drawok &= jc_drawimage(canvas, idx, 0, 0, 0, 0, -1, -1);
+	} else {
+		// the operations (or the map) as one block map, drawn with a
+		// single jc_drawmap(). to undo them it's turned around, which
+		// is exact even when they overlap
+		struct jc_info_struct srcinfo, destinfo;
+		struct map fwd, m;
+		unsigned sw, sh, dw, dh;
+
+		jc_get_info(canvas, idx, &srcinfo);
+		jc_get_info(canvas, JC_SELF, &destinfo);
+		sw = srcinfo.data_width/srcinfo.block_width;
+		sh = srcinfo.data_height/srcinfo.block_height;
+		dw = destinfo.data_width/destinfo.block_width;
+		dh = destinfo.data_height/destinfo.block_height;
+
+		if (mapin) {
+			if (!map_load(&fwd, &srcinfo, mapin, idx))
+				return 1;
+		} else {
+			// (-r) the operations made an image the size of our input
+			// out of one the size of our output
+			if (!map_alloc(&fwd, sw, sh)) {
+				fprintf(stderr, "scramble: out of memory\n");
+				return 1;
+			}
+			json_array_foreach(data, i, row) {
+				int nums[6] = {0};
+
+				if (!parse_op(row, nums))
+					goto typeerr;
+
+				drawok &= map_drawimage(&fwd, dw, dh, &srcinfo, nums, idx);
+			}
+			if (json_array_size(data) == 0)
+				drawok &= map_drawimage(&fwd, dw, dh, &srcinfo, (int[6]){0, 0, 0, 0, -1, -1}, idx);
 		}
-		if (i != 6)
-			goto typeerr;
 
 		if (rflag) {
-			int tmp;
-			tmp = nums[0]; nums[0] = nums[2]; nums[2] = tmp;
-			tmp = nums[1]; nums[1] = nums[3]; nums[3] = tmp;
+			if (!map_invert(&fwd, &m, dw, dh))
+				return 1;
+			free(fwd.e);
+		} else {
+			m = fwd;
 		}
 
-		drawok &= jc_drawimage(canvas, idx,
-		    nums[0], nums[1], nums[2], nums[3], nums[4], nums[5]);
+		if (m.w != dw || m.h != dh) {
+			fprintf(stderr, "scramble: the map is %ux%u blocks but the output is %ux%u\n",
+			    m.w, m.h, dw, dh);
+			return 1;
+		}
+		// blocks that nothing was drawn to (with -r, the ones the
+		// operations dropped) are left gray. that isn't a failed draw,
+		// so it's only a warning even with -s
+		for (i = 0; i < (size_t)m.w*m.h; i++) {
+			if (m.e[i].img == -1) {
+				m.e[i].img = JC_BLANK;
+				holes++;
+			}
+		}
 
-		continue;
-typeerr:
-		fprintf(stderr, "scramble: bad decode data: item at index %d has wrong type or length\n", i);
-		return 1;
+		if (!jc_drawmap(canvas, m.e, (size_t)m.w*m.h)) {
+			fprintf(stderr, "scramble: %s\n", jc_get_error(canvas));
+			return 1;
+		}
+		free(m.e);
 	}
-	if (json_array_size(data) == 0)
-		drawok &= jc_drawimage(canvas, idx, 0, 0, 0, 0, -1, -1);
 
 	if (!drawok)
 		fprintf(stderr, "scramble: %s: one or more jc_drawimage calls failed\n",
 		    (strict) ? "error" : "warning");
+	if (holes)
+		fprintf(stderr, "scramble: warning: %zu blocks of the output have nothing to draw from\n", holes);
+
+	if (mapout) {
+		struct jc_info_struct info;
+		struct map m;
 
-	if (!jc_save_and_free(canvas)) {
-		fprintf(stderr, "scramble: jc_save_and_free failed\n");
+		jc_get_info(canvas, JC_SELF, &info);
+		if (!map_alloc(&m, info.data_width/info.block_width, info.data_height/info.block_height)) {
+			fprintf(stderr, "scramble: out of memory\n");
+			return 1;
+		}
+		if (!jc_get_map(canvas, m.e, (size_t)m.w*m.h)) {
+			fprintf(stderr, "scramble: %s\n", jc_get_error(canvas));
+			return 1;
+		}
+		if (!map_save(&m, &info, mapout))
+			return 1;
+		free(m.e);
+	}
+
+	if (!jc_save(canvas)) {
+		fprintf(stderr, "scramble: %s\n", jc_get_error(canvas));
+		jc_free(canvas);
 		return 1;
 	}
+	jc_free(canvas);
 
 	json_decref(data);
 
@@ -150,4 +445,7 @@ typeerr:
 		return 1;
 
 	return 0;
+typeerr:
+	fprintf(stderr, "scramble: bad decode data: item at index %zu has wrong type or length\n", i);
+	return 1;
 }
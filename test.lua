@@ -4,6 +4,7 @@ ffi.cdef([[
 
 enum jc_special_idx {
 	JC_SELF = -2,
+	JC_BLANK = -3,
 };
 
 struct jc_info_struct {
@@ -18,17 +19,74 @@ struct jc_info_struct {
 };
 
 struct jc *jc_new(const char *savepath, int w, int h);
+struct jc *jc_new_mem(int w, int h);
+bool jc_set_spill(struct jc *self, const char *dir, size_t limit);
+bool jc_set_memory_budget(struct jc *self, size_t budget);
+bool jc_set_resample_chroma(struct jc *self, bool enable);
 int jc_add_image(struct jc *self, const char *path);
+int jc_add_image_mem(struct jc *self, const void *buf, size_t size);
+int jc_add_image_async(struct jc *self, const char *path);
 bool jc_get_info(struct jc *self, int idx, struct jc_info_struct *info_out);
 bool jc_drawimage(struct jc *self, int idx,
 	unsigned destX, unsigned destY,
 	unsigned srcX, unsigned srcY,
 	int width, int height);
+
+struct jc_map_entry {
+	int img;
+	int src_x;
+	int src_y;
+};
+bool jc_get_map(struct jc *self, struct jc_map_entry *out, size_t cnt);
+bool jc_drawmap(struct jc *self, const struct jc_map_entry *map, size_t cnt);
+
+bool jc_save(struct jc *self);
+void jc_free(struct jc *self);
 bool jc_save_and_free(struct jc *self);
 
+struct jc_variant {
+	const char *path;
+	bool optimize;
+	bool progressive;
+	bool grayscale;
+	unsigned char *buf;
+	size_t size;
+};
+bool jc_save_variants(struct jc *self, struct jc_variant *variants, size_t cnt);
+bool jc_save_variants_and_free(struct jc *self, struct jc_variant *variants, size_t cnt);
+unsigned char *jc_take_output(struct jc *self, size_t *size);
+
+const char *jc_get_error(struct jc *self);
+
+void free(void *ptr);
+
+]])
+
+
+ffi.cdef([[
+
+enum jcmp_status {
+	jcmp_same = 0,
+	jcmp_differ = 1,
+	jcmp_error = 2,
+};
+struct jcmp_result {
+	int component;
+	unsigned x;
+	unsigned y;
+	char msg[200];
+};
+enum jcmp_status jcmp(const char *path1, const char *path2, struct jcmp_result *result);
+enum jcmp_status jcmp_area(const char *path1, const char *path2,
+	unsigned w, unsigned h,
+	unsigned x1, unsigned y1,
+	unsigned x2, unsigned y2,
+	struct jcmp_result *result);
+
 ]])
 
 ffi.load('./jcanvas.so', true)
+ffi.load('./jcmp.so', true)
 
 local C = ffi.C
 
@@ -90,6 +148,47 @@ local check_area_equals = function (file1, file2, w, h,
 	return rv == 0 or rv == true
 end
 
+-- like check_area_equals, but the decoded pixels only have to be within a
+-- tolerance: mean and peak absolute error, 0-255
+local check_area_close = function (file1, file2, w, h,
+                                   f1x, f1y,
+                                   f2x, f2y,
+                                   max_mean, max_peak)
+	add_tmp_file('close1.png', 'close2.png')
+	local rv = os.execute([[
+	file1=]]..file1..[[;
+	file2=]]..file2..[[;
+	w=]]..w..[[ h=]]..h..[[;
+	f1x=]]..f1x..[[ f1y=]]..f1y..[[;
+	f2x=]]..f2x..[[ f2y=]]..f2y..[[;
+	convert -crop ${w}x${h}+${f1x}+${f1y} +repage $file1 close1.png
+	convert -crop ${w}x${h}+${f2x}+${f2y} +repage $file2 close2.png
+	# prints "absolute (normalized)"
+	mae=$(compare -metric MAE close1.png close2.png null: 2>&1 | sed -n 's/.*(\(.*\)).*/\1/p')
+	pae=$(compare -metric PAE close1.png close2.png null: 2>&1 | sed -n 's/.*(\(.*\)).*/\1/p')
+	exec awk -v mae="$mae" -v pae="$pae" 'BEGIN { exit !(mae != "" && pae != "" &&
+	    mae*255 <= ]]..max_mean..[[ && pae*255 <= ]]..max_peak..[[) }'
+	]])
+	return rv == 0 or rv == true
+end
+
+-- same arguments as check_area_equals, but compares the dct coefficients
+-- without decoding. the area has to be block aligned (see jcmp.h)
+local check_blocks_equal = function (file1, file2, w, h,
+                                     f1x, f1y,
+                                     f2x, f2y)
+	f1x = f1x or 0
+	f1y = f1y or 0
+	f2x = f2x or f1x
+	f2y = f2y or f1y
+	local res = ffi.new('struct jcmp_result')
+	local rv = C.jcmp_area(file1, file2, w, h, f1x, f1y, f2x, f2y, res)
+	if rv == C.jcmp_error then
+		error(ffi.string(res.msg))
+	end
+	return rv == C.jcmp_same
+end
+
 local check_md5_equals = function (file1, file2)
 	local rv = os.execute([[
 	file1=]]..file1..[[;
@@ -510,3 +609,320 @@ end
 end
 
 delete_tmp_files()
+
+--
+-- test a canvas bigger than one tile of the block map (64x64 blocks)
+--
+do
+	print('big canvas')
+
+	add_tmp_file('big_src.jpg', 'big_out.jpg')
+	os.execute([[
+	exec convert -define jpeg:optimize-coding=off -sampling-factor 1x1 -size 600x600 ]]..mono..[[ big_src.jpg
+	]])
+
+	-- the second time with a memory budget too small for the source, so
+	-- it's only loaded when saving, and the third with the output spilled
+	-- to a temp file. the output should be the same
+	for i, name in ipairs({'big_out.jpg', 'big_out_budget.jpg', 'big_out_spill.jpg'}) do
+		add_tmp_file(name)
+		local out = C.jc_new(name, 1800, 1200) assert(out ~= nil)
+		assert(C.jc_set_memory_budget(out, i == 2 and 1 or 0))
+		assert(C.jc_set_spill(out, i == 3 and '.' or nil, 1))
+		assert(0 == C.jc_add_image(out, 'big_src.jpg'))
+		-- 3x2 copies, the middle ones overlapping the others a bit
+		for y = 0, 1 do
+			for x = 0, 2 do
+				assert(C.jc_drawimage(out, 0, x*600, y*600, 0, 0, 600, 600))
+			end
+		end
+		assert(C.jc_drawimage(out, 0, 592, 296, 0, 0, 600, 600))
+		-- moves the top left copy right by one block, across a tile edge
+		assert(C.jc_drawimage(out, C.JC_SELF, 8, 0, 0, 0, 592, 600))
+		assert(C.jc_save_and_free(out))
+	end
+	assert(check_md5_equals('big_out.jpg', 'big_out_budget.jpg'))
+	assert(check_md5_equals('big_out.jpg', 'big_out_spill.jpg'))
+
+	assert(check_blocks_equal('big_out.jpg', 'big_src.jpg', 592, 600, 8, 0, 0, 0))
+	assert(check_blocks_equal('big_out.jpg', 'big_src.jpg', 592, 600, 600, 296, 8, 0))
+	assert(check_blocks_equal('big_out.jpg', 'big_src.jpg', 600, 600, 1200, 600, 0, 0))
+	assert(check_blocks_equal('big_out.jpg', 'big_src.jpg', 600, 296, 1200, 0, 0, 0))
+
+	-- the parts not covered by the image are filled in with JC_BLANK
+	print('blank')
+	add_tmp_file('blank_out.jpg', 'blank_gray.jpg')
+	os.execute([[
+	exec convert -define jpeg:optimize-coding=off -sampling-factor 1x1 -size 600x600 xc:#808080 blank_gray.jpg
+	]])
+	local out = C.jc_new('blank_out.jpg', 1200, 600) assert(out ~= nil)
+	assert(0 == C.jc_add_image(out, 'big_src.jpg'))
+	assert(C.jc_drawimage(out, C.JC_BLANK, 0, 0, 0, 0, -1, -1))
+	assert(C.jc_drawimage(out, 0, 600, 0, 0, 0, 600, 600))
+	assert(C.jc_save_and_free(out))
+	assert(check_blocks_equal('blank_out.jpg', 'big_src.jpg', 600, 600, 600, 0, 0, 0))
+	assert(check_area_equals('blank_out.jpg', 'blank_gray.jpg', 600, 600, 0, 0, 0, 0))
+
+	-- a canvas drawn with jc_drawmap() from another one's jc_get_map()
+	-- should come out the same
+	print('map')
+	add_tmp_file('map_a.jpg', 'map_b.jpg')
+	local a = C.jc_new('map_a.jpg', 1200, 600) assert(a ~= nil)
+	assert(0 == C.jc_add_image(a, 'big_src.jpg'))
+	assert(C.jc_drawimage(a, C.JC_BLANK, 0, 0, 0, 0, -1, -1))
+	assert(C.jc_drawimage(a, 0, 8, 16, 0, 0, 592, 584))
+	assert(C.jc_drawimage(a, 0, 600, 0, 304, 0, 296, 600))
+	assert(C.jc_drawimage(a, C.JC_SELF, 904, 0, 8, 16, 296, 400))
+	local cnt = (1200/8)*(600/8)
+	local map = ffi.new('struct jc_map_entry[?]', cnt)
+	assert(not C.jc_get_map(a, map, cnt-1))
+	assert(C.jc_get_map(a, map, cnt))
+	assert(map[0].img == C.JC_BLANK)
+	assert(map[1+2*150].img == 0 and map[1+2*150].src_x == 0 and map[1+2*150].src_y == 0)
+	assert(C.jc_save_and_free(a))
+	local b = C.jc_new('map_b.jpg', 1200, 600) assert(b ~= nil)
+	assert(0 == C.jc_add_image(b, 'big_src.jpg'))
+	assert(C.jc_drawmap(b, map, cnt))
+	assert(C.jc_save_and_free(b))
+	assert(check_md5_equals('map_a.jpg', 'map_b.jpg'))
+end
+
+delete_tmp_files()
+
+--
+-- scramble: overlapping operations, undone with -r, and the same through a
+-- map saved with -m and drawn with -M
+--
+do
+	print('scramble -r')
+
+	add_tmp_file('scr_src.jpg', 'scr_ops.json', 'scr_out.jpg', 'scr_map.json',
+	    'scr_undo.jpg', 'scr_out_map.jpg', 'scr_undo_map.jpg')
+	os.execute([[
+	exec convert -define jpeg:optimize-coding=off -sampling-factor 2x2 -quality 90 -size 192x128 ]]..color..[[ scr_src.jpg
+	]])
+
+	-- 16x16 blocks, 12x8 of them. the later ones cover parts of the earlier
+	local ops = {
+		{0, 0, 0, 0, -1, -1},
+		{32, 16, 96, 48, 80, 64},
+		{64, 48, 0, 0, 96, 48},
+		{160, 96, 16, 0, 32, 32},
+	}
+	local parts = {}
+	for i, op in ipairs(ops) do
+		parts[i] = '['..table.concat(op, ',')..']'
+	end
+	local f = assert(io.open('scr_ops.json', 'w'))
+	f:write('['..table.concat(parts, ',')..']')
+	f:close()
+
+	-- which block of the source ends up where
+	local bw, bh = 12, 8
+	local fwd = {}
+	for _, op in ipairs(ops) do
+		local w = op[5] == -1 and bw or op[5]/16
+		local h = op[6] == -1 and bh or op[6]/16
+		for y = 0, h-1 do
+			for x = 0, w-1 do
+				fwd[(op[2]/16+y)*bw + op[1]/16+x] = (op[4]/16+y)*bw + op[3]/16+x
+			end
+		end
+	end
+	local survived = {}
+	for _, src in pairs(fwd) do
+		survived[src] = true
+	end
+	local holes = 0
+	for i = 0, bw*bh-1 do
+		if not survived[i] then
+			holes = holes+1
+		end
+	end
+	assert(holes > 0)
+
+	local run = function (args)
+		local p = io.popen('./scramble '..args..' 2>&1')
+		local out = p:read('*a')
+		p:close()
+		return out
+	end
+	local holes_msg = holes..' blocks of the output have nothing to draw from'
+
+	assert(run('-s -m scr_map.json scr_src.jpg scr_out.jpg < scr_ops.json') == '')
+	-- the holes are only a warning, even with -s
+	assert(run('-s -r scr_out.jpg scr_undo.jpg < scr_ops.json 2>&1; echo $?') ==
+	    'scramble: warning: '..holes_msg..'\n0\n')
+	assert(run('-s -M scr_map.json scr_src.jpg scr_out_map.jpg') == '')
+	assert(run('-r -M scr_map.json scr_out.jpg scr_undo_map.jpg'):find(holes_msg, 1, true))
+
+	for y = 0, bh-1 do
+		for x = 0, bw-1 do
+			local i = y*bw + x
+			assert(check_blocks_equal('scr_out.jpg', 'scr_src.jpg', 16, 16,
+			    x*16, y*16, (fwd[i]%bw)*16, math.floor(fwd[i]/bw)*16))
+			if survived[i] then
+				assert(check_blocks_equal('scr_undo.jpg', 'scr_src.jpg', 16, 16, x*16, y*16))
+			end
+		end
+	end
+	assert(check_blocks_equal('scr_out_map.jpg', 'scr_out.jpg', 192, 128, 0, 0))
+	assert(check_blocks_equal('scr_undo_map.jpg', 'scr_undo.jpg', 192, 128, 0, 0))
+end
+
+delete_tmp_files()
+
+--
+-- atlas: images packed onto more than one page, each placement in the
+-- index checked against its source
+--
+do
+	print('atlas')
+
+	local sizes = {'120x90', '200x64', '64x200', '150x150', '96x40', '40x96', '176x130'}
+	local srcs = {}
+	for i, size in ipairs(sizes) do
+		srcs[i] = 'atlas_src_'..size..'.jpg'
+		add_tmp_file(srcs[i])
+		os.execute([[
+		exec convert -define jpeg:optimize-coding=off -sampling-factor 2x2 -quality 90 -size ]]..size..[[ -seed ]]..i..[[ xc: +noise Random ]]..srcs[i]..[[
+		]])
+	end
+	add_tmp_file('atlas_out.json')
+	local rv = os.execute('exec ./atlas -s 256x256 atlas_out '..table.concat(srcs, ' '))
+	assert(rv == 0 or rv == true)
+
+	local f = assert(io.open('atlas_out.json'))
+	local index = f:read('*a')
+	f:close()
+
+	local pages = {}
+	for page in index:match('"pages":%s*(%b[])'):gmatch('%b{}') do
+		pages[#pages+1] = page:match('"path":%s*"([^"]*)"')
+		add_tmp_file(pages[#pages])
+	end
+	assert(#pages > 1)
+
+	local seen = 0
+	for image in index:match('"images":%s*(%b[])'):gmatch('%b{}') do
+		local num = function (key) return tonumber(image:match('"'..key..'":%s*(%d+)')) end
+		local path = image:match('"path":%s*"([^"]*)"')
+		local page = pages[num('page')+1]
+		assert(path and page)
+		assert(check_blocks_equal(page, path, num('width'), num('height'), num('x'), num('y'), 0, 0))
+		seen = seen+1
+	end
+	assert(seen == #sizes)
+end
+
+delete_tmp_files()
+
+--
+-- images with different chroma subsampling, with jc_set_resample_chroma()
+--
+do
+	print('resample chroma')
+
+	add_tmp_file('rs_420.jpg', 'rs_444.jpg', 'rs_out.jpg')
+	os.execute([[
+	convert -define jpeg:optimize-coding=off -sampling-factor 2x2 -quality 90 -size 256x256 ]]..color..[[ rs_420.jpg
+	exec convert -define jpeg:optimize-coding=off -sampling-factor 1x1 -quality 90 -size 256x256 ]]..color..[[ rs_444.jpg
+	]])
+
+	local out = C.jc_new('rs_out.jpg', 512, 256) assert(out ~= nil)
+	assert(0 == C.jc_add_image(out, 'rs_420.jpg'))
+	assert(C.jc_add_image(out, 'rs_444.jpg') == -1)
+	assert(not C.jc_set_resample_chroma(out, true))
+	C.jc_free(out)
+
+	out = C.jc_new('rs_out.jpg', 512, 256) assert(out ~= nil)
+	assert(C.jc_set_resample_chroma(out, true))
+	assert(0 == C.jc_add_image(out, 'rs_420.jpg'))
+	assert(1 == C.jc_add_image(out, 'rs_444.jpg'))
+	assert(C.jc_drawimage(out, 0, 0, 0, 0, 0, 256, 256))
+	assert(C.jc_drawimage(out, 1, 256, 0, 0, 0, 256, 256))
+	assert(C.jc_save_and_free(out))
+	-- the canvas' own sampling is copied as is
+	assert(check_blocks_equal('rs_out.jpg', 'rs_420.jpg', 256, 256, 0, 0, 0, 0))
+	-- the resampled one should look like its source. (the column of blocks
+	-- next to the other image is left out, the decoder's chroma upsampling
+	-- mixes the two there)
+	assert(check_area_close('rs_out.jpg', 'rs_444.jpg', 240, 256, 272, 0, 16, 0, 3, 16))
+end
+
+delete_tmp_files()
+
+--
+-- jcf: a canvas saved as a jcf and read back as an image
+--
+do
+	print('jcf')
+
+	add_tmp_file('jcf_src.jpg', 'jcf_out.jcf', 'jcf_out.jpg')
+	os.execute([[
+	exec convert -define jpeg:optimize-coding=off -sampling-factor 2x2 -quality 90 -size 200x136 ]]..color..[[ jcf_src.jpg
+	]])
+
+	local out = C.jc_new('jcf_out.jcf', -1, -1) assert(out ~= nil)
+	assert(0 == C.jc_add_image(out, 'jcf_src.jpg'))
+	assert(C.jc_drawimage(out, 0, 0, 0, 0, 0, -1, -1))
+	assert(C.jc_save_and_free(out))
+	assert(check_blocks_equal('jcf_out.jcf', 'jcf_src.jpg', 200, 136, 0, 0, 0, 0))
+
+	out = C.jc_new('jcf_out.jpg', -1, -1) assert(out ~= nil)
+	assert(0 == C.jc_add_image(out, 'jcf_out.jcf'))
+	assert(C.jc_drawimage(out, 0, 0, 0, 0, 0, -1, -1))
+	assert(C.jc_save_and_free(out))
+	assert(check_blocks_equal('jcf_out.jpg', 'jcf_src.jpg', 200, 136, 0, 0, 0, 0))
+	assert(check_area_equals('jcf_out.jpg', 'jcf_src.jpg', 200, 136, 0, 0, 0, 0))
+
+	-- the same coefficients labeled RGB (color_space is at offset 24, JCS_RGB is 2)
+	add_tmp_file('jcf_rgb.jcf')
+	local f = assert(io.open('jcf_out.jcf', 'rb'))
+	local data = f:read('*a')
+	f:close()
+	f = assert(io.open('jcf_rgb.jcf', 'wb'))
+	f:write(data:sub(1, 24), string.char(2, 0, 0, 0), data:sub(29))
+	f:close()
+	assert(not check_blocks_equal('jcf_rgb.jcf', 'jcf_src.jpg', 200, 136, 0, 0, 0, 0))
+end
+
+delete_tmp_files()
+
+--
+-- in memory: a buffer in, the output taken out, plus an async image
+--
+do
+	print('memory')
+
+	add_tmp_file('mem_src.jpg', 'mem_out.jpg')
+	os.execute([[
+	exec convert -define jpeg:optimize-coding=off -sampling-factor 2x2 -quality 90 -size 192x128 ]]..color..[[ mem_src.jpg
+	]])
+
+	local f = assert(io.open('mem_src.jpg', 'rb'))
+	local data = f:read('*a')
+	f:close()
+
+	-- (data has to stay alive until jc_free)
+	local out = C.jc_new_mem(384, 128) assert(out ~= nil)
+	assert(0 == C.jc_add_image_mem(out, data, #data))
+	assert(1 == C.jc_add_image_async(out, 'mem_src.jpg'))
+	assert(C.jc_drawimage(out, 0, 0, 0, 0, 0, -1, -1))
+	assert(C.jc_drawimage(out, 1, 192, 0, 0, 0, -1, -1))
+	assert(C.jc_save(out))
+	local size = ffi.new('size_t[1]')
+	local buf = C.jc_take_output(out, size) assert(buf ~= nil)
+	assert(C.jc_take_output(out, size) == nil)
+	C.jc_free(out)
+
+	f = assert(io.open('mem_out.jpg', 'wb'))
+	f:write(ffi.string(buf, size[0]))
+	f:close()
+	C.free(buf)
+
+	assert(check_blocks_equal('mem_out.jpg', 'mem_src.jpg', 192, 128, 0, 0, 0, 0))
+	assert(check_blocks_equal('mem_out.jpg', 'mem_src.jpg', 192, 128, 192, 0, 0, 0))
+end
+
+delete_tmp_files()
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# smoke test for the python bindings. "make test-python", or
+# python3 test_pyjcanvas.py [image.jpg] from a directory with pyjcanvas and jcmp.so
+
+import array
+import ctypes
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.getcwd())
+import pyjcanvas
+
+class JcmpResult(ctypes.Structure):
+	_fields_ = [
+		("component", ctypes.c_int),
+		("x", ctypes.c_uint),
+		("y", ctypes.c_uint),
+		("msg", ctypes.c_char*200),
+	]
+
+jcmp = ctypes.CDLL("./jcmp.so")
+jcmp.jcmp_area.argtypes = [ctypes.c_char_p, ctypes.c_char_p] + [ctypes.c_uint]*6 + [ctypes.POINTER(JcmpResult)]
+
+def check_blocks_equal(file1, file2, w, h, f1x, f1y, f2x, f2y):
+	res = JcmpResult()
+	rv = jcmp.jcmp_area(file1.encode(), file2.encode(), w, h, f1x, f1y, f2x, f2y, ctypes.byref(res))
+	assert rv != 2, res.msg.decode()
+	return rv == 0
+
+tmpdir = tempfile.TemporaryDirectory()
+
+if len(sys.argv) > 1:
+	src = sys.argv[1]
+else:
+	src = os.path.join(tmpdir.name, "src.jpg")
+	subprocess.run(["convert", "-sampling-factor", "2x2", "-size", "192x128",
+	    "gradient:yellow-blue", src], check=True)
+
+with open(src, "rb") as f:
+	data = f.read()
+
+print("memory")
+
+c = pyjcanvas.Canvas()
+c.__init__() # again, nothing in use
+assert c.add_image(data) == 0
+info = c.get_info(0)
+w, h = info["width"], info["height"]
+
+c = pyjcanvas.Canvas(w*2, h)
+assert c.add_image(data) == 0
+assert c.add_image(src) == 1
+assert c.get_info() == dict(info, width=w*2, data_width=info["data_width"]+w)
+c.drawimage(0, 0, 0)
+c.drawimages(1, array.array("i", [w, 0, 0, 0, -1, -1]))
+out = c.save()
+assert isinstance(out, memoryview) and out.nbytes > 0
+
+outpath = os.path.join(tmpdir.name, "out.jpg")
+with open(outpath, "wb") as f:
+	f.write(out)
+del out
+assert check_blocks_equal(outpath, src, w, h, 0, 0, 0, 0)
+assert check_blocks_equal(outpath, src, w, h, w, 0, 0, 0)
+
+print("path")
+
+outpath2 = os.path.join(tmpdir.name, "out2.jpg")
+c = pyjcanvas.Canvas(path=outpath2)
+assert c.add_image(bytearray(data)) == 0
+c.drawimage(0, 0, 0)
+assert c.save() is None
+assert check_blocks_equal(outpath2, src, w, h, 0, 0, 0, 0)
+
+print("errors")
+
+def raises(exc, fn, *args, **kwargs):
+	try:
+		fn(*args, **kwargs)
+	except exc:
+		return True
+	return False
+
+c = pyjcanvas.Canvas()
+assert raises(pyjcanvas.error, c.add_image, b"not a jpg")
+assert c.add_image(data) == 0
+assert raises(pyjcanvas.error, c.drawimage, 5, 0, 0)
+assert raises(ValueError, c.drawimages, 0, array.array("i", [0]*5))
+assert raises(ValueError, c.drawimages, 0, array.array("h", [0]*6))
+c.drawimage(0, 0, 0)
+c.save()
+assert raises(pyjcanvas.error, c.save)
+assert raises(pyjcanvas.error, c.add_image, data)
+assert raises(ValueError, pyjcanvas.Canvas, memory_budget=-1)
+
+print("ok")
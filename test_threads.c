@@ -0,0 +1,484 @@
+// stress test for using the libraries from many threads at once
+// makes some images in a temporary directory, works out the expected results
+// on one thread and then checks that every thread gets the same ones
+// build with "make test-threads" (uses -fsanitize=thread)
+
+#include "isgrayscale.h"
+#include "jcanvas.h"
+#include "jresave.h"
+#include "jthumb.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+
+#define NTHREADS 8
+#define ROUNDS 10
+
+struct image {
+	const char *name;
+	int w, h;
+	int components; // 1 or 3
+	int hs, vs; // luma sampling factors
+	bool color; // chroma that isgrayscale should notice
+
+	char path[256];
+
+	enum grayscale_status gray;
+	unsigned char *resaved; // -optimize -progressive
+	size_t resaved_size;
+	unsigned char *halved; // -halve -optimize
+	size_t halved_size;
+	unsigned char *canvas; // copied with jcanvas
+	size_t canvas_size;
+	unsigned char *thumb; // 1/16 scale jpg
+	size_t thumb_size;
+};
+
+static struct image images[] = {
+	{ "c420.jpg", 197, 131, 3, 2, 2, true },
+	{ "c444.jpg", 64, 200, 3, 1, 1, true },
+	{ "grayrgb.jpg", 160, 160, 3, 2, 1, false },
+	{ "gray.jpg", 99, 45, 1, 1, 1, false },
+};
+#define NIMAGES (sizeof(images)/sizeof(images[0]))
+
+static char tmpdir[] = "/tmp/test_threads.XXXXXX";
+static char badpath[256];
+
+static const struct resave_opts resave_opts = {
+	.optimize = 1,
+	.progressive = 1,
+};
+
+static const struct resave_opts halve_opts = {
+	.optimize = 1,
+	.halve = 1,
+};
+
+static const struct resave_opts jcf_opts = {
+	.jcf = 1,
+};
+
+static const struct thumb_opts thumb_opts = {
+	.scale = 16,
+};
+
+static unsigned failures;
+
+__attribute__((format(printf, 1, 2)))
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	flockfile(stderr);
+	fprintf(stderr, "test_threads: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	funlockfile(stderr);
+
+	__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+}
+
+// -----------------------------------------------------------------------------
+
+static bool write_image(struct image *img)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	JSAMPROW row;
+	FILE *f;
+
+	if (!(f = fopen(img->path, "w")))
+		return false;
+	if (!(row = malloc(img->w*img->components))) {
+		fclose(f);
+		return false;
+	}
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, f);
+
+	cinfo.image_width = img->w;
+	cinfo.image_height = img->h;
+	cinfo.input_components = img->components;
+	cinfo.in_color_space = (img->components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 90, TRUE);
+	cinfo.comp_info[0].h_samp_factor = img->hs;
+	cinfo.comp_info[0].v_samp_factor = img->vs;
+
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		int y = cinfo.next_scanline;
+
+		for (int x = 0; x < img->w; x++) {
+			int v = (x*7 + y*3 + (x*y)%31) & 0xff;
+
+			if (img->components == 1) {
+				row[x] = v;
+			} else {
+				row[x*3+0] = v;
+				row[x*3+1] = (img->color) ? 255-v : v;
+				row[x*3+2] = (img->color) ? (x*13)&0xff : v;
+			}
+		}
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	free(row);
+
+	return (fclose(f) == 0);
+}
+
+static bool read_file(const char *path, unsigned char **buf, size_t *size)
+{
+	long len;
+	FILE *f;
+
+	*buf = NULL;
+	if (!(f = fopen(path, "r")))
+		return false;
+	if (fseek(f, 0, SEEK_END) == -1 || (len = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) == -1 ||
+	    !(*buf = malloc(len ? len : 1)) ||
+	    fread(*buf, 1, len, f) != (size_t)len) {
+		free(*buf);
+		*buf = NULL;
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	*size = len;
+
+	return true;
+}
+
+static bool same_file(const char *path, const unsigned char *want, size_t want_size)
+{
+	unsigned char *buf;
+	size_t size;
+	bool ok;
+
+	if (!read_file(path, &buf, &size))
+		return false;
+	ok = (size == want_size && memcmp(buf, want, size) == 0);
+	free(buf);
+
+	return ok;
+}
+
+static bool copy_with_jcanvas(const char *inpath, const char *outpath, bool async)
+{
+	struct jc *jc;
+	int idx;
+	bool ok;
+
+	if (!(jc = jc_new(outpath, -1, -1)))
+		return false;
+	ok = ((idx = (async) ? jc_add_image_async(jc, inpath) : jc_add_image(jc, inpath)) != -1 &&
+	    jc_drawimage(jc, idx, 0, 0, 0, 0, -1, -1) &&
+	    jc_save(jc));
+	if (!ok)
+		fail("%s: jcanvas: %s", inpath, jc_get_error(jc));
+	jc_free(jc);
+
+	return ok;
+}
+
+// the canvas again as it is, and like resave_opts. both should come out the
+// same as the references
+static void check_jcanvas_variants(const struct image *img, const char *outpath, const char *varpath)
+{
+	struct jc_variant variants[] = {
+		{ .path = NULL },
+		{ .path = varpath, .optimize = 1, .progressive = 1 },
+	};
+	struct jc *jc;
+	int idx;
+
+	if (!(jc = jc_new(outpath, -1, -1))) {
+		fail("jc_new failed");
+		return;
+	}
+	if ((idx = jc_add_image(jc, img->path)) == -1 ||
+	    !jc_drawimage(jc, idx, 0, 0, 0, 0, -1, -1) ||
+	    !jc_save_variants_and_free(jc, variants, 2)) {
+		fail("%s: jcanvas variants: %s", img->name, jc_get_error(jc));
+		return;
+	}
+
+	if (!same_file(outpath, img->canvas, img->canvas_size))
+		fail("%s: jcanvas output differs (variants)", img->name);
+	if (variants[0].size != img->canvas_size || memcmp(variants[0].buf, img->canvas, img->canvas_size) != 0)
+		fail("%s: jcanvas variant in memory differs", img->name);
+	if (!same_file(varpath, img->resaved, img->resaved_size))
+		fail("%s: jcanvas progressive variant differs", img->name);
+	free(variants[0].buf);
+	unlink(varpath);
+}
+
+// -----------------------------------------------------------------------------
+
+static bool make_references(void)
+{
+	struct resave_ctx *ctx;
+	char path[256];
+
+	if (!(ctx = resave_ctx_new()))
+		return false;
+
+	for (int i = 0; i < NIMAGES; i++) {
+		struct image *img = &images[i];
+		unsigned char *inbuf;
+		const unsigned char *outbuf;
+		size_t insize, outsize;
+
+		img->gray = isgrayscale(img->path);
+		if (img->gray != ((img->color) ? gss_no : gss_yes)) {
+			fail("%s: isgrayscale returned %d", img->name, img->gray);
+			return false;
+		}
+
+		if (!read_file(img->path, &inbuf, &insize) ||
+		    !resave_buf(ctx, inbuf, insize, &outbuf, &outsize, &resave_opts, NULL) ||
+		    !(img->resaved = malloc(outsize))) {
+			fail("%s: resave: %s", img->name, resave_ctx_error(ctx));
+			free(inbuf);
+			return false;
+		}
+		memcpy(img->resaved, outbuf, outsize);
+		img->resaved_size = outsize;
+
+		if (!resave_buf(ctx, inbuf, insize, &outbuf, &outsize, &halve_opts, NULL) ||
+		    !(img->halved = malloc(outsize))) {
+			fail("%s: resave -halve: %s", img->name, resave_ctx_error(ctx));
+			free(inbuf);
+			return false;
+		}
+		memcpy(img->halved, outbuf, outsize);
+		img->halved_size = outsize;
+		free(inbuf);
+
+		snprintf(path, sizeof(path), "%s/ref_%s", tmpdir, img->name);
+		if (!copy_with_jcanvas(img->path, path, false) ||
+		    !read_file(path, &img->canvas, &img->canvas_size))
+			return false;
+		unlink(path);
+
+		if (!thumb(img->path, path, &thumb_opts) ||
+		    !read_file(path, &img->thumb, &img->thumb_size)) {
+			fail("%s: thumb: %s", img->name, thumb_error());
+			return false;
+		}
+		unlink(path);
+	}
+
+	resave_ctx_free(ctx);
+
+	return true;
+}
+
+static void *thread_main(void *arg)
+{
+	long tid = (long)arg;
+	struct resave_ctx *ctx;
+	struct isgrayscale_ctx *gctx;
+	char path[256];
+	char varpath[256];
+
+	if (!(ctx = resave_ctx_new()) || !(gctx = isgrayscale_ctx_new())) {
+		fail("thread %ld: couldn't allocate contexts", tid);
+		resave_ctx_free(ctx);
+		return NULL;
+	}
+
+	for (int round = 0; round < ROUNDS; round++) {
+		for (int k = 0; k < NIMAGES; k++) {
+			// different threads start from different images
+			struct image *img = &images[(k+tid) % NIMAGES];
+			unsigned char *inbuf, *jcfbuf = NULL;
+			const unsigned char *outbuf;
+			size_t insize, outsize, jcfsize;
+			enum grayscale_status gray;
+			struct jc *jc;
+			// the first two like resave_opts
+			struct resave_variant variants[] = {
+				{ .outpath = NULL, .optimize = 1, .progressive = 1 },
+				{ .outpath = varpath, .optimize = 1, .progressive = 1 },
+				{ .outpath = NULL, .grayscale = 1 },
+			};
+
+			if ((gray = isgrayscale(img->path)) != img->gray)
+				fail("%s: isgrayscale returned %d, expected %d", img->name, gray, img->gray);
+
+			if (!read_file(img->path, &inbuf, &insize)) {
+				fail("%s: read failed", img->name);
+				continue;
+			}
+			// one context, files and buffers in turn
+			if ((gray = isgrayscale_ctx_check(gctx, img->path)) != img->gray ||
+			    (gray = isgrayscale_ctx_check_buf(gctx, inbuf, insize)) != img->gray)
+				fail("%s: isgrayscale_ctx returned %d, expected %d (\"%s\")",
+				    img->name, gray, img->gray, isgrayscale_ctx_error(gctx));
+			if (!resave_buf(ctx, inbuf, insize, &outbuf, &outsize, &resave_opts, NULL))
+				fail("%s: resave_buf: %s", img->name, resave_ctx_error(ctx));
+			else if (outsize != img->resaved_size || memcmp(outbuf, img->resaved, outsize) != 0)
+				fail("%s: resave_buf output differs", img->name);
+			if (!resave_buf(ctx, inbuf, insize, &outbuf, &outsize, &halve_opts, NULL))
+				fail("%s: resave_buf -halve: %s", img->name, resave_ctx_error(ctx));
+			else if (outsize != img->halved_size || memcmp(outbuf, img->halved, outsize) != 0)
+				fail("%s: resave_buf -halve output differs", img->name);
+
+			// through a jcf and back should be the same as directly
+			if (!resave_buf(ctx, inbuf, insize, &outbuf, &outsize, &jcf_opts, NULL) ||
+			    !(jcfbuf = malloc(outsize))) {
+				fail("%s: resave_buf to jcf: %s", img->name, resave_ctx_error(ctx));
+			} else {
+				memcpy(jcfbuf, outbuf, outsize);
+				jcfsize = outsize;
+				if (!resave_buf(ctx, jcfbuf, jcfsize, &outbuf, &outsize, &resave_opts, NULL))
+					fail("%s: resave_buf from jcf: %s", img->name, resave_ctx_error(ctx));
+				else if (outsize != img->resaved_size || memcmp(outbuf, img->resaved, outsize) != 0)
+					fail("%s: resave_buf from jcf output differs", img->name);
+			}
+			free(jcfbuf);
+
+			snprintf(path, sizeof(path), "%s/t%ld_%s", tmpdir, tid, img->name);
+			snprintf(varpath, sizeof(varpath), "%s/t%ld_var_%s", tmpdir, tid, img->name);
+
+			if (!resave_ctx_variants(ctx, inbuf, insize, variants, 3))
+				fail("%s: resave_ctx_variants: %s", img->name, resave_ctx_error(ctx));
+			else if (variants[0].outsize != img->resaved_size ||
+			    memcmp(variants[0].outbuf, img->resaved, img->resaved_size) != 0 ||
+			    !same_file(varpath, img->resaved, img->resaved_size))
+				fail("%s: resave_ctx_variants output differs", img->name);
+			free(variants[0].outbuf);
+			free(variants[2].outbuf);
+			unlink(varpath);
+			free(inbuf);
+
+			if (!resave(img->path, path, &resave_opts))
+				fail("%s: resave: %s", img->name, resave_error());
+			else if (!same_file(path, img->resaved, img->resaved_size))
+				fail("%s: resave output differs", img->name);
+
+			if (copy_with_jcanvas(img->path, path, false) &&
+			    !same_file(path, img->canvas, img->canvas_size))
+				fail("%s: jcanvas output differs", img->name);
+			if (copy_with_jcanvas(img->path, path, true) &&
+			    !same_file(path, img->canvas, img->canvas_size))
+				fail("%s: jcanvas output differs (async)", img->name);
+			check_jcanvas_variants(img, path, varpath);
+
+			if (!thumb(img->path, path, &thumb_opts))
+				fail("%s: thumb: %s", img->name, thumb_error());
+			else if (!same_file(path, img->thumb, img->thumb_size))
+				fail("%s: thumb output differs", img->name);
+
+			// errors
+
+			if (isgrayscale(badpath) != gss_error || !*isgrayscale_error())
+				fail("isgrayscale: bad file not reported");
+			if (resave(badpath, path, &resave_opts) || !strstr(resave_error(), "JPEG"))
+				fail("resave: bad file not reported (\"%s\")", resave_error());
+			if (thumb(badpath, path, &thumb_opts) || !strstr(thumb_error(), "JPEG"))
+				fail("thumb: bad file not reported (\"%s\")", thumb_error());
+
+			if ((jc = jc_new(path, -1, -1))) {
+				if (jc_add_image(jc, badpath) != -1 || !strstr(jc_get_error(jc), "JPEG"))
+					fail("jcanvas: bad file not reported (\"%s\")", jc_get_error(jc));
+				if (jc_save(jc) || !*jc_get_error(jc))
+					fail("jcanvas: empty canvas saved");
+				jc_free(jc);
+			} else {
+				fail("jc_new failed");
+			}
+
+			// the bad one is only looked at on a worker
+			if ((jc = jc_new(path, -1, -1))) {
+				if (jc_add_image_async(jc, img->path) != 0 || jc_add_image_async(jc, badpath) != 1)
+					fail("jcanvas: async add failed (\"%s\")", jc_get_error(jc));
+				else if (jc_save(jc) || !strstr(jc_get_error(jc), "JPEG"))
+					fail("jcanvas: bad file not reported by async add (\"%s\")", jc_get_error(jc));
+				jc_free(jc);
+			} else {
+				fail("jc_new failed");
+			}
+
+			unlink(path);
+		}
+	}
+
+	isgrayscale_ctx_free(gctx);
+	resave_ctx_free(ctx);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[NTHREADS];
+	FILE *f;
+	int rv = 1;
+
+	if (!mkdtemp(tmpdir)) {
+		perror("test_threads: mkdtemp");
+		return 1;
+	}
+
+	for (int i = 0; i < NIMAGES; i++) {
+		snprintf(images[i].path, sizeof(images[i].path), "%s/%s", tmpdir, images[i].name);
+		if (!write_image(&images[i])) {
+			fail("%s: couldn't write test image", images[i].name);
+			goto out;
+		}
+	}
+	snprintf(badpath, sizeof(badpath), "%s/bad.jpg", tmpdir);
+	if (!(f = fopen(badpath, "w")) || fputs("not a jpeg\n", f) == EOF || fclose(f) != 0) {
+		fail("couldn't write bad.jpg");
+		goto out;
+	}
+
+	if (!make_references())
+		goto out;
+
+	for (long i = 0; i < NTHREADS; i++) {
+		if (pthread_create(&threads[i], NULL, thread_main, (void *)i) != 0) {
+			fail("pthread_create failed");
+			while (--i >= 0)
+				pthread_join(threads[i], NULL);
+			goto out;
+		}
+	}
+	for (int i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	if (failures == 0) {
+		printf("test_threads: ok (%d threads, %d rounds)\n", NTHREADS, ROUNDS);
+		rv = 0;
+	}
+out:
+	for (int i = 0; i < NIMAGES; i++) {
+		unlink(images[i].path);
+		free(images[i].resaved);
+		free(images[i].halved);
+		free(images[i].canvas);
+		free(images[i].thumb);
+	}
+	unlink(badpath);
+	rmdir(tmpdir);
+
+	return rv;
+}